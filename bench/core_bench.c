@@ -0,0 +1,159 @@
+// Microbenchmarks for the core of shell.c: the parser, the job table,
+// end-to-end command launches and the echo builtin against /bin/echo.
+//
+// Build: make bench (or gcc -O2 -o core_bench bench/core_bench.c)
+// Usage: core_bench [spawn_iterations]
+//
+// One JSON object is printed per measurement so results of different builds
+// can be diffed or loaded into anything that reads JSON lines.
+
+#define main shell_main
+#include "../shell.c"
+#undef main
+
+#ifndef BENCH_BUILD
+#define BENCH_BUILD "dev"
+#endif
+
+void report(const char *bench, const char *variant, long ops, uint64_t ns,
+            const char *unit, double per_sec) {
+  printf(
+      "{\"bench\":\"%s\",\"variant\":\"%s\",\"build\":\"%s\",\"ops\":%ld,"
+      "\"ns_per_op\":%.1f,\"%s_per_sec\":%.0f}\n",
+      bench, variant, BENCH_BUILD, ops, (double)ns / ops, unit, per_sec);
+  fflush(stdout);
+}
+
+void bench_parse() {
+  // tokenizer, quote removal and the per-stage redirect scan, which is what
+  // every command line goes through before anything is started
+  static const char *lines[] = {
+      "ls -la /usr/lib",
+      "grep -n 'some pattern' file.c > out.txt",
+      "cat < input.txt | sort -k2 | uniq -c >> counts.txt",
+      "echo \"a quoted string\" with\\ escapes 'and | ops'",
+      "find . -name '*.c' -newer Makefile | xargs wc -l | sort -n | tail &",
+  };
+  int line_count = sizeof(lines) / sizeof(lines[0]);
+  long iterations = 400000;
+  size_t bytes = 0;
+
+  uint64_t start = monotonic_ns();
+  for (long i = 0; i < iterations; i++) {
+    const char *line = lines[i % line_count];
+    struct token_list tokens = {0};
+    arena_reset(&parse_arena);
+    tokenize(line, &tokens);
+    expand_words(&tokens, false);
+    struct launch cmd = {0};
+    cmd.args = tokens.items;
+    take_redirections(&cmd);
+    bytes += strlen(line);
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+  report("parse", "lines", iterations, elapsed, "lines",
+         iterations / (elapsed / 1e9));
+  report("parse", "bytes", bytes, elapsed, "bytes", bytes / (elapsed / 1e9));
+}
+
+void bench_job_table(int jobs) {
+  // inserts jobs with made up pids, looks every pid up and removes them in
+  // a scattered order, so the free list and both indexes get exercised
+  uint64_t start = monotonic_ns();
+  for (int i = 0; i < jobs; i++) {
+    struct job_control job = {0};
+    job.procs = calloc(1, sizeof(struct job_process));
+    job.procs[0].pid = 1000000 + i;
+    job.procs[0].pidfd = -1;
+    job.proc_count = job.live_count = 1;
+    job.job_pid = job.procs[0].pid;
+    job.command = strdup("bench");
+    set_job_id(add_job(&job));
+  }
+  uint64_t inserted = monotonic_ns();
+
+  long found = 0;
+  for (int i = 0; i < jobs; i++) {
+    int pid = 1000000 + (int)(((long)i * 7919) % jobs);
+    found += find_job_by_pid(pid) != -1;
+  }
+  uint64_t looked_up = monotonic_ns();
+
+  for (int i = 0; i < jobs; i++) {
+    int pid = 1000000 + (int)(((long)i * 104729) % jobs);
+    int slot = find_job_by_pid(pid);
+    if (slot != -1) {
+      remove_job(slot);
+    }
+  }
+  uint64_t removed = monotonic_ns();
+  if (found != jobs || job_count != 0) {
+    fprintf(stderr, "job table bench lost jobs\n");
+    exit(1);
+  }
+
+  char variant[32];
+  snprintf(variant, sizeof(variant), "insert_%d", jobs);
+  report("job_table", variant, jobs, inserted - start, "ops",
+         jobs / ((inserted - start) / 1e9));
+  snprintf(variant, sizeof(variant), "lookup_%d", jobs);
+  report("job_table", variant, jobs, looked_up - inserted, "ops",
+         jobs / ((looked_up - inserted) / 1e9));
+  snprintf(variant, sizeof(variant), "delete_%d", jobs);
+  report("job_table", variant, jobs, removed - looked_up, "ops",
+         jobs / ((removed - looked_up) / 1e9));
+}
+
+void bench_spawn(bool background, int iterations) {
+  // whole command lines through eval, the way a script runs them
+  char line[32];
+  uint64_t start = monotonic_ns();
+  for (int i = 0; i < iterations; i++) {
+    strcpy(line, background ? "/bin/true &" : "/bin/true");
+    eval(line);
+  }
+  while (job_count > 0) {
+    process_events(-1);  // reap the background jobs still running
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+  char variant[32];
+  snprintf(variant, sizeof(variant), "%s_%s", background ? "bg" : "fg",
+           launch_engine == LAUNCH_SPAWN ? "spawn" : "fork");
+  report("spawn", variant, iterations, elapsed, "ops",
+         iterations / (elapsed / 1e9));
+}
+
+void bench_echo(const char *command, const char *variant, int iterations) {
+  // one command line per op through eval with its output thrown away, the
+  // echo builtin against /bin/echo started by each engine
+  char line[64];
+  uint64_t start = monotonic_ns();
+  for (int i = 0; i < iterations; i++) {
+    snprintf(line, sizeof(line), "%s hello > /dev/null", command);
+    eval(line);
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+  report("echo", variant, iterations, elapsed, "ops",
+         iterations / (elapsed / 1e9));
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  event_init();
+  builtins_init();
+  show_prompt = false;
+
+  bench_parse();
+  bench_job_table(1000);
+  bench_job_table(100000);
+  for (int engine = LAUNCH_FORK; engine <= LAUNCH_SPAWN; engine++) {
+    launch_engine = engine;
+    bench_spawn(false, iterations);
+    bench_spawn(true, iterations);
+    bench_echo("/bin/echo", engine == LAUNCH_SPAWN ? "bin_echo_spawn"
+                                                    : "bin_echo_fork",
+               iterations);
+  }
+  bench_echo("echo", "builtin", iterations);
+  return 0;
+}
@@ -0,0 +1,67 @@
+// Compares the fork and posix_spawn launch engines of shell.c.
+//
+// Build: make bench (or gcc -O2 -o launch_bench bench/launch_bench.c)
+// Usage: launch_bench [iterations] [ballast_mb]
+//
+// Each iteration launches /bin/true through launch() and reaps it. The
+// ballast is touched memory that makes the shell look bigger, which is what
+// fork() pays for when it copies page tables. One JSON object is printed per
+// engine and ballast size.
+
+#define main shell_main
+#include "../shell.c"
+#undef main
+
+#ifndef BENCH_BUILD
+#define BENCH_BUILD "dev"
+#endif
+
+double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void run(enum launch_engine engine, int iterations, int ballast_mb) {
+  char *args[] = {"true", NULL};
+  struct launch cmd = {0};
+  cmd.args = args;
+  cmd.path = "/bin/true";
+
+  launch_engine = engine;
+  double start = now_ns();
+  for (int i = 0; i < iterations; i++) {
+    int status;
+    pid_t pid = launch(&cmd);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+      fprintf(stderr, "launch failed\n");
+      exit(1);
+    }
+  }
+  double elapsed = now_ns() - start;
+
+  printf(
+      "{\"bench\":\"launch\",\"engine\":\"%s\",\"build\":\"%s\","
+      "\"ballast_mb\":%d,\"iterations\":%d,\"ns_per_op\":%.0f,"
+      "\"ops_per_sec\":%.0f}\n",
+      engine == LAUNCH_SPAWN ? "spawn" : "fork", BENCH_BUILD, ballast_mb,
+      iterations, elapsed / iterations, iterations / (elapsed / 1e9));
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  int ballast_mb = argc > 2 ? atoi(argv[2]) : 256;
+
+  run(LAUNCH_FORK, iterations, 0);
+  run(LAUNCH_SPAWN, iterations, 0);
+
+  if (ballast_mb > 0) {
+    size_t size = (size_t)ballast_mb << 20;
+    char *ballast = malloc(size);
+    memset(ballast, 1, size);  // fault every page in
+    run(LAUNCH_FORK, iterations, ballast_mb);
+    run(LAUNCH_SPAWN, iterations, ballast_mb);
+    free(ballast);
+  }
+  return 0;
+}
@@ -0,0 +1,461 @@
+// Plays a session recorded with shell --record back against a fresh shell
+// under a pseudo terminal, to stress job control with the same lines and
+// signals that came with an incident.
+//
+// Build: make bench/replay (or gcc -O2 -o replay bench/replay.c)
+// Usage: replay [-s speed] [-S shell] [-t drain_seconds] recording
+//
+// Lines are typed at their recorded times divided by speed (1, 10, 100...),
+// and SIGINT and SIGTSTP are typed as CTRL + C and CTRL + Z, so the terminal
+// sends them to whatever is in the foreground just like in the session.
+// SIGCHLD is what the children did and is only counted. A line's latency
+// runs from typing it to the next prompt. Wherever jobs printed a table in
+// the recording, the table the replay printed is compared with it, without
+// the pids. One JSON object with the results goes to stdout, divergences go
+// to stderr and make the exit status 1.
+//
+// Nothing leaves the machine: the shell runs with no rc file and an empty
+// history in a temporary directory that is removed afterwards.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BENCH_BUILD
+#define BENCH_BUILD "dev"
+#endif
+
+#define PROMPT "prompt > "  // what shell.c prints when it wants a line
+
+enum event_kind { EV_LINE, EV_MORE, EV_INT, EV_TSTP, EV_CHLD, EV_JOBS, EV_JOB };
+
+struct event {
+  double at;  // seconds into the recording
+  enum event_kind kind;
+  char *text;  // the line, or the job for EV_JOB
+  int count;   // rows for EV_JOBS, the sender of EV_INT and EV_TSTP
+};
+
+struct command {
+  struct event *line;
+  double sent;
+  double answered;  // 0 until its prompt came back
+  char *output;     // what it printed before that prompt
+  struct event *table;  // the recorded jobs table, NULL if there is none
+};
+
+struct event *events;
+int event_count;
+struct command *commands;
+int command_count;
+int answered_count;  // commands answered so far, in order
+int prompts;         // every prompt seen
+
+int master_fd;
+pid_t shell_pid;
+bool shell_gone;
+char *out_buf;  // terminal output since the last prompt
+size_t out_len;
+size_t out_cap;
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void read_recording(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    exit(2);
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int capacity = 0;
+  while ((len = getline(&line, &cap, file)) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    char *kind = strchr(line, '\t');
+    char *text = kind ? strchr(kind + 1, '\t') : NULL;
+    if (line[0] == '#' || text == NULL) {
+      continue;
+    }
+    *kind++ = '\0';
+    *text++ = '\0';
+    struct event event = {atof(line), EV_LINE, NULL, 0};
+    if (strcmp(kind, "line") == 0 || strcmp(kind, "more") == 0) {
+      event.kind = kind[0] == 'l' ? EV_LINE : EV_MORE;
+      event.text = strdup(text);
+    } else if (strcmp(kind, "signal") == 0 || strcmp(kind, "terminal") == 0) {
+      // the sender of a signal the shell got, 0 when it was the terminal
+      char *sender = strchr(text, '\t');
+      event.count = kind[0] == 's' && sender ? atoi(sender + 1) : 0;
+      event.kind = strncmp(text, "INT", 3) == 0    ? EV_INT
+                   : strncmp(text, "TSTP", 4) == 0 ? EV_TSTP
+                                                   : EV_CHLD;
+    } else if (strcmp(kind, "jobs") == 0) {
+      event.kind = EV_JOBS;
+      event.count = atoi(text);
+    } else if (strcmp(kind, "job") == 0) {
+      event.kind = EV_JOB;
+      event.text = strdup(text);
+    } else {
+      continue;  // from a newer shell, not something to replay
+    }
+    if (event_count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      events = realloc(events, capacity * sizeof(struct event));
+    }
+    events[event_count++] = event;
+  }
+  free(line);
+  fclose(file);
+
+  // one command per line, holding the table jobs printed for it
+  commands = calloc(event_count + 1, sizeof(struct command));
+  for (int i = 0; i < event_count; i++) {
+    if (events[i].kind == EV_LINE) {
+      commands[command_count++].line = &events[i];
+    } else if (events[i].kind == EV_JOBS && command_count > 0) {
+      commands[command_count - 1].table = &events[i];
+    }
+  }
+}
+
+void start_shell(const char *shell, const char *history) {
+  // the shell gets a terminal of its own and leads its session, so it does
+  // job control on it the way it does on a real one
+  master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0) {
+    perror("posix_openpt");
+    exit(2);
+  }
+  char *name = ptsname(master_fd);
+  shell_pid = fork();
+  if (shell_pid < 0) {
+    perror("fork");
+    exit(2);
+  } else if (shell_pid == 0) {
+    setsid();
+    int slave = open(name, O_RDWR);
+    if (slave < 0 || ioctl(slave, TIOCSCTTY, 0) < 0) {
+      _exit(127);
+    }
+    // no echo, the output is the shell's alone; CTRL + C must not flush
+    // lines typed ahead at higher speeds
+    struct termios mode;
+    tcgetattr(slave, &mode);
+    mode.c_lflag &= ~(ECHO | ECHONL);
+    mode.c_lflag |= NOFLSH;
+    tcsetattr(slave, TCSANOW, &mode);
+    struct winsize size = {.ws_row = 24, .ws_col = 80};
+    ioctl(slave, TIOCSWINSZ, &size);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    if (slave > STDERR_FILENO) {
+      close(slave);
+    }
+    setenv("TERM", "dumb", 1);  // plain lines, no line editor
+    setenv("CSHELL_RC", "", 1);
+    setenv("CSHELL_HISTORY", history, 1);
+    execl(shell, shell, (char *)NULL);
+    _exit(127);
+  }
+}
+
+void kill_session() {
+  // the shell and every job it left behind, which are in process groups
+  // of their own but all in the shell's session
+  kill(shell_pid, SIGKILL);
+  DIR *proc = opendir("/proc");
+  struct dirent *entry;
+  while (proc != NULL && (entry = readdir(proc)) != NULL) {
+    char path[300];
+    snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+    FILE *file = atoi(entry->d_name) > 0 ? fopen(path, "r") : NULL;
+    if (file == NULL) {
+      continue;
+    }
+    // pid (comm) state ppid pgrp session, comm may hold spaces
+    char line[512];
+    char *close = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+    int session;
+    if (close != NULL && sscanf(close + 2, "%*c %*d %*d %d", &session) == 1 &&
+        session == shell_pid) {
+      kill(atoi(entry->d_name), SIGKILL);
+    }
+    fclose(file);
+  }
+  if (proc != NULL) {
+    closedir(proc);
+  }
+}
+
+void take_output(double at) {
+  // everything up to a prompt is the output of the oldest command still
+  // waiting for one; a prompt nobody waits for, such as after CTRL + C at
+  // the prompt, is skipped
+  char *prompt;
+  while ((prompt = memmem(out_buf, out_len, PROMPT, strlen(PROMPT))) != NULL) {
+    size_t len = prompt - out_buf;
+    prompts++;
+    if (answered_count < command_count &&
+        commands[answered_count].sent > 0) {
+      struct command *cmd = &commands[answered_count++];
+      cmd->answered = at;
+      cmd->output = strndup(out_buf, len);
+    }
+    len += strlen(PROMPT);
+    out_len -= len;
+    memmove(out_buf, out_buf + len, out_len);
+  }
+}
+
+void pump(double deadline) {
+  // reads the terminal until deadline
+  double left;
+  while (!shell_gone && (left = deadline - now()) > 0) {
+    struct pollfd pfd = {master_fd, POLLIN, 0};
+    if (poll(&pfd, 1, (int)(left * 1000) + 1) <= 0) {
+      continue;
+    }
+    if (out_len + 4096 > out_cap) {
+      out_cap = out_cap ? out_cap * 2 : 65536;
+      out_buf = realloc(out_buf, out_cap);
+    }
+    ssize_t n = read(master_fd, out_buf + out_len, out_cap - out_len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      shell_gone = true;  // EIO once the shell has closed the terminal
+      break;
+    }
+    out_len += n;
+    take_output(now());
+  }
+}
+
+void type(const char *text, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(master_fd, text, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      shell_gone = true;
+      return;
+    }
+    text += n;
+    len -= n;
+  }
+}
+
+int table_rows(const char *output, char ***rows) {
+  // the [id] lines of what jobs printed, with the (pid) taken out
+  int count = 0;
+  *rows = NULL;
+  const char *line = output;
+  while (line != NULL && *line) {
+    const char *end = strchr(line, '\n');
+    size_t len = end ? (size_t)(end - line) : strlen(line);
+    while (len > 0 && line[len - 1] == '\r') {
+      len--;
+    }
+    const char *close = memchr(line, ']', len);
+    if (line[0] == '[' && close != NULL && close[1] == ' ' && close[2] == '(') {
+      const char *after = memchr(close, ')', len - (close - line));
+      if (after != NULL && after[1] == ' ') {
+        char *row = malloc(len + 1);
+        size_t head = close + 1 - line;
+        memcpy(row, line, head);
+        size_t rest = len - (after + 1 - line);
+        memcpy(row + head, after + 1, rest);
+        row[head + rest] = '\0';
+        *rows = realloc(*rows, (count + 1) * sizeof(char *));
+        (*rows)[count++] = row;
+      }
+    }
+    line = end ? end + 1 : NULL;
+  }
+  return count;
+}
+
+int check_table(struct command *cmd) {
+  // compares the replayed jobs table with the recorded one, prints the
+  // difference and returns 1 if there is one
+  char **rows;
+  int count = table_rows(cmd->output, &rows);
+  struct event *recorded = cmd->table + 1;
+  int expected = cmd->table->count;
+  bool same = count == expected;
+  for (int i = 0; same && i < count; i++) {
+    same = recorded[i].kind == EV_JOB && strcmp(rows[i], recorded[i].text) == 0;
+  }
+  if (!same) {
+    fprintf(stderr, "divergence at %.3fs, %s\n", cmd->line->at,
+            cmd->line->text);
+    for (int i = 0; i < expected && recorded[i].kind == EV_JOB; i++) {
+      fprintf(stderr, "  recorded  %s\n", recorded[i].text);
+    }
+    for (int i = 0; i < count; i++) {
+      fprintf(stderr, "  replayed  %s\n", rows[i]);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    free(rows[i]);
+  }
+  free(rows);
+  return !same;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, int count, double p) {
+  return count ? sorted[(int)((count - 1) * p + 0.5)] : 0;
+}
+
+int main(int argc, char **argv) {
+  double speed = 1;
+  double drain = 10;
+  const char *shell = "./shell";
+  int option;
+  while ((option = getopt(argc, argv, "s:S:t:")) != -1) {
+    if (option == 's') {
+      speed = atof(optarg);
+    } else if (option == 'S') {
+      shell = optarg;
+    } else if (option == 't') {
+      drain = atof(optarg);
+    }
+  }
+  if (optind != argc - 1 || speed <= 0) {
+    fprintf(stderr,
+            "usage: replay [-s speed] [-S shell] [-t drain_seconds] "
+            "recording\n");
+    return 2;
+  }
+  const char *recording = argv[optind];
+  read_recording(recording);
+  if (command_count == 0) {
+    fprintf(stderr, "%s: no lines to replay\n", recording);
+    return 2;
+  }
+
+  char dir[] = "/tmp/cshell-replay-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 2;
+  }
+  char history[sizeof(dir) + 16];
+  snprintf(history, sizeof(history), "%s/history", dir);
+  signal(SIGPIPE, SIG_IGN);
+  start_shell(shell, history);
+
+  // the clock starts at the first prompt, with the first event
+  double deadline = now() + 10;
+  while (!shell_gone && prompts == 0 && now() < deadline) {
+    pump(now() + 0.01);
+  }
+  if (prompts == 0) {
+    fprintf(stderr, "%s never showed a prompt\n", shell);
+    kill_session();
+    rmdir(dir);
+    return 2;
+  }
+  double start = now();
+  double first = events[0].at;
+
+  int signals = 0;
+  int children = 0;
+  int sent = 0;
+  for (int i = 0; i < event_count && !shell_gone; i++) {
+    struct event *event = &events[i];
+    pump(start + (event->at - first) / speed);
+    if (event->kind == EV_LINE || event->kind == EV_MORE) {
+      if (event->kind == EV_LINE) {
+        commands[sent++].sent = now();
+      }
+      type(event->text, strlen(event->text));
+      type("\n", 1);
+    } else if (event->kind == EV_INT || event->kind == EV_TSTP) {
+      // what came from the terminal is typed, what a process sent is sent
+      if (event->count != 0) {
+        kill(shell_pid, event->kind == EV_INT ? SIGINT : SIGTSTP);
+      } else {
+        type(event->kind == EV_INT ? "\x03" : "\x1a", 1);
+      }
+      signals++;
+    } else if (event->kind == EV_CHLD) {
+      children++;
+    }
+  }
+
+  // let the last commands come back, then make sure the shell is gone
+  double drain_end = now() + drain;
+  while (!shell_gone && answered_count < sent && now() < drain_end) {
+    pump(now() + 0.05);
+  }
+  double end = answered_count > 0 ? commands[answered_count - 1].answered
+                                  : now();
+  if (!shell_gone) {
+    type("quit\n", 5);
+    pump(now() + 1);
+  }
+  kill_session();
+  waitpid(shell_pid, NULL, 0);
+  unlink(history);
+  rmdir(dir);
+
+  double *latencies = malloc((answered_count + 1) * sizeof(double));
+  int checked = 0;
+  int divergences = 0;
+  for (int i = 0; i < answered_count; i++) {
+    latencies[i] = (commands[i].answered - commands[i].sent) * 1e6;
+    if (commands[i].table != NULL) {
+      checked++;
+      divergences += check_table(&commands[i]);
+    }
+  }
+  for (int i = answered_count; i < sent; i++) {
+    if (commands[i].table != NULL) {
+      fprintf(stderr, "divergence at %.3fs, %s\n  never came back\n",
+              commands[i].line->at, commands[i].line->text);
+      checked++;
+      divergences++;
+    }
+  }
+  qsort(latencies, answered_count, sizeof(double), compare_doubles);
+
+  double seconds = end - start;
+  printf(
+      "{\"bench\":\"replay\",\"build\":\"%s\",\"recording\":\"%s\","
+      "\"speed\":%g,\"commands\":%d,\"answered\":%d,\"signals\":%d,"
+      "\"sigchld\":%d,"
+      "\"seconds\":%.3f,\"commands_per_sec\":%.1f,\"latency_p50_us\":%.0f,"
+      "\"latency_p90_us\":%.0f,\"latency_p99_us\":%.0f,"
+      "\"latency_max_us\":%.0f,\"jobs_checked\":%d,\"divergences\":%d}\n",
+      BENCH_BUILD, recording, speed, sent, answered_count, signals, children,
+      seconds, seconds > 0 ? answered_count / seconds : 0,
+      percentile(latencies, answered_count, 0.5),
+      percentile(latencies, answered_count, 0.9),
+      percentile(latencies, answered_count, 0.99),
+      percentile(latencies, answered_count, 1), checked, divergences);
+  return divergences > 0;
+}
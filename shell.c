@@ -1,738 +1,7134 @@
+#define _GNU_SOURCE  // for strchrnul and other GNU extensions
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>  // for pid_t
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
-#define MAX_PROCESS 56
-#define MAX 80
+#define MAX_EVENTS 16
+#define MAX_PIDFDS 512  // children past this are reaped through SIGCHLD only
 #define DEBUG 0
+#define PROMPT "prompt > "
 
-pid_t foreground_pid = 0;  // process id for current process
+pid_t foreground_pid = 0;  // process group of the foreground job
+pid_t shell_pgid;          // process group the shell runs in
+pid_t job_group = 0;  // in a client's forked line, the group every job joins
+bool interactive;          // stdin is a terminal we do job control on
+void (*interrupt_hook)() = NULL;  // CTRL + C while a builtin is waiting
 
-pid_t child_processes[MAX_PROCESS];  // stores the PID of all child process
-int child_process_num = 0;
-char original[MAX];  // copy of the user input
+char *original;  // the user input, for the job's command
+int last_status = 0;       // exit status of the last command, $?
+bool interrupted = false;  // CTRL + C since the line started, ends loops
+char **positional = NULL;  // arguments of the running function, $1 ...
+int positional_count = 0;
 int job_counter = 1;
-int job_index = 0;
-int max_jobs = 0;  // stores the number of jobs, once hits 5, will error
 bool foreground;   // determines if it is foreground of background
 bool builtin;  // determines if command is builtin or not - used in adding jobs
                // to the array
-bool input_redirect;
 bool printed;
-bool output_redirect;
-bool append;
-char *file;   // file to be opened
-char *file2;  // 2nd file if needed
+
+struct job_process {
+  pid_t pid;
+  int pidfd;  // pidfd watched by the event loop, -1 if none
+  bool done;  // exited or was killed
+};
+
+struct job_usage {
+  struct timespec start;  // CLOCK_MONOTONIC when the job was launched
+  struct timespec end;    // when its last process was reaped, 0 until then
+  struct timeval utime;   // user CPU of the reaped processes
+  struct timeval stime;   // system CPU of the reaped processes
+  long maxrss;            // largest resident set of any process, in KB
+  long nvcsw;             // voluntary context switches
+  long nivcsw;            // involuntary context switches
+};
+
+struct placement {
+  char cpus[64];  // CPU list as given to run --cpus, empty if not set
+  cpu_set_t cpu_set;
+  bool renice;  // --nice was given
+  int nice;
+  char cgroup[NAME_MAX + 1];  // group under the cgroup root, empty if none
+  int procs_fd;  // its cgroup.procs while processes are being placed
+};
 
 struct job_control {
-  int job_id;
-  pid_t job_pid;
+  int job_id;                 // 0 until the job is shown in jobs
+  pid_t job_pid;              // pid of the first stage, also the process group
+  struct job_process *procs;  // one per pipeline stage
+  int proc_count;
+  int live_count;     // processes that have not been reaped yet
   bool foreground;    // true if foreground, false if background
   bool running;       // true if running, false if stopped
   bool terminated;    // true if terminated
   bool show;          // if false don't print, if true, print
-  char command[MAX];  // stores the command that was given
+  char *command;      // stores the command that was given
+  int status;         // wait status of the last stage once it has exited
+  struct job_usage usage;
+  void (*on_done)(void *owner, int status, struct job_usage *usage);
+  void *owner;        // passed to on_done, which runs once the job is gone
+  struct placement *place;  // set by run, NULL if the job was not placed
+  bool in_use;        // false while the slot is on the free list
+  int prev, next;     // neighbouring live slots, or next free slot
+};
+
+struct job_control *processes = NULL;  // job slots, see the job table below
+int job_capacity = 0;
+int job_count = 0;    // live jobs
+int job_head = -1;    // oldest live job, -1 if none
+int job_tail = -1;    // newest live job
+int free_slot = -1;   // first slot of the free list
+
+/* ---- event loop ----
+ * All signals the shell cares about are blocked and read from a signalfd, so
+ * the job table is only ever touched from the main loop. stdin, the signalfd
+ * and one pidfd per child are multiplexed with epoll. */
+
+// what an epoll event refers to, stored in the upper half of epoll_data
+enum event_source {
+  EV_STDIN = 1,
+  EV_SIGNAL,
+  EV_PIDFD,
+  EV_TIMER,
+  EV_LISTEN,  // the socket of shell --listen
+  EV_CLIENT   // a connection to it
+};
+
+int epoll_fd = -1;
+int signal_fd = -1;
+sigset_t shell_mask;    // signals routed through signal_fd
+sigset_t default_mask;  // mask the shell started with, restored in children
+bool stdin_watched;     // true if stdin is in the epoll interest set
+bool stdin_pollable;    // false for regular files, which epoll rejects
+bool stdin_ready;       // set when epoll reports stdin readable
+bool need_prompt = true;  // prompt has to be (re)printed before reading
+bool show_prompt = true;  // false when running a script or -c
+const char *prompt = PROMPT;  // "> " while a here-document is read
+int pidfd_count = 0;      // pidfds currently open
+
+char *input_buf = NULL;  // bytes read from stdin but not consumed yet
+size_t input_cap = 0;
+size_t input_len = 0;
+size_t line_used = 0;  // bytes of the line last returned by read_line
+bool input_eof = false;
+bool discarding = false;  // skipping the rest of an overlong line
+
+void watch_fd(int fd, enum event_source source, uint32_t events, int op) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.u64 = ((uint64_t)source << 32) | (uint32_t)fd;
+  if (epoll_ctl(epoll_fd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+    perror("epoll_ctl");
+  }
+}
+
+void watch_stdin(bool on) {
+  // stdin is level triggered, so it has to leave the interest set while a
+  // foreground job owns the terminal or epoll_wait would return immediately
+  if (stdin_pollable && on != stdin_watched) {
+    watch_fd(STDIN_FILENO, EV_STDIN, on ? EPOLLIN : 0, EPOLL_CTL_MOD);
+    stdin_watched = on;
+  }
+}
+
+int watch_child(pid_t pid) {
+  // opens a pidfd for the child so its exit wakes the event loop directly
+  // with thousands of jobs the budget keeps pidfds from using up every fd
+  if (pidfd_count >= MAX_PIDFDS) {
+    return -1;
+  }
+  int pidfd = pidfd_open(pid, 0);
+  if (pidfd < 0) {
+    return -1;  // older kernels still get SIGCHLD through signal_fd
+  }
+  fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+  watch_fd(pidfd, EV_PIDFD, EPOLLIN, EPOLL_CTL_ADD);
+  pidfd_count++;
+  return pidfd;
+}
+
+void unwatch_child(int pidfd) {
+  if (pidfd >= 0) {
+    close(pidfd);  // closing also drops it from the epoll set
+    pidfd_count--;
+  }
+}
+
+void event_init() {
+  sigemptyset(&shell_mask);
+  sigaddset(&shell_mask, SIGINT);
+  sigaddset(&shell_mask, SIGTSTP);
+  sigaddset(&shell_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &shell_mask, &default_mask);
+
+  // writes to a closed pipe should fail with EPIPE instead of killing us
+  signal(SIGPIPE, SIG_IGN);
+
+  // take the terminal so every job can get its own process group, SIGTTOU
+  // is ignored so the shell can take it back from a finished job
+  interactive = isatty(STDIN_FILENO);
+  if (interactive) {
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    setpgid(0, 0);  // fails harmlessly if we already lead a session
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+  }
+  shell_pgid = getpgrp();
+
+  signal_fd = signalfd(-1, &shell_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (signal_fd < 0 || epoll_fd < 0) {
+    perror("event loop");
+    exit(1);
+  }
+  watch_fd(signal_fd, EV_SIGNAL, EPOLLIN, EPOLL_CTL_ADD);
+
+  struct epoll_event ev = {.events = EPOLLIN,
+                           .data.u64 = (uint64_t)EV_STDIN << 32};
+  stdin_pollable = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+  stdin_watched = stdin_pollable;
+}
+
+void subshell_init() {
+  // a forked copy of the shell that goes on running commands needs its own
+  // epoll set and signalfd, the parent's would deliver to either process
+  close(epoll_fd);
+  close(signal_fd);
+  signal_fd = signalfd(-1, &shell_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  watch_fd(signal_fd, EV_SIGNAL, EPOLLIN, EPOLL_CTL_ADD);
+  stdin_pollable = false;
+  stdin_watched = false;
+  pidfd_count = 0;
+}
+
+void child_reset_signals() {
+  // undo the shell's signal setup before exec, blocked masks survive exec
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTSTP, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGTTOU, SIG_DFL);
+  signal(SIGTTIN, SIG_DFL);
+  sigprocmask(SIG_SETMASK, &default_mask, NULL);
+}
+
+/* ---- buffered output ----
+ * Builtins print through a writer on the fd their redirections point at,
+ * so the shell never has to move its own stdout around to run them. */
+
+struct writer {
+  int fd;  // -1 if the output was closed with >&-
+  size_t len;
+  char buf[4096];
+};
+
+void writer_flush(struct writer *out) {
+  if (out->fd == STDOUT_FILENO || out->fd == STDERR_FILENO) {
+    fflush(stdout);  // keep the order with what went through printf
+  }
+  size_t done = 0;
+  while (out->fd >= 0 && done < out->len) {
+    ssize_t n = write(out->fd, out->buf + done, out->len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;  // EPIPE or a full disk, the rest is dropped
+    }
+    done += n;
+  }
+  out->len = 0;
+}
+
+void writer_printf(struct writer *out, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t room = sizeof(out->buf) - out->len;
+  int n = vsnprintf(out->buf + out->len, room, format, args);
+  va_end(args);
+  if (n < 0 || (size_t)n < room) {
+    out->len += n > 0 ? n : 0;
+    return;
+  }
+  // did not fit, make room and try again; bigger than the buffer goes
+  // straight out
+  writer_flush(out);
+  va_start(args, format);
+  if ((size_t)n < sizeof(out->buf)) {
+    out->len = vsnprintf(out->buf, sizeof(out->buf), format, args);
+  } else if (out->fd >= 0) {
+    vdprintf(out->fd, format, args);
+  }
+  va_end(args);
+}
+
+void writer_put(struct writer *out, const char *text, size_t len) {
+  // text as it is, without a format to go through
+  while (len > 0) {
+    if (out->len == sizeof(out->buf)) {
+      writer_flush(out);
+    }
+    size_t room = sizeof(out->buf) - out->len;
+    size_t n = len < room ? len : room;
+    memcpy(out->buf + out->len, text, n);
+    out->len += n;
+    text += n;
+    len -= n;
+  }
+}
+
+/* ---- instrumentation ----
+ * The hot paths are timed with CLOCK_MONOTONIC into HDR style histograms:
+ * every power of two is split into HIST_SUB linear buckets, so any latency
+ * is kept with about 6% precision in a fixed table and recording one is a
+ * shift and an increment. stats prints them, --stats-file writes them for
+ * the node exporter's textfile collector every --stats-interval seconds. */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+  const char *name;  // exported as cshell_<name>_seconds
+  const char *help;
+  uint64_t count;
+  uint64_t sum;  // all values are in ns
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+enum timer_id { T_PARSE, T_REDIRECT, T_LAUNCH, T_DISPATCH, T_REAP, T_COUNT };
+
+struct histogram histograms[T_COUNT] = {
+    {"parse", "Tokenizing and expanding one command line."},
+    {"redirect", "Pipe and redirection setup of one pipeline stage."},
+    {"launch", "Starting one process with fork/exec or posix_spawn."},
+    {"dispatch", "From reading a command line to its first process running."},
+    {"reap", "From the event loop waking up to a child being reaped."},
+};
+
+char *stats_file = NULL;  // --stats-file, NULL if not exporting
+int stats_interval = 15;  // seconds between exports
+int timer_fd = -1;
+uint64_t command_start;   // when the line being run was read
+uint64_t events_woke;     // when epoll_wait last returned
+
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int hist_index(uint64_t value) {
+  if (value < HIST_SUB) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + ((value >> shift) & (HIST_SUB - 1));
+}
+
+uint64_t hist_lowest(int index) {
+  // smallest value that lands in bucket index
+  if (index < HIST_SUB) {
+    return index;
+  }
+  int shift = index / HIST_SUB - 1;
+  return (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+}
+
+uint64_t hist_highest(int index) {
+  return index + 1 < HIST_BUCKETS ? hist_lowest(index + 1) - 1 : UINT64_MAX;
+}
+
+void hist_record(enum timer_id id, uint64_t ns) {
+  struct histogram *hist = &histograms[id];
+  if (hist->count == 0 || ns < hist->min) {
+    hist->min = ns;
+  }
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+  hist->count++;
+  hist->sum += ns;
+  hist->buckets[hist_index(ns)]++;
+}
+
+void time_since(enum timer_id id, uint64_t start) {
+  hist_record(id, monotonic_ns() - start);
+}
+
+uint64_t hist_percentile(struct histogram *hist, double percentile) {
+  // upper end of the bucket holding the percentile, within the bucket width
+  uint64_t rank = (uint64_t)(percentile / 100 * hist->count + 0.5);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t high = hist_highest(i);
+      return high < hist->max ? high : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+void print_stats(struct writer *out) {
+  // the stats builtin, every latency in microseconds
+  writer_printf(out, "%-10s %8s %9s %9s %9s %9s %9s %9s\n", "timer", "count",
+                "min", "p50", "p90", "p99", "max", "mean");
+  for (int t = 0; t < T_COUNT; t++) {
+    struct histogram *hist = &histograms[t];
+    double mean = hist->count ? (double)hist->sum / hist->count : 0;
+    writer_printf(out, "%-10s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                  hist->name, hist->count, hist->min / 1e3,
+                  hist_percentile(hist, 50) / 1e3,
+                  hist_percentile(hist, 90) / 1e3,
+                  hist_percentile(hist, 99) / 1e3, hist->max / 1e3,
+                  mean / 1e3);
+  }
+  writer_printf(out, "(microseconds)\n");
+}
+
+void reset_stats() {
+  for (int t = 0; t < T_COUNT; t++) {
+    struct histogram *hist = &histograms[t];
+    hist->count = hist->sum = hist->min = hist->max = 0;
+    memset(hist->buckets, 0, sizeof(hist->buckets));
+  }
+}
+
+void export_stats() {
+  // writes every histogram in the Prometheus text format; the file is
+  // renamed into place so the exporter never reads half of it
+  static const double bounds[] = {1e-6,   2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5,
+                                   1e-4,   2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+                                   1e-2,   2.5e-2, 5e-2, 0.1,  0.25,   1};
+  int bound_count = sizeof(bounds) / sizeof(bounds[0]);
+  size_t len = strlen(stats_file);
+  char tmp[len + 5];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file);
+  FILE *out = fopen(tmp, "we");
+  if (out == NULL) {
+    fprintf(stderr, "Cannot open file %s: ", tmp);
+    perror("");
+    return;
+  }
+
+  for (int t = 0; t < T_COUNT; t++) {
+    struct histogram *hist = &histograms[t];
+    fprintf(out, "# HELP cshell_%s_seconds %s\n", hist->name, hist->help);
+    fprintf(out, "# TYPE cshell_%s_seconds histogram\n", hist->name);
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int b = 0; b < bound_count; b++) {
+      // buckets that end at or below the bound are counted in it
+      uint64_t bound_ns = bounds[b] * 1e9;
+      while (bucket < HIST_BUCKETS && hist_highest(bucket) <= bound_ns) {
+        cumulative += hist->buckets[bucket++];
+      }
+      fprintf(out, "cshell_%s_seconds_bucket{le=\"%g\"} %lu\n", hist->name,
+              bounds[b], cumulative);
+    }
+    fprintf(out, "cshell_%s_seconds_bucket{le=\"+Inf\"} %lu\n", hist->name,
+            hist->count);
+    fprintf(out, "cshell_%s_seconds_sum %.9f\n", hist->name, hist->sum / 1e9);
+    fprintf(out, "cshell_%s_seconds_count %lu\n", hist->name, hist->count);
+  }
+  if (fclose(out) != 0 || rename(tmp, stats_file) != 0) {
+    fprintf(stderr, "Cannot write file %s: ", stats_file);
+    perror("");
+  }
+}
+
+void start_stats_export() {
+  // a timerfd in the event loop triggers export_stats periodically
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec period = {{stats_interval, 0}, {stats_interval, 0}};
+  if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &period, NULL) < 0) {
+    perror("timerfd");
+    return;
+  }
+  watch_fd(timer_fd, EV_TIMER, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+/* ---- job table ----
+ * processes[] is a growable array of slots. Live jobs are linked in launch
+ * order for jobs and quit, freed slots go on a free list, and two hash
+ * indexes map every stage pid and every job id to its slot, so adding,
+ * finding and removing a job never scans the table. */
+
+struct int_map {
+  int *keys;  // 0 marks an empty bucket, pids and job ids are never 0
+  int *values;
+  size_t capacity;  // always a power of two
+  size_t count;
 };
 
-struct job_control processes[MAX_PROCESS];
+struct int_map pid_index;  // pid of any stage -> slot
+struct int_map id_index;   // job_id -> slot
+
+size_t map_bucket(struct int_map *map, int key) {
+  return ((unsigned)key * 2654435761u) & (map->capacity - 1);
+}
+
+void map_put(struct int_map *map, int key, int value);
+
+void map_grow(struct int_map *map) {
+  struct int_map old = *map;
+  map->capacity = old.capacity ? old.capacity * 2 : 64;
+  map->keys = calloc(map->capacity, sizeof(int));
+  map->values = calloc(map->capacity, sizeof(int));
+  map->count = 0;
+  for (size_t i = 0; i < old.capacity; i++) {
+    if (old.keys[i] != 0) {
+      map_put(map, old.keys[i], old.values[i]);
+    }
+  }
+  free(old.keys);
+  free(old.values);
+}
+
+void map_put(struct int_map *map, int key, int value) {
+  if ((map->count + 1) * 2 > map->capacity) {
+    map_grow(map);
+  }
+  size_t i = map_bucket(map, key);
+  while (map->keys[i] != 0 && map->keys[i] != key) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  if (map->keys[i] == 0) {
+    map->count++;
+  }
+  map->keys[i] = key;
+  map->values[i] = value;
+}
+
+int map_get(struct int_map *map, int key) {
+  // returns the value for key, -1 if it is not there
+  if (map->capacity == 0 || key == 0) {
+    return -1;
+  }
+  size_t i = map_bucket(map, key);
+  while (map->keys[i] != 0) {
+    if (map->keys[i] == key) {
+      return map->values[i];
+    }
+    i = (i + 1) & (map->capacity - 1);
+  }
+  return -1;
+}
+
+void map_remove(struct int_map *map, int key) {
+  if (map->capacity == 0 || key == 0) {
+    return;
+  }
+  size_t mask = map->capacity - 1;
+  size_t i = map_bucket(map, key);
+  while (map->keys[i] != key) {
+    if (map->keys[i] == 0) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  // shift later entries of the probe run back so lookups never stop early
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (map->keys[j] == 0) {
+      break;
+    }
+    size_t home = map_bucket(map, map->keys[j]);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      map->keys[i] = map->keys[j];
+      map->values[i] = map->values[j];
+      i = j;
+    }
+  }
+  map->keys[i] = 0;
+  map->count--;
+}
+
+int job_alloc() {
+  // takes a slot off the free list, doubling processes[] when it is empty
+  if (free_slot == -1) {
+    int old_capacity = job_capacity;
+    job_capacity = job_capacity ? job_capacity * 2 : 16;
+    processes = realloc(processes, job_capacity * sizeof(struct job_control));
+    for (int i = job_capacity - 1; i >= old_capacity; i--) {
+      processes[i].in_use = false;
+      processes[i].next = free_slot;
+      free_slot = i;
+    }
+  }
+  int slot = free_slot;
+  free_slot = processes[slot].next;
+  return slot;
+}
+
+int add_job(struct job_control *job) {
+  // copies job into a free slot, appends it to the list and indexes it
+  int slot = job_alloc();
+  processes[slot] = *job;
+  processes[slot].in_use = true;
+  processes[slot].prev = job_tail;
+  processes[slot].next = -1;
+  if (job_tail != -1) {
+    processes[job_tail].next = slot;
+  } else {
+    job_head = slot;
+  }
+  job_tail = slot;
+
+  for (int i = 0; i < job->proc_count; i++) {
+    map_put(&pid_index, job->procs[i].pid, slot);
+  }
+  if (job->job_id != 0) {
+    map_put(&id_index, job->job_id, slot);
+  }
+  job_count++;
+  return slot;
+}
+
+void set_job_id(int slot) {
+  // gives a job the next id once it should show up in jobs
+  processes[slot].job_id = job_counter;
+  job_counter++;  // increment the ID
+  map_put(&id_index, processes[slot].job_id, slot);
+}
+
+void remove_job(int slot) {
+  // unlinks the job, drops it from both indexes and frees the slot
+  struct job_control *job = &processes[slot];
+  for (int i = 0; i < job->proc_count; i++) {
+    unwatch_child(job->procs[i].pidfd);
+    map_remove(&pid_index, job->procs[i].pid);
+  }
+  map_remove(&id_index, job->job_id);
+  free(job->procs);
+  free(job->command);
+  free(job->place);
+
+  if (job->prev != -1) {
+    processes[job->prev].next = job->next;
+  } else {
+    job_head = job->next;
+  }
+  if (job->next != -1) {
+    processes[job->next].prev = job->prev;
+  } else {
+    job_tail = job->prev;
+  }
+
+  job->in_use = false;
+  job->next = free_slot;
+  free_slot = slot;
+  job_count--;
+}
+
+int find_job_by_pid(pid_t pid) {
+  // slot of the job that pid is a stage of, -1 if none
+  return map_get(&pid_index, pid);
+}
+
+int find_job_by_id(int job_id) {
+  return map_get(&id_index, job_id);
+}
+
+struct job_process *find_process(pid_t pid, int *slot) {
+  // finds the job (and stage) that pid belongs to
+  *slot = find_job_by_pid(pid);
+  if (*slot == -1) {
+    return NULL;
+  }
+  struct job_control *job = &processes[*slot];
+  for (int i = 0; i < job->proc_count; i++) {
+    if (job->procs[i].pid == pid) {
+      return &job->procs[i];
+    }
+  }
+  return NULL;
+}
+
+int find_job_arg(char *arg) {
+  // resolves a %job_id or pid argument of kill, fg and bg to a slot
+  // prints what went wrong and returns -1 if there is no such job
+  if (arg == NULL) {
+    printf("A %%job_id or pid is needed.\n");
+    return -1;
+  }
+  if (arg[0] == '%') {
+    int slot = find_job_by_id(atoi(arg + 1));
+    if (slot == -1) {
+      printf("Job ID %s does not exist.\n", arg);
+    }
+    return slot;
+  }
+  int slot = find_job_by_pid(atoi(arg));
+  if (slot == -1 && find_job_by_id(atoi(arg)) != -1) {
+    printf("%% should be placed before a Job ID.\n");
+  } else if (slot == -1) {
+    printf(
+        "Process ID or Job ID should be an existing process or has "
+        "been formatted wrong.\n");
+  }
+  return slot;
+}
+
+/* ---- recording ----
+ * --record PATH logs an interactive session so an incident can be played
+ * back against a fresh shell with bench/replay: every line read at the
+ * prompt, every SIGINT, SIGTSTP and SIGCHLD the event loop took in, and the
+ * table that jobs printed. CTRL + C and CTRL + Z go from the terminal to
+ * the foreground job rather than the shell, so they are logged as terminal
+ * events when that job is interrupted or stopped. One event per line, tab
+ * separated, stamped with the seconds since the recording started; each
+ * is flushed right away so a shell that crashes or is killed still leaves
+ * the events before it. */
+
+FILE *record_file = NULL;  // NULL when not recording
+uint64_t record_start = 0;
+
+bool record_open(const char *path) {
+  record_file = fopen(path, "we");
+  if (record_file == NULL) {
+    fprintf(stderr, "Cannot open file %s: ", path);
+    perror("");
+    return false;
+  }
+  record_start = monotonic_ns();
+  fprintf(record_file, "# cshell recording 1\n");
+  fflush(record_file);
+  return true;
+}
+
+void record_event(const char *kind, const char *format, ...) {
+  if (record_file == NULL) {
+    return;
+  }
+  fprintf(record_file, "%.6f\t%s\t", (monotonic_ns() - record_start) / 1e9,
+          kind);
+  va_list args;
+  va_start(args, format);
+  vfprintf(record_file, format, args);
+  va_end(args);
+  fputc('\n', record_file);
+  fflush(record_file);
+}
+
+void record_signal(struct signalfd_siginfo *info) {
+  // SIGCHLD carries the child and what happened to it; several children
+  // can share one SIGCHLD, which is the kind of thing a recording is for
+  if (info->ssi_signo == SIGINT) {
+    record_event("signal", "INT\t%u", info->ssi_pid);
+  } else if (info->ssi_signo == SIGTSTP) {
+    record_event("signal", "TSTP\t%u", info->ssi_pid);
+  } else if (info->ssi_signo == SIGCHLD) {
+    const char *what = info->ssi_code == CLD_EXITED      ? "exited"
+                       : info->ssi_code == CLD_KILLED    ? "killed"
+                       : info->ssi_code == CLD_DUMPED    ? "dumped"
+                       : info->ssi_code == CLD_STOPPED   ? "stopped"
+                       : info->ssi_code == CLD_CONTINUED ? "continued"
+                                                         : "trapped";
+    record_event("signal", "CHLD\t%u\t%s\t%d", info->ssi_pid, what,
+                 info->ssi_status);
+  }
+}
+
+void record_jobs() {
+  // what jobs just printed, the count first; the pids are left out since a
+  // replay gets different ones
+  if (record_file == NULL) {
+    return;
+  }
+  int shown = 0;
+  for (int i = job_head; i != -1; i = processes[i].next) {
+    shown += !processes[i].terminated && processes[i].show;
+  }
+  record_event("jobs", "%d", shown);
+  for (int i = job_head; i != -1; i = processes[i].next) {
+    if (!processes[i].terminated && processes[i].show) {
+      record_event("job", "[%i] %s  %s", processes[i].job_id,
+                   processes[i].running ? "Running" : "Stopped",
+                   processes[i].command);
+    }
+  }
+}
+
+/* ---- resource accounting ----
+ * Children are reaped with wait4, and the rusage of every process of a job
+ * is added to the job entry so time and jobs -l can show it. */
+
+double seconds_between(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void usage_add(struct job_usage *usage, struct rusage *ru) {
+  // adds one reaped process to the job's totals
+  timeradd(&usage->utime, &ru->ru_utime, &usage->utime);
+  timeradd(&usage->stime, &ru->ru_stime, &usage->stime);
+  if (ru->ru_maxrss > usage->maxrss) {
+    usage->maxrss = ru->ru_maxrss;  // the pipeline's biggest stage
+  }
+  usage->nvcsw += ru->ru_nvcsw;
+  usage->nivcsw += ru->ru_nivcsw;
+}
+
+double usage_wall(struct job_usage *usage) {
+  // wall time so far, or in total once the job is gone
+  struct timespec now;
+  struct timespec *end = &usage->end;
+  if (end->tv_sec == 0 && end->tv_nsec == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    end = &now;
+  }
+  return seconds_between(&usage->start, end);
+}
+
+void usage_now(struct job_usage *usage) {
+  // the shell's own usage plus that of every child it has reaped so far,
+  // time in front of a builtin or a function reports the difference
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  *usage = (struct job_usage){0};
+  clock_gettime(CLOCK_MONOTONIC, &usage->start);
+  usage_add(usage, &self);
+  usage_add(usage, &children);
+}
+
+void usage_since(struct job_usage *usage) {
+  // turns a usage_now snapshot into what was used since it was taken
+  struct job_usage now;
+  usage_now(&now);
+  usage->end = now.start;
+  timersub(&now.utime, &usage->utime, &usage->utime);
+  timersub(&now.stime, &usage->stime, &usage->stime);
+  usage->maxrss = now.maxrss;  // a peak, it cannot be split up
+  usage->nvcsw = now.nvcsw - usage->nvcsw;
+  usage->nivcsw = now.nivcsw - usage->nivcsw;
+}
+
+void print_time(double seconds) {
+  fprintf(stderr, "%dm%.3fs\n", (int)(seconds / 60),
+          seconds - 60 * (int)(seconds / 60));
+}
+
+void time_done(void *owner, int status, struct job_usage *usage) {
+  // on_done of a job started by time, prints its usage the way bash does
+  fprintf(stderr, "\nreal\t");
+  print_time(usage_wall(usage));
+  fprintf(stderr, "user\t");
+  print_time(timeval_seconds(&usage->utime));
+  fprintf(stderr, "sys\t");
+  print_time(timeval_seconds(&usage->stime));
+  fprintf(stderr, "maxrss\t%ld KB\n", usage->maxrss);
+  fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", usage->nvcsw,
+          usage->nivcsw);
+}
+
+void give_terminal(pid_t pgid) {
+  // makes pgid the terminal's foreground process group
+  if (interactive) {
+    tcsetpgrp(STDIN_FILENO, pgid);
+  }
+}
+
+void sigint_handler() {
+  // handles the CTRL + C (SIGINT) signal
+  // with a terminal the foreground job gets CTRL + C itself, this covers a
+  // SIGINT sent to the shell; the job entry is cleaned up by sigchld_handler
+  interrupted = true;
+  if (foreground_pid > 0) {
+    kill(-foreground_pid, SIGINT);  // terminate the whole pipeline
+  } else if (interrupt_hook) {
+    interrupt_hook();  // a builtin such as parallel is waiting on its jobs
+    printf("\n");
+  } else {
+    printf("\n");
+    need_prompt = true;
+  }
+}
+
+void sigtstp_handler() {
+  // handles the CTRL + Z (SIGTSTP) signal
+  // the job is marked as stopped by sigchld_handler when the children stop
+  if (foreground_pid > 0) {
+    kill(-foreground_pid, SIGTSTP);  // sends stop signal
+  } else {
+    printf("\n");
+    need_prompt = true;
+  }
+}
+
+void foreground_done() {
+  // the foreground job has exited, been killed or stopped
+  foreground = false;
+  foreground_pid = 0;
+  need_prompt = true;
+  give_terminal(shell_pgid);
+}
+
+int exit_code(int status) {
+  // the number a shell reports as $?
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+void process_reaped(int slot, struct job_process *proc, int status,
+                    struct rusage *ru) {
+  // books one exited process of a job; once the last one is gone the job
+  // is removed and its on_done runs, whoever reaped it
+  struct job_control *job = &processes[slot];
+  bool is_foreground = foreground && job->job_pid == foreground_pid;
+  proc->done = true;
+  unwatch_child(proc->pidfd);
+  proc->pidfd = -1;
+  job->live_count--;
+  usage_add(&job->usage, ru);
+  if (proc == &job->procs[job->proc_count - 1]) {
+    job->status = status;  // a pipeline reports its last stage
+  }
+  if (job->live_count > 0) {
+    return;
+  }
+
+  // the last stage of the pipeline is gone
+  if (is_foreground) {
+    if (WIFSIGNALED(status)) {
+      printf("\n");
+    }
+    if (WIFSIGNALED(job->status) && WTERMSIG(job->status) == SIGINT) {
+      record_event("terminal", "INT\t%d", job->job_pid);
+    }
+    last_status = exit_code(job->status);
+    foreground_done();
+  }
+  // on_done may start new jobs, so the slot is released first
+  clock_gettime(CLOCK_MONOTONIC, &job->usage.end);
+  void (*on_done)(void *, int, struct job_usage *) = job->on_done;
+  void *owner = job->owner;
+  int job_status = job->status;
+  struct job_usage usage = job->usage;
+  remove_job(slot);
+  if (on_done) {
+    on_done(owner, job_status, &usage);
+  }
+}
+
+void sigchld_handler() {
+  int waitCondition = WUNTRACED | WCONTINUED | WNOHANG;
+  // option to track stopped (due to signal), continued, process
+  // WNOHANG: waitpid return status info immediately, without waiting for
+  // process to terminate;
+
+  int childStatus;
+  pid_t child_pid;
+  struct rusage ru;  // filled in by wait4 for exited children
+
+  // handles when the child is terminated - call wait4 to reap the child
+  //  wait4 first arg pid -1 is any child that terminates
+  while ((child_pid = wait4(-1, &childStatus, waitCondition, &ru)) > 0) {
+    if (WIFEXITED(childStatus) || WIFSIGNALED(childStatus)) {
+      time_since(T_REAP, events_woke);
+    }
+    int slot;
+    struct job_process *proc = find_process(child_pid, &slot);
+    if (proc == NULL) {
+      continue;
+    }
+    struct job_control *job = &processes[slot];
+    bool is_foreground = foreground && job->job_pid == foreground_pid;
+
+    if (WIFEXITED(childStatus) || WIFSIGNALED(childStatus)) {
+      // regular terminate, error or ctrl + c
+      process_reaped(slot, proc, childStatus, &ru);
+    } else if (WIFSTOPPED(childStatus)) {
+      //  ctrl + z, the job shows up in jobs from now on
+      job->running = false;
+      if (!job->show) {
+        job->show = true;
+        set_job_id(slot);
+      }
+      if (is_foreground) {
+        printf("\n");
+        if (WSTOPSIG(childStatus) == SIGTSTP) {
+          record_event("terminal", "TSTP\t%d", job->job_pid);
+        }
+        last_status = 128 + WSTOPSIG(childStatus);
+        foreground_done();
+      }
+    } else if (WIFCONTINUED(childStatus)) {
+      job->running = true;
+    }
+  }
+  fflush(stdout);
+}
+
+void handle_signals() {
+  // drains signal_fd; SIGINT and SIGTSTP are forwarded before SIGCHLD is
+  // handled so a child stopped by CTRL + Z is still the foreground job
+  struct signalfd_siginfo info[MAX_EVENTS];
+  bool got_int = false, got_tstp = false, got_chld = false;
+  ssize_t n;
+
+  while ((n = read(signal_fd, info, sizeof(info))) > 0) {
+    for (size_t i = 0; i < n / sizeof(info[0]); i++) {
+      record_signal(&info[i]);
+      if (info[i].ssi_signo == SIGINT) {
+        got_int = true;
+      } else if (info[i].ssi_signo == SIGTSTP) {
+        got_tstp = true;
+      } else if (info[i].ssi_signo == SIGCHLD) {
+        got_chld = true;
+      }
+    }
+  }
+
+  if (got_int) {
+    sigint_handler();
+  }
+  if (got_tstp) {
+    sigtstp_handler();
+  }
+  if (got_chld) {
+    sigchld_handler();
+  }
+}
+
+void server_event(enum event_source source, int fd, uint32_t events);
+
+void process_events(int timeout) {
+  // waits for one round of events and dispatches them on the main thread
+  // timeout is in milliseconds, -1 blocks until something happens
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+  events_woke = monotonic_ns();
+
+  for (int i = 0; i < n; i++) {
+    switch (events[i].data.u64 >> 32) {
+      case EV_SIGNAL:
+        handle_signals();
+        break;
+      case EV_PIDFD:
+        sigchld_handler();  // the child exited, reap it now
+        break;
+      case EV_STDIN:
+        stdin_ready = true;
+        break;
+      case EV_TIMER: {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+          export_stats();
+        }
+        break;
+      }
+      case EV_LISTEN:
+      case EV_CLIENT:
+        server_event(events[i].data.u64 >> 32, (uint32_t)events[i].data.u64,
+                     events[i].events);
+        break;
+    }
+  }
+}
+
+void wait_foreground() {
+  // runs the event loop until the foreground job finishes or stops
+  watch_stdin(false);
+  while (foreground) {
+    process_events(-1);
+  }
+}
+
+void print_prompt() {
+  if (show_prompt && need_prompt && !foreground) {
+    printf("%s", prompt);
+    fflush(stdout);
+    need_prompt = false;
+  }
+}
+
+char *read_line() {
+  // returns the next line of input without its newline, dispatching events
+  // while waiting; the line stays valid until the next call
+  // returns NULL once stdin is closed and no input is left
+  if (line_used > 0) {
+    // drop the line handed out last time
+    input_len -= line_used;
+    memmove(input_buf, input_buf + line_used, input_len);
+    line_used = 0;
+  }
+  print_prompt();
+  while (1) {
+    char *newline = input_len ? memchr(input_buf, '\n', input_len) : NULL;
+    if (discarding && newline != NULL) {
+      // the rest of an overlong line, skip it
+      input_len -= newline + 1 - input_buf;
+      memmove(input_buf, newline + 1, input_len);
+      discarding = false;
+      continue;
+    }
+    if (newline != NULL || (input_eof && input_len > 0 && !discarding)) {
+      size_t end = newline ? (size_t)(newline - input_buf) : input_len;
+      input_buf[end] = '\0';  // there is always room past input_len
+      line_used = newline ? end + 1 : input_len;
+      return input_buf;
+    }
+    if (input_eof) {
+      return NULL;  // end of input
+    }
+
+    if (input_len + 1 >= input_cap) {
+      // grow getline style, a line can be as long as ARG_MAX
+      size_t limit = sysconf(_SC_ARG_MAX);
+      if (input_cap >= limit) {
+        printf("Line is longer than %zu bytes, ignored.\n", limit);
+        discarding = true;
+        input_len = 0;
+      } else {
+        input_cap = input_cap ? input_cap * 2 : 4096;
+        input_buf = realloc(input_buf, input_cap);
+      }
+    }
+
+    watch_stdin(true);
+    stdin_ready = !stdin_pollable;  // a regular file can always be read
+    process_events(0);  // pick up job changes that are already pending
+    while (!stdin_ready) {
+      print_prompt();
+      process_events(-1);
+    }
+
+    ssize_t n = read(STDIN_FILENO, input_buf + input_len,
+                     input_cap - input_len - 1);
+    if (n > 0) {
+      input_len += n;
+    } else if (n == 0 || errno != EINTR) {
+      input_eof = true;
+    }
+  }
+}
+
+/* ---- parsing ----
+ * A command line is split into tokens that live in a per-command arena, so
+ * parsing allocates nothing per token and everything is given back in one
+ * step by arena_reset once the command has run. Operators are returned as
+ * pointers to the OP_ strings below, which is how a quoted "|" is told apart
+ * from a real pipe. Words keep their quotes until expand_words removes them. */
+
+#define ARENA_BLOCK 65536
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *first;
+  struct arena_block *current;
+  size_t used;  // bytes taken from current
+};
+
+struct arena parse_arena;  // reset after every command
+
+char OP_PIPE[] = "|";
+char OP_BACKGROUND[] = "&";
+char OP_AND[] = "&&";
+char OP_OR[] = "||";
+char OP_SEMI[] = ";";  // also what joins the lines of a compound command
+
+// redirections are operators too, one per fd and kind, so [n]<, [n]>,
+// [n]>>, [n]>& (or <&), [n]<< and [n]<<< for fds 0-9 carry their fd in the
+// token itself
+enum redirect_kind {
+  REDIRECT_IN,
+  REDIRECT_OUT,
+  REDIRECT_APPEND,
+  REDIRECT_DUP,
+  REDIRECT_HEREDOC,     // <<WORD, the lines up to WORD
+  REDIRECT_HERESTRING,  // <<<word, the word and a newline
+  REDIRECT_KINDS
+};
+
+struct redirect_op {
+  char text[5];  // first, so the op is also the token's string
+  int fd;        // fd of the command that is redirected
+  enum redirect_kind kind;
+};
+
+#define REDIRECT_OPS(n)                                                   \
+  {                                                                       \
+    {#n "<", n, REDIRECT_IN}, {#n ">", n, REDIRECT_OUT},                  \
+        {#n ">>", n, REDIRECT_APPEND}, {#n ">&", n, REDIRECT_DUP},        \
+        {#n "<<", n, REDIRECT_HEREDOC}, {#n "<<<", n, REDIRECT_HERESTRING} \
+  }
+
+struct redirect_op redirect_ops[10][REDIRECT_KINDS] = {
+    REDIRECT_OPS(0), REDIRECT_OPS(1), REDIRECT_OPS(2), REDIRECT_OPS(3),
+    REDIRECT_OPS(4), REDIRECT_OPS(5), REDIRECT_OPS(6), REDIRECT_OPS(7),
+    REDIRECT_OPS(8), REDIRECT_OPS(9)};
+
+struct redirect_op *as_redirect(char *token) {
+  // the redirection a token stands for, NULL for words and other operators
+  uintptr_t at = (uintptr_t)token;
+  uintptr_t first = (uintptr_t)redirect_ops;
+  if (at < first || at >= first + sizeof(redirect_ops)) {
+    return NULL;
+  }
+  return (struct redirect_op *)token;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  struct arena_block *block = arena->current;
+  if (block == NULL || arena->used + size > block->size) {
+    // move on to the next kept block if it fits, otherwise add one
+    struct arena_block *next = block ? block->next : arena->first;
+    if (next == NULL || next->size < size) {
+      size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+      struct arena_block *fresh = malloc(sizeof(*fresh) + block_size);
+      fresh->size = block_size;
+      fresh->next = next;
+      if (block) {
+        block->next = fresh;
+      } else {
+        arena->first = fresh;
+      }
+      next = fresh;
+    }
+    arena->current = block = next;
+    arena->used = 0;
+  }
+  void *ptr = block->data + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+void arena_reset(struct arena *arena) {
+  // hands back everything at once, the blocks are kept for the next command
+  arena->current = NULL;
+  arena->used = 0;
+}
+
+struct arena_mark {
+  struct arena_block *block;
+  size_t used;
+};
+
+struct arena_mark arena_mark(struct arena *arena) {
+  return (struct arena_mark){arena->current, arena->used};
+}
+
+void arena_release(struct arena *arena, struct arena_mark mark) {
+  // hands back everything allocated since mark, for one command of a loop
+  arena->current = mark.block;
+  arena->used = mark.used;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+struct token_list {
+  char **items;  // NULL terminated
+  int count;
+  int capacity;
+};
+
+void token_push(struct token_list *list, char *token) {
+  if (list->count + 1 >= list->capacity) {
+    // old arrays stay in the arena until the reset, that is fine
+    int capacity = list->capacity ? list->capacity * 2 : 32;
+    char **items = arena_alloc(&parse_arena, capacity * sizeof(char *));
+    if (list->count > 0) {
+      memcpy(items, list->items, list->count * sizeof(char *));
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = token;
+  list->items[list->count] = NULL;
+}
+
+char *lex_operator(const char *c, int *len) {
+  // returns the operator starting at c and sets len, NULL if there is none
+  // a digit right before < or > is the fd to redirect, as in 2> or 2>&1
+  const char *op = c;
+  int fd = -1;
+  if (c[0] >= '0' && c[0] <= '9' && (c[1] == '<' || c[1] == '>')) {
+    fd = c[0] - '0';
+    op++;
+  }
+  *len = (op[0] == '|' || op[0] == '&') && op[1] == op[0] ? 2 : 1;
+  if (op[0] == '|') {
+    return *len == 2 ? OP_OR : OP_PIPE;
+  } else if (op[0] == '&') {
+    return *len == 2 ? OP_AND : OP_BACKGROUND;
+  } else if (op[0] == ';') {
+    return OP_SEMI;
+  } else if (op[0] != '<' && op[0] != '>') {
+    return NULL;
+  }
+
+  enum redirect_kind kind = op[0] == '<' ? REDIRECT_IN : REDIRECT_OUT;
+  int op_len = 2;
+  if (op[1] == '&') {
+    kind = REDIRECT_DUP;
+  } else if (op[0] == '>' && op[1] == '>') {
+    kind = REDIRECT_APPEND;
+  } else if (op[0] == '<' && op[1] == '<') {
+    kind = op[2] == '<' ? REDIRECT_HERESTRING : REDIRECT_HEREDOC;
+    op_len = op[2] == '<' ? 3 : 2;
+  } else {
+    op_len = 1;
+  }
+  if (fd == -1) {
+    fd = op[0] == '<' ? 0 : 1;
+  }
+  *len = (op - c) + op_len;
+  return redirect_ops[fd][kind].text;
+}
+
+const char *skip_substitution(const char *c);
+
+const char *skip_quoted(const char *c) {
+  // c is at a quote, returns what follows the closing one, NULL if none
+  const char *close = c + 1;
+  while (close != NULL && *close && *close != *c) {
+    if (*c == '"' && *close == '\\' && close[1]) {
+      close += 2;
+    } else if (*c == '"' && close[0] == '$' && close[1] == '(') {
+      close = skip_substitution(close);
+    } else {
+      close++;
+    }
+  }
+  return close != NULL && *close ? close + 1 : NULL;
+}
+
+const char *skip_substitution(const char *c) {
+  // c is at $(, returns what follows the matching ), NULL if there is none
+  c += 2;
+  while (c != NULL && *c && *c != ')') {
+    if (*c == '\\' && c[1]) {
+      c += 2;
+    } else if (*c == '\'' || *c == '"') {
+      c = skip_quoted(c);
+    } else if (c[0] == '$' && c[1] == '(') {
+      c = skip_substitution(c);
+    } else {
+      c++;
+    }
+  }
+  return c != NULL && *c ? c + 1 : NULL;
+}
+
+size_t word_length(const char *c) {
+  // length of the word at c, quotes, backslashes and $(...) included
+  // returns (size_t)-1 if a quote or a $( is never closed
+  const char *start = c;
+  while (*c && *c != ' ' && *c != '\t' && strchr("|&;<>", *c) == NULL) {
+    if (*c == '\\' && c[1]) {
+      c += 2;
+    } else if (*c == '\'' || *c == '"' || (c[0] == '$' && c[1] == '(')) {
+      c = *c == '$' ? skip_substitution(c) : skip_quoted(c);
+      if (c == NULL) {
+        return (size_t)-1;
+      }
+    } else {
+      c++;
+    }
+  }
+  return c - start;
+}
+
+bool tokenize(const char *line, struct token_list *tokens) {
+  // splits line into words and operators, false on an unterminated quote
+  const char *c = line;
+  while (1) {
+    c += strspn(c, " \t");
+    if (*c == '\0' || *c == '#') {
+      return true;  // end of line or a comment
+    }
+    int op_len;
+    char *op = lex_operator(c, &op_len);
+    if (op != NULL) {
+      token_push(tokens, op);
+      c += op_len;
+      continue;
+    }
+    size_t len = word_length(c);
+    if (len == (size_t)-1) {
+      printf("Unterminated quote or $(.\n");
+      return false;
+    }
+    token_push(tokens, arena_strndup(&parse_arena, c, len));
+    c += len;
+  }
+}
+
+bool is_operator(char *token) {
+  return token == OP_PIPE || token == OP_BACKGROUND || token == OP_AND ||
+         token == OP_OR || token == OP_SEMI || as_redirect(token) != NULL;
+}
+
+char *remove_quotes(char *word) {
+  // 'x' keeps everything, "x" and bare words drop the backslash in \c
+  if (strpbrk(word, "'\"\\") == NULL) {
+    return word;  // most words have nothing to remove
+  }
+  char *out = arena_alloc(&parse_arena, strlen(word) + 1);
+  char *o = out;
+  char quote = 0;
+  for (char *c = word; *c; c++) {
+    if (quote == 0 && (*c == '\'' || *c == '"')) {
+      quote = *c;
+    } else if (quote == *c) {
+      quote = 0;
+    } else if (*c == '\\' && quote != '\'' && c[1] &&
+               (quote == 0 || strchr("\"\\$`", c[1]))) {
+      *o++ = *++c;
+    } else {
+      *o++ = *c;
+    }
+  }
+  *o = '\0';
+  return out;
+}
+
+/* $(command) runs command in a forked copy of the shell and reads what it
+ * prints. Up to CAPTURE_CHUNK bytes are read straight from the pipe; past
+ * that the output is spliced into a memfd that is mapped once at the end,
+ * so a multi-megabyte capture costs no realloc-and-copy and is split into
+ * arguments in place. The mappings live until the next command. */
+
+#define CAPTURE_CHUNK 65536
+
+struct capture_map {
+  char *addr;
+  size_t len;
+};
+
+struct capture_map *capture_maps = NULL;  // mapped outputs of this command
+int capture_map_count = 0;
+int capture_map_capacity = 0;
+int capture_status = 0;  // exit code of the command's last $(...)
+
+bool eval(char *user_str);
+bool is_name(const char *name, size_t len);
+bool is_assignment(const char *word);
+const char *variable_get(const char *name, size_t len);
+bool has_glob(const char *word);
+void glob_word(char *pattern, struct token_list *tokens);
+
+void release_captures() {
+  // unmaps the outputs of the previous command, its words are gone too
+  for (int i = 0; i < capture_map_count; i++) {
+    munmap(capture_maps[i].addr, capture_maps[i].len);
+  }
+  capture_map_count = 0;
+}
+
+char *capture_spliced(int in, char *head, size_t head_len, size_t *len) {
+  // moves the rest of the pipe into a memfd and maps it, one byte past the
+  // output is left as room for a NUL
+  int fd = memfd_create("capture", MFD_CLOEXEC);
+  if (fd < 0 || write(fd, head, head_len) != (ssize_t)head_len) {
+    perror("capture");
+    return NULL;
+  }
+  *len = head_len;
+  ssize_t n;
+  while ((n = splice(in, NULL, fd, NULL, 1 << 20, SPLICE_F_MOVE)) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      // no splice between these two, copy through the chunk buffer instead
+      while ((n = read(in, head, CAPTURE_CHUNK)) > 0 ||
+             (n < 0 && errno == EINTR)) {
+        if (n > 0 && write(fd, head, n) == n) {
+          *len += n;
+        }
+      }
+      break;
+    }
+    *len += n;
+  }
+  ftruncate(fd, *len + 1);
+  char *map = mmap(NULL, *len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("capture");
+    return NULL;
+  }
+  if (capture_map_count == capture_map_capacity) {
+    capture_map_capacity = capture_map_capacity ? capture_map_capacity * 2 : 8;
+    capture_maps = realloc(capture_maps,
+                           capture_map_capacity * sizeof(struct capture_map));
+  }
+  capture_maps[capture_map_count++] = (struct capture_map){map, *len + 1};
+  return map;
+}
+
+char *capture(const char *command, size_t *len) {
+  // runs command and returns its output with the trailing newlines dropped,
+  // writable and with room for a NUL after it
+  static char chunk[CAPTURE_CHUNK];
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return NULL;
+  }
+  fflush(stdout);  // or the child would print what is still buffered again
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Fork failed.\n");
+    close(fds[0]);
+    close(fds[1]);
+    return NULL;
+  } else if (pid == 0) {
+    // the copy runs the command like a line of its own, output into the pipe
+    subshell_init();
+    dup2(fds[1], STDOUT_FILENO);
+    last_status = 0;
+    eval(strdup(command));
+    fflush(stdout);
+    _exit(last_status);
+  }
+  close(fds[1]);
+
+  // most outputs are small and fit in one chunk
+  char *out = NULL;
+  size_t got = 0;
+  ssize_t n;
+  while (got < CAPTURE_CHUNK &&
+         (n = read(fds[0], chunk + got, CAPTURE_CHUNK - got)) != 0) {
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    got += n > 0 ? n : 0;
+  }
+  if (got < CAPTURE_CHUNK) {
+    out = arena_strndup(&parse_arena, chunk, got);
+    *len = got;
+  } else {
+    out = capture_spliced(fds[0], chunk, got, len);
+  }
+  close(fds[0]);
+  int status;
+  if (waitpid(pid, &status, 0) == pid) {
+    capture_status = exit_code(status);  // $? of a line of assignments
+  }
+
+  while (out != NULL && *len > 0 && out[*len - 1] == '\n') {
+    (*len)--;
+  }
+  return out;
+}
+
+struct word_builder {
+  char *text;   // not NUL terminated until the word is pushed
+  size_t len;
+  size_t cap;   // 0 while text points into a capture and is not ours
+  bool quoted;  // quotes were seen, so an empty word is still a word
+  bool glob;    // the word is a pattern, quoted text gets escaped
+};
+
+void builder_copy(struct word_builder *word, const char *text, size_t len) {
+  if (word->len + len + 1 > word->cap) {
+    size_t cap = word->cap * 2 > word->len + len + 1 ? word->cap * 2
+                                                     : word->len + len + 1;
+    char *grown = arena_alloc(&parse_arena, cap < 64 ? 64 : cap);
+    if (word->len > 0) {
+      memcpy(grown, word->text, word->len);
+    }
+    word->text = grown;
+    word->cap = cap < 64 ? 64 : cap;
+  }
+  memcpy(word->text + word->len, text, len);
+  word->len += len;
+}
+
+void builder_append(struct word_builder *word, const char *text, size_t len) {
+  // text has to be the shell's to change, as a capture or a copied value
+  if (word->len == 0 && word->cap == 0) {
+    // borrow the text, a lone $(...) is never copied
+    word->text = (char *)text;
+    word->len = len;
+    return;
+  }
+  builder_copy(word, text, len);
+}
+
+void builder_char(struct word_builder *word, char c, bool quoted) {
+  // a character of the word itself, always copied since the words of a loop
+  // are expanded again on every pass
+  if (quoted && word->glob && strchr("*?[]\\", c) != NULL) {
+    builder_copy(word, "\\", 1);
+  }
+  builder_copy(word, &c, 1);
+}
+
+void builder_append_quoted(struct word_builder *word, const char *text,
+                           size_t len) {
+  // quoted text never matches file names, so in a pattern its *, ?, [, ]
+  // and \ are escaped
+  if (!word->glob) {
+    builder_append(word, text, len);
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    builder_char(word, text[i], text[i] != '\0');
+  }
+}
+
+void builder_push(struct word_builder *word, struct token_list *tokens) {
+  // ends the word and starts the next one
+  if (word->len > 0 || word->quoted) {
+    if (word->text == NULL) {
+      word->text = arena_alloc(&parse_arena, 1);
+    }
+    word->text[word->len] = '\0';
+    if (word->glob) {
+      glob_word(word->text, tokens);
+    } else {
+      token_push(tokens, word->text);
+    }
+  }
+  *word = (struct word_builder){.glob = word->glob};
+}
+
+void split_fields(char *text, size_t len, struct word_builder *word,
+                  struct token_list *tokens) {
+  // an unquoted substitution: blanks and newlines separate arguments, the
+  // first and last field stick to the text around the $(...)
+  char *end = text + len;
+  char *c = text;
+  while (c < end) {
+    char *field = c;
+    while (c < end && !strchr(" \t\n", *c)) {
+      c++;
+    }
+    builder_append(word, field, c - field);
+    if (c < end) {
+      builder_push(word, tokens);  // NULs the blank the field ended at
+      while (c < end && strchr(" \t\n", *c)) {
+        c++;
+      }
+    }
+  }
+}
+
+const char *special_value(char name) {
+  // $? is the last exit status, $# $@ and $1 to $9 the function's arguments
+  static char number[16];
+  if (name == '?' || name == '#') {
+    snprintf(number, sizeof(number), "%d",
+             name == '?' ? last_status : positional_count);
+    return number;
+  } else if (name == '@') {
+    size_t len = 0;
+    for (int i = 0; i < positional_count; i++) {
+      len += strlen(positional[i]) + 1;
+    }
+    char *all = arena_alloc(&parse_arena, len + 1);
+    char *at = all;
+    for (int i = 0; i < positional_count; i++) {
+      if (i > 0) {
+        *at++ = ' ';
+      }
+      at = stpcpy(at, positional[i]);
+    }
+    *at = '\0';
+    return all;
+  }
+  return name - '1' < positional_count ? positional[name - '1'] : NULL;
+}
+
+void expand_variable(char **c, char quote, bool split,
+                     struct word_builder *built, struct token_list *tokens) {
+  // *c is at the $ of $NAME or ${NAME} and is left on its last character,
+  // a $ without a name after it stays a $
+  char *name = *c + 1;
+  bool braced = *name == '{';
+  name += braced;
+  size_t len = 0;
+  while (is_name(name, len + 1)) {
+    len++;
+  }
+  bool special = len == 0 && *name != '\0' &&
+                 strchr("?#@123456789", *name) != NULL;
+  len += special;
+  if (len == 0 || (braced && name[len] != '}')) {
+    builder_char(built, '$', quote != 0);
+    return;
+  }
+  *c = name + len - 1 + braced;
+
+  // copied, so splitting can cut it up and a later assignment cannot free it
+  const char *value = special ? special_value(*name) : variable_get(name, len);
+  if (*name == '@' && quote == '"') {
+    // "$@" keeps every argument a word of its own
+    for (int i = 0; i < positional_count; i++) {
+      if (i > 0) {
+        builder_push(built, tokens);
+      }
+      char *copy = arena_strndup(&parse_arena, positional[i],
+                                 strlen(positional[i]));
+      builder_append_quoted(built, copy, strlen(copy));
+    }
+    return;
+  } else if (value == NULL) {
+    return;
+  }
+  char *copy = arena_strndup(&parse_arena, value, strlen(value));
+  if (quote == '"' || !split) {
+    builder_append_quoted(built, copy, strlen(copy));
+  } else {
+    split_fields(copy, strlen(copy), built, tokens);
+  }
+}
+
+void expand_word(char *word, struct token_list *tokens) {
+  // removes the quotes of word and replaces each $(...) with its output and
+  // each $NAME with its value, neither is split in the value of NAME=value
+  // and neither is a pattern there
+  struct word_builder built = {0};
+  bool split = !is_assignment(word);
+  built.glob = split && has_glob(word);
+  char quote = 0;
+  for (char *c = word; *c; c++) {
+    if (quote == 0 && (*c == '\'' || *c == '"')) {
+      quote = *c;
+      built.quoted = true;
+    } else if (quote == *c) {
+      quote = 0;
+    } else if (*c == '\\' && quote != '\'' && c[1] &&
+               (quote == 0 || strchr("\"\\$`", c[1]))) {
+      builder_char(&built, *++c, true);
+    } else if (quote != '\'' && c[0] == '$' && c[1] == '(') {
+      char *close = (char *)skip_substitution(c);
+      char *command = arena_strndup(&parse_arena, c + 2, close - 1 - (c + 2));
+      size_t len = 0;
+      char *out = capture(command, &len);
+      if (out != NULL && (quote == '"' || !split)) {
+        builder_append_quoted(&built, out, len);
+      } else if (out != NULL) {
+        split_fields(out, len, &built, tokens);
+      }
+      c = close - 1;
+    } else if (quote != '\'' && *c == '$') {
+      expand_variable(&c, quote, split, &built, tokens);
+    } else {
+      builder_char(&built, *c, quote != 0);
+    }
+  }
+  builder_push(&built, tokens);
+}
+
+bool is_document(struct token_list *tokens, int i, bool documents_read) {
+  // a here-document read when its command was parsed, kept as it is
+  struct redirect_op *op = i > 0 ? as_redirect(tokens->items[i - 1]) : NULL;
+  return documents_read && op != NULL && op->kind == REDIRECT_HEREDOC;
+}
+
+void expand_rest(struct token_list *tokens, int from, bool documents_read) {
+  // a $(...), $NAME or pattern can turn one word into several, so the list
+  // is rebuilt from the first word that has one
+  struct token_list expanded = {0};
+  for (int i = 0; i < tokens->count; i++) {
+    char *token = tokens->items[i];
+    if (i < from || is_operator(token) ||
+        is_document(tokens, i, documents_read)) {
+      token_push(&expanded, token);
+    } else if (strchr(token, '$') != NULL || has_glob(token)) {
+      expand_word(token, &expanded);
+    } else {
+      token_push(&expanded, remove_quotes(token));
+    }
+  }
+  *tokens = expanded;
+}
+
+void expand_words(struct token_list *tokens, bool documents_read) {
+  // turns the words of a parsed line into the arguments commands receive;
+  // documents_read when here-documents already replaced their delimiters
+  capture_status = 0;
+  for (int i = 0; i < tokens->count; i++) {
+    char *token = tokens->items[i];
+    if (is_operator(token) || is_document(tokens, i, documents_read)) {
+      continue;
+    } else if (strchr(token, '$') != NULL || has_glob(token)) {
+      expand_rest(tokens, i, documents_read);
+      return;
+    }
+    tokens->items[i] = remove_quotes(token);
+  }
+}
+
+// where the lines of a here-document come from, NULL at the end of input
+// set by whatever feeds eval: the prompt, a script or a server client
+char *(*more_input)(void) = NULL;
+
+char *buffer_next;  // next line of the buffer being run
+char *buffer_end;
+
+char *buffer_line() {
+  // hands out the next line of the buffer, NUL terminated in place
+  if (buffer_next >= buffer_end) {
+    return NULL;
+  }
+  char *line = buffer_next;
+  char *newline = memchr(line, '\n', buffer_end - line);
+  char *line_end = newline ? newline : buffer_end;
+  *line_end = '\0';
+  buffer_next = line_end + 1;
+  return line;
+}
+
+char *read_document(const char *delimiter) {
+  // collects the lines after the command up to a line that is delimiter
+  size_t len = 0, cap = 256;
+  char *body = malloc(cap);
+  char *line;
+  while (1) {
+    line = more_input ? more_input() : NULL;
+    if (line == NULL || strcmp(line, delimiter) == 0) {
+      break;
+    }
+    size_t line_len = strlen(line);
+    if (len + line_len + 2 > cap) {
+      while (len + line_len + 2 > cap) {
+        cap *= 2;
+      }
+      body = realloc(body, cap);
+    }
+    memcpy(body + len, line, line_len);
+    len += line_len;
+    body[len++] = '\n';
+  }
+  if (line == NULL) {
+    fprintf(stderr, "Here-document ended by the end of input, wanted %s.\n",
+            delimiter);
+  }
+  char *document = arena_strndup(&parse_arena, body, len);
+  free(body);
+  return document;
+}
+
+void read_documents(struct token_list *tokens, bool documents_read) {
+  // replaces the word after each << and <<< with the text the command reads
+  for (int i = 0; i + 1 < tokens->count; i++) {
+    struct redirect_op *op = as_redirect(tokens->items[i]);
+    char *word = tokens->items[i + 1];
+    if (op == NULL || is_operator(word)) {
+      continue;
+    } else if (op->kind == REDIRECT_HEREDOC && !documents_read) {
+      // reading on may reuse the buffer the command line is in
+      original = arena_strndup(&parse_arena, original, strlen(original));
+      tokens->items[i + 1] = read_document(word);
+    } else if (op->kind == REDIRECT_HERESTRING) {
+      size_t len = strlen(word);
+      char *text = arena_alloc(&parse_arena, len + 2);
+      memcpy(text, word, len);
+      memcpy(text + len, "\n", 2);
+      tokens->items[i + 1] = text;
+    }
+  }
+}
+
+/* ---- globbing ----
+ * Unquoted *, ? and [...] in a word match file names and a ** component
+ * matches any number of directories below it. A directory is read once per
+ * command, in getdents64 batches, into one flat listing that every pattern
+ * over it shares, and names are matched right in that listing without
+ * allocating. Quoted pattern characters reach the matcher escaped with \.
+ * A pattern that matches nothing stays as it was typed. */
+
+#define LISTING_BUCKETS 64
+
+struct listing {
+  char *dir;             // path prefix it was read for, "" for .
+  char *names;           // NUL separated
+  int *offsets;          // where each name starts in names
+  unsigned char *types;  // d_type of each name
+  int count;
+  struct listing *next;  // next in the same bucket
+};
+
+struct listing_build {
+  struct listing *listing;
+  size_t len;  // bytes used in names
+  size_t cap;
+  int capacity;
+};
+
+struct glob_walk {
+  struct token_list *tokens;
+  char path[PATH_MAX];  // directory reached so far, / terminated
+};
+
+// the directories read by this command
+struct listing *listings[LISTING_BUCKETS];
+
+size_t hash_string(const char *str);
+void scan_dir(int dir_fd,
+              void (*found)(void *ctx, int dir_fd, struct dirent64 *entry),
+              void *ctx);
+
+void release_listings() {
+  for (int i = 0; i < LISTING_BUCKETS; i++) {
+    while (listings[i] != NULL) {
+      struct listing *listing = listings[i];
+      listings[i] = listing->next;
+      free(listing->dir);
+      free(listing->names);
+      free(listing->offsets);
+      free(listing->types);
+      free(listing);
+    }
+  }
+}
+
+void listing_add(void *ctx, int dir_fd, struct dirent64 *entry) {
+  struct listing_build *build = ctx;
+  struct listing *listing = build->listing;
+  size_t len = strlen(entry->d_name) + 1;
+  if (build->len + len > build->cap) {
+    build->cap = build->cap * 2 > build->len + len ? build->cap * 2 : 65536;
+    listing->names = realloc(listing->names, build->cap);
+  }
+  if (listing->count == build->capacity) {
+    build->capacity = build->capacity ? build->capacity * 2 : 1024;
+    listing->offsets =
+        realloc(listing->offsets, build->capacity * sizeof(int));
+    listing->types = realloc(listing->types, build->capacity);
+  }
+  memcpy(listing->names + build->len, entry->d_name, len);
+  listing->offsets[listing->count] = build->len;
+  listing->types[listing->count++] = entry->d_type;
+  build->len += len;
+}
+
+struct listing *listing_get(const char *dir) {
+  // the entries of dir, read on first use; NULL if it cannot be read
+  size_t hash = hash_string(dir);
+  struct listing **bucket = &listings[hash % LISTING_BUCKETS];
+  for (struct listing *listing = *bucket; listing; listing = listing->next) {
+    if (strcmp(listing->dir, dir) == 0) {
+      return listing;
+    }
+  }
+  int fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct listing *listing = calloc(1, sizeof(struct listing));
+  listing->dir = strdup(dir);
+  struct listing_build build = {listing, 0, 0, 0};
+  scan_dir(fd, listing_add, &build);
+  close(fd);
+  listing->next = *bucket;
+  *bucket = listing;
+  return listing;
+}
+
+bool has_glob(const char *word) {
+  // an unquoted *, ? or [ with a ] after it, outside of $(...)
+  char quote = 0;
+  for (const char *c = word; *c; c++) {
+    if (quote == 0 && (*c == '\'' || *c == '"')) {
+      quote = *c;
+    } else if (quote == *c) {
+      quote = 0;
+    } else if (*c == '\\' && quote != '\'' && c[1]) {
+      c++;
+    } else if (quote == 0 && c[0] == '$' && c[1] == '(') {
+      c = skip_substitution(c) - 1;
+    } else if (quote == 0 && (*c == '*' || *c == '?' ||
+                              (*c == '[' && strchr(c, ']') != NULL))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool is_pattern(const char *start, const char *end) {
+  // an unescaped pattern character between start and end
+  for (const char *c = start; c < end; c++) {
+    if (*c == '\\' && c + 1 < end) {
+      c++;
+    } else if (*c == '*' || *c == '?' || *c == '[') {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t unescape(char *out, const char *start, const char *end) {
+  // copies the text from start to end without its escapes, returns the length
+  size_t len = 0;
+  for (const char *c = start; c < end; c++) {
+    if (*c == '\\' && c + 1 < end) {
+      c++;
+    }
+    out[len++] = *c;
+  }
+  return len;
+}
+
+const char *bracket_end(const char *p, const char *end) {
+  // the ] closing the [ at p, NULL if there is none and [ is just a [
+  const char *c = p + 1;
+  if (c < end && (*c == '!' || *c == '^')) {
+    c++;
+  }
+  if (c < end && *c == ']') {
+    c++;  // []...] and [!]...] start with a ]
+  }
+  for (; c < end; c++) {
+    if (*c == '\\' && c + 1 < end) {
+      c++;
+    } else if (*c == ']') {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+bool bracket_match(const char *p, const char *close, char ch) {
+  // whether ch is in the set [p ... close]
+  const char *c = p + 1;
+  bool negate = *c == '!' || *c == '^';
+  c += negate;
+  bool found = false;
+  while (c < close) {
+    char low = *c == '\\' && c + 1 < close ? *++c : *c;
+    char high = low;
+    c++;
+    if (c + 1 < close && *c == '-') {
+      high = c[1] == '\\' && c + 2 < close ? c[2] : c[1];
+      c += c[1] == '\\' ? 3 : 2;
+    }
+    if ((unsigned char)ch >= (unsigned char)low &&
+        (unsigned char)ch <= (unsigned char)high) {
+      found = true;
+    }
+  }
+  return found != negate;
+}
+
+bool glob_match(const char *p, const char *end, const char *name) {
+  // matches name against the pattern from p to end, a mismatch after a *
+  // lets that * take one more character and tries again
+  const char *star = NULL;
+  const char *star_name = NULL;
+  while (*name || p < end) {
+    if (p < end && *p == '*') {
+      star = ++p;
+      star_name = name;
+      continue;
+    }
+    if (p < end && *name) {
+      const char *close = *p == '[' ? bracket_end(p, end) : NULL;
+      bool matched;
+      if (*p == '?') {
+        matched = true;
+        p++;
+      } else if (close != NULL) {
+        matched = bracket_match(p, close, *name);
+        p = close + 1;
+      } else {
+        p += *p == '\\' && p + 1 < end;
+        matched = *p++ == *name;
+      }
+      if (matched) {
+        name++;
+        continue;
+      }
+    }
+    if (star == NULL || *star_name == '\0') {
+      return false;
+    }
+    p = star;
+    name = ++star_name;
+  }
+  return true;
+}
+
+bool listing_is_dir(struct listing *listing, int i, const char *path,
+                    bool follow) {
+  // d_type tells for most file systems, the others need a stat
+  struct stat info;
+  switch (listing->types[i]) {
+    case DT_DIR:
+      return true;
+    case DT_UNKNOWN:
+      return (follow ? stat(path, &info) : lstat(path, &info)) == 0 &&
+             S_ISDIR(info.st_mode);
+    case DT_LNK:
+      return follow && stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+    default:
+      return false;
+  }
+}
+
+void glob_walk(struct glob_walk *walk, size_t len, const char *pattern) {
+  // matches pattern below walk->path, whose first len bytes are the
+  // directory reached so far
+  char *path = walk->path;
+  path[len] = '\0';
+  const char *slash = strchr(pattern, '/');
+  const char *end = slash ? slash : pattern + strlen(pattern);
+  const char *rest = slash ? slash + 1 : NULL;
+  struct stat info;
+
+  if (*pattern == '\0') {
+    // a trailing / only keeps directories
+    if (len > 0 && stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+      token_push(walk->tokens, arena_strndup(&parse_arena, path, len));
+    }
+    return;
+  } else if (end - pattern == 2 && pattern[0] == '*' && pattern[1] == '*') {
+    // ** is the directory itself and every directory below it, without
+    // going into hidden ones or following links
+    glob_walk(walk, len, rest ? rest : "*");
+    path[len] = '\0';
+    struct listing *listing = listing_get(path);
+    for (int i = 0; listing != NULL && i < listing->count; i++) {
+      char *name = listing->names + listing->offsets[i];
+      size_t name_len = strlen(name);
+      if (name[0] == '.' || len + name_len + 2 > PATH_MAX) {
+        continue;
+      }
+      memcpy(path + len, name, name_len + 1);
+      if (listing_is_dir(listing, i, path, false)) {
+        path[len + name_len] = '/';
+        glob_walk(walk, len + name_len + 1, pattern);
+      }
+    }
+    return;
+  } else if (!is_pattern(pattern, end)) {
+    // a plain component is looked up, not searched for
+    if (len + (end - pattern) + 2 > PATH_MAX) {
+      return;
+    }
+    size_t name_len = unescape(path + len, pattern, end);
+    path[len + name_len] = '\0';
+    if (rest != NULL) {
+      path[len + name_len] = '/';
+      glob_walk(walk, len + name_len + 1, rest);
+    } else if (lstat(path, &info) == 0) {
+      token_push(walk->tokens,
+                 arena_strndup(&parse_arena, path, len + name_len));
+    }
+    return;
+  }
+
+  // a wildcard only matches a leading . when the pattern spells it out
+  struct listing *listing = listing_get(path);
+  bool dots = pattern[0] == '.' || (pattern[0] == '\\' && pattern[1] == '.');
+  for (int i = 0; listing != NULL && i < listing->count; i++) {
+    char *name = listing->names + listing->offsets[i];
+    if ((name[0] == '.' && !dots) || !glob_match(pattern, end, name)) {
+      continue;
+    }
+    size_t name_len = strlen(name);
+    if (len + name_len + 2 > PATH_MAX) {
+      continue;
+    }
+    memcpy(path + len, name, name_len + 1);
+    if (rest == NULL) {
+      token_push(walk->tokens,
+                 arena_strndup(&parse_arena, path, len + name_len));
+    } else if (listing_is_dir(listing, i, path, true)) {
+      path[len + name_len] = '/';
+      glob_walk(walk, len + name_len + 1, rest);
+    }
+  }
+}
+
+int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void glob_word(char *pattern, struct token_list *tokens) {
+  // pushes the sorted names that pattern matches, or the pattern itself
+  // without its escapes when nothing matches
+  int first = tokens->count;
+  if (is_pattern(pattern, pattern + strlen(pattern))) {
+    static struct glob_walk walk;
+    walk.tokens = tokens;
+    size_t len = 0;
+    while (pattern[len] == '/') {
+      walk.path[len++] = '/';
+    }
+    glob_walk(&walk, len, pattern + len);
+  }
+  if (tokens->count == first) {
+    size_t len = strlen(pattern);
+    char *word = arena_alloc(&parse_arena, len + 1);
+    word[unescape(word, pattern, pattern + len)] = '\0';
+    token_push(tokens, word);
+  } else {
+    qsort(tokens->items + first, tokens->count - first, sizeof(char *),
+          compare_names);
+  }
+}
+
+/* ---- history ----
+ * The history is an append-only log, one command per line, in
+ * $CSHELL_HISTORY or ~/.cshell_history. It is mapped read-only instead of
+ * being read, and starts[] indexes the entries lazily: history_sync only
+ * looks at bytes past the indexed end, which picks up lines appended by
+ * other sessions as well as our own. Appends are single O_APPEND writes
+ * under flock, so concurrent sessions never rewrite or tear each other's
+ * entries. */
+
+struct history {
+  int fd;          // the log, -1 if there is no history
+  char *map;       // read-only view of the file
+  size_t mapped;   // bytes mapped
+  size_t indexed;  // bytes covered by starts[]
+  size_t *starts;  // offset of every complete entry
+  size_t count;
+  size_t capacity;
+};
+
+struct history history = {.fd = -1};
+char *expanded_line = NULL;  // the result of the last ! expansion
+
+void history_open() {
+  // opens the log, maps nothing yet; an empty file cannot be mapped
+  char *path = getenv("CSHELL_HISTORY");
+  char default_path[PATH_MAX];
+  if (path == NULL) {
+    char *home = getenv("HOME");
+    if (home == NULL) {
+      return;
+    }
+    snprintf(default_path, sizeof(default_path), "%s/.cshell_history", home);
+    path = default_path;
+  }
+  history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history.fd < 0) {
+    fprintf(stderr, "Cannot open file %s: ", path);
+    perror("");
+  }
+}
+
+void history_sync() {
+  // maps whatever the file has grown by and indexes the new entries
+  struct stat st;
+  if (history.fd < 0 || fstat(history.fd, &st) < 0 ||
+      (size_t)st.st_size <= history.mapped) {
+    return;
+  }
+  size_t size = st.st_size;
+  char *map = history.map
+                  ? mremap(history.map, history.mapped, size, MREMAP_MAYMOVE)
+                  : mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  history.map = map;
+  history.mapped = size;
+
+  // a line another session is still writing has no newline yet
+  char *c = map + history.indexed;
+  char *end = map + size;
+  char *newline;
+  while ((newline = memchr(c, '\n', end - c)) != NULL) {
+    if (history.count == history.capacity) {
+      history.capacity = history.capacity ? history.capacity * 2 : 1024;
+      history.starts =
+          realloc(history.starts, history.capacity * sizeof(size_t));
+    }
+    history.starts[history.count++] = c - map;
+    c = newline + 1;
+  }
+  history.indexed = c - map;
+}
+
+char *history_entry(size_t i, size_t *len) {
+  // entry i, counted from 0, without its newline
+  size_t start = history.starts[i];
+  size_t end = i + 1 < history.count ? history.starts[i + 1] : history.indexed;
+  *len = end - start - 1;
+  return history.map + start;
+}
+
+void history_add(const char *line) {
+  // appends line to the log; blank lines and repeats of the last entry are
+  // not recorded
+  size_t len = strlen(line);
+  if (history.fd < 0 || line[strspn(line, " \t")] == '\0') {
+    return;
+  }
+  history_sync();
+  size_t last_len;
+  if (history.count > 0) {
+    char *last = history_entry(history.count - 1, &last_len);
+    if (last_len == len && memcmp(last, line, len) == 0) {
+      return;
+    }
+  }
+
+  char *entry = malloc(len + 1);
+  memcpy(entry, line, len);
+  entry[len] = '\n';
+  flock(history.fd, LOCK_EX);  // one entry per write, whatever its size
+  if (write(history.fd, entry, len + 1) < 0) {
+    perror("history");
+  }
+  flock(history.fd, LOCK_UN);
+  free(entry);
+}
+
+long history_search(const char *needle, long before, bool prefix) {
+  // newest entry older than before that contains needle (or starts with it
+  // if prefix), -1 if there is none; before = count searches everything
+  size_t needle_len = strlen(needle);
+  for (long i = before - 1; i >= 0; i--) {
+    size_t len;
+    char *entry = history_entry(i, &len);
+    if (prefix ? (len >= needle_len && memcmp(entry, needle, needle_len) == 0)
+               : memmem(entry, len, needle, needle_len) != NULL) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+char *history_expand(char *line) {
+  // replaces a leading !!, !N, !-N or !prefix with the entry it names and
+  // prints the result; returns line untouched if it has no event, NULL if
+  // the event does not exist
+  char *bang = line + strspn(line, " \t");
+  if (bang[0] != '!' || bang[1] == '\0' || strchr(" \t=", bang[1])) {
+    return line;
+  }
+  char *word_end = bang + 1 + strcspn(bang + 1, " \t");
+  char *event = strndup(bang + 1, word_end - bang - 1);
+  history_sync();
+
+  long found = -1;
+  char *end;
+  long number = strtol(event, &end, 10);
+  if (strcmp(event, "!") == 0) {
+    found = (long)history.count - 1;
+  } else if (*end == '\0' && number < 0) {
+    found = (long)history.count + number;
+  } else if (*end == '\0') {
+    found = number - 1;  // history numbers from 1
+  } else {
+    found = history_search(event, history.count, true);
+  }
+  if (found < 0 || found >= (long)history.count) {
+    printf("!%s: event not found\n", event);
+    free(event);
+    return NULL;
+  }
+  free(event);
+
+  size_t len;
+  char *entry = history_entry(found, &len);
+  size_t rest = strlen(word_end);
+  free(expanded_line);
+  expanded_line = malloc(len + rest + 1);
+  memcpy(expanded_line, entry, len);
+  memcpy(expanded_line + len, word_end, rest + 1);
+  printf("%s\n", expanded_line);
+  fflush(stdout);
+  return expanded_line;
+}
+
+void print_history(struct writer *out, char **args) {
+  // history [N] shows the last N entries, history -s text searches them
+  history_sync();
+  if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+    if (args[2] == NULL) {
+      writer_printf(out, "history: -s needs the text to search for\n");
+      return;
+    }
+    for (long i = history_search(args[2], history.count, false); i >= 0;
+         i = history_search(args[2], i, false)) {
+      size_t len;
+      char *entry = history_entry(i, &len);
+      writer_printf(out, "%5ld  %.*s\n", i + 1, (int)len, entry);
+    }
+    return;
+  }
+  size_t shown = args[1] ? strtoul(args[1], NULL, 10) : history.count;
+  size_t first = shown < history.count ? history.count - shown : 0;
+  for (size_t i = first; i < history.count; i++) {
+    size_t len;
+    char *entry = history_entry(i, &len);
+    writer_printf(out, "%5zu  %.*s\n", i + 1, (int)len, entry);
+  }
+}
+
+/* ---- command hash ----
+ * Maps command names to the absolute path they resolved to in PATH so a launch
+ * is a single execv instead of one failed execve per PATH directory. The table
+ * is dropped when PATH changes or when a directory that was searched to find
+ * an entry has a new mtime (something was added to or removed from it). */
+
+#define HASH_INITIAL 64
+
+struct hash_entry {
+  char *name;     // command name, NULL if the slot is empty
+  char *path;     // absolute path it resolved to
+  int dir_index;  // index of the PATH directory it was found in
+  int hits;       // number of times the entry was used
+};
+
+struct path_dir {
+  char *dir;
+  struct timespec mtime;  // mtime when the table was last validated
+};
+
+struct hash_entry *hash_table = NULL;
+size_t hash_capacity = 0;  // always a power of two
+size_t hash_count = 0;
+char *hash_path_env = NULL;  // copy of PATH the table was built for
+struct path_dir *path_dirs = NULL;
+int path_dir_count = 0;
+
+size_t hash_string(const char *str) {
+  // FNV-1a
+  size_t hash = 14695981039346656037ULL;
+  for (; *str; str++) {
+    hash = (hash ^ (unsigned char)*str) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+void dir_mtime(const char *dir, struct timespec *mtime) {
+  struct stat st;
+  if (stat(dir, &st) == 0) {
+    *mtime = st.st_mtim;
+  } else {
+    mtime->tv_sec = -1;  // missing directories compare equal to each other
+    mtime->tv_nsec = 0;
+  }
+}
+
+void hash_clear() {
+  for (size_t i = 0; i < hash_capacity; i++) {
+    free(hash_table[i].name);
+    free(hash_table[i].path);
+  }
+  memset(hash_table, 0, hash_capacity * sizeof(struct hash_entry));
+  hash_count = 0;
+  for (int i = 0; i < path_dir_count; i++) {
+    dir_mtime(path_dirs[i].dir, &path_dirs[i].mtime);
+  }
+}
+
+void hash_load_path(const char *path_env) {
+  // splits PATH into path_dirs and empties the table
+  for (int i = 0; i < path_dir_count; i++) {
+    free(path_dirs[i].dir);
+  }
+  free(path_dirs);
+  free(hash_path_env);
+  hash_path_env = strdup(path_env);
+  path_dir_count = 0;
+
+  int count = 1;
+  for (const char *c = path_env; *c; c++) {
+    count += (*c == ':');
+  }
+  path_dirs = calloc(count, sizeof(struct path_dir));
+
+  const char *start = path_env;
+  while (1) {
+    const char *end = strchrnul(start, ':');
+    // an empty PATH entry means the current directory
+    path_dirs[path_dir_count].dir =
+        end == start ? strdup(".") : strndup(start, end - start);
+    path_dir_count++;
+    if (*end == '\0') {
+      break;
+    }
+    start = end + 1;
+  }
+
+  if (hash_table == NULL) {
+    hash_capacity = HASH_INITIAL;
+    hash_table = calloc(hash_capacity, sizeof(struct hash_entry));
+  }
+  hash_clear();
+}
+
+struct hash_entry *hash_slot(const char *name) {
+  // linear probing, returns the entry for name or the empty slot it belongs in
+  size_t i = hash_string(name) & (hash_capacity - 1);
+  while (hash_table[i].name && strcmp(hash_table[i].name, name) != 0) {
+    i = (i + 1) & (hash_capacity - 1);
+  }
+  return &hash_table[i];
+}
+
+void hash_grow() {
+  struct hash_entry *old = hash_table;
+  size_t old_capacity = hash_capacity;
+
+  hash_capacity *= 2;
+  hash_table = calloc(hash_capacity, sizeof(struct hash_entry));
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].name) {
+      *hash_slot(old[i].name) = old[i];
+    }
+  }
+  free(old);
+}
+
+bool hash_check_dirs(int upto) {
+  // true if none of the first upto + 1 PATH directories changed
+  for (int i = 0; i <= upto && i < path_dir_count; i++) {
+    struct timespec now;
+    dir_mtime(path_dirs[i].dir, &now);
+    if (now.tv_sec != path_dirs[i].mtime.tv_sec ||
+        now.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+      return false;
+    }
+  }
+  return true;
+}
+
+char *hash_lookup(const char *name) {
+  // returns the absolute path for name, or NULL if it is not in PATH
+  // names containing a slash are never looked up, they are run as given
+  if (strchr(name, '/') != NULL) {
+    return NULL;
+  }
+
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL) {
+    path_env = "/usr/bin:/bin";
+  }
+  if (hash_path_env == NULL || strcmp(hash_path_env, path_env) != 0) {
+    hash_load_path(path_env);
+  }
+
+  struct hash_entry *entry = hash_slot(name);
+  if (entry->name) {
+    if (hash_check_dirs(entry->dir_index)) {
+      entry->hits++;
+      return entry->path;
+    }
+    hash_clear();  // a directory changed, every entry may be stale
+    entry = hash_slot(name);
+  }
+
+  char full_path[PATH_MAX];
+  for (int i = 0; i < path_dir_count; i++) {
+    struct stat st;
+    snprintf(full_path, sizeof(full_path), "%s/%s", path_dirs[i].dir, name);
+    if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(full_path, X_OK) == 0) {
+      entry->name = strdup(name);
+      entry->path = strdup(full_path);
+      entry->dir_index = i;
+      entry->hits = 1;
+      hash_count++;
+      if (hash_count * 2 > hash_capacity) {
+        hash_grow();
+        entry = hash_slot(name);
+      }
+      return entry->path;
+    }
+  }
+  return NULL;
+}
+
+void exec_command(char *path, char **args, char **envp) {
+  // replaces the child with the command, path comes from hash_lookup
+  if (path != NULL) {
+    execve(path, args, envp);
+  }
+  // not in PATH (or the cached file vanished), try it as a local executable
+  if (execve(args[0], args, envp) < 0) {
+    printf("%s file could not be executed.\n", args[0]);
+    exit(1);  // exit with error status
+  }
+}
+
+/* Builtins are found through a perfect hash: builtins_init tries seeds
+ * until every name lands in a slot of its own, so a lookup is one hash and
+ * one strcmp to rule out other words, whatever the number of builtins. */
+
+#define BUILTIN_SLOTS 64  // a power of two, a few times the builtins
+
+// in the order of builtin_names
+enum builtin_id {
+  BUILTIN_CD,
+  BUILTIN_PWD,
+  BUILTIN_JOBS,
+  BUILTIN_KILL,
+  BUILTIN_FG,
+  BUILTIN_BG,
+  BUILTIN_HASH,
+  BUILTIN_LAUNCH,
+  BUILTIN_PARALLEL,
+  BUILTIN_STATS,
+  BUILTIN_HISTORY,
+  BUILTIN_EXPORT,
+  BUILTIN_UNSET,
+  BUILTIN_ECHO,
+  BUILTIN_PRINTF,
+  BUILTIN_TEST,
+  BUILTIN_BRACKET,
+  BUILTIN_TRUE,
+  BUILTIN_FALSE,
+  BUILTIN_RETURN,
+  BUILTIN_BREAK,
+  BUILTIN_CONTINUE,
+  BUILTIN_QUIT,
+  BUILTIN_COUNT
+};
+
+const char *builtin_names[] = {"cd",       "pwd",      "jobs",    "kill",
+                               "fg",       "bg",       "hash",    "launch",
+                               "parallel", "stats",    "history", "export",
+                               "unset",    "echo",     "printf",  "test",
+                               "[",        "true",     "false",   "return",
+                               "break",    "continue", "quit",    NULL};
+
+int8_t builtin_slots[BUILTIN_SLOTS];  // builtin in each slot, -1 if none
+uint32_t builtin_seed = 0;
+
+uint32_t builtin_hash(const char *name, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;  // 32 bit FNV-1a, seeded
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+  return (hash ^ (hash >> 15)) & (BUILTIN_SLOTS - 1);
+}
+
+void builtins_init() {
+  // looks for a seed without collisions, a few tries with this many slots
+  bool collision = true;
+  while (collision) {
+    builtin_seed++;
+    memset(builtin_slots, -1, sizeof(builtin_slots));
+    collision = false;
+    for (int i = 0; i < BUILTIN_COUNT && !collision; i++) {
+      uint32_t slot = builtin_hash(builtin_names[i], builtin_seed);
+      collision = builtin_slots[slot] != -1;
+      builtin_slots[slot] = i;
+    }
+  }
+}
+
+int builtin_find(const char *name) {
+  // the enum builtin_id of name, -1 if it is not a builtin
+  int id = builtin_slots[builtin_hash(name, builtin_seed)];
+  return id >= 0 && strcmp(name, builtin_names[id]) == 0 ? id : -1;
+}
+
+bool is_builtin(const char *name) {
+  // commands that eval runs itself instead of starting a job
+  return builtin_find(name) >= 0;
+}
+
+/* ---- variables ----
+ * Shell variables live in one open addressing table keyed by name, and each
+ * keeps its "NAME=value" string so an exported one goes into the
+ * environment as is. The envp array is cached: a new value for an exported
+ * variable replaces a single pointer, and the array is only rebuilt when a
+ * variable is exported or unset. environ points at the cache, so getenv,
+ * the PATH lookup and posix_spawn all see the shell's variables. */
+
+#define VARIABLES_INITIAL 64
+
+struct variable {
+  char *name;     // NULL if the slot is empty
+  char *entry;    // "NAME=value", NULL while unset
+  bool exported;
+  int env_index;  // position in env_cache, -1 if not in it
+};
+
+struct variable *variables = NULL;
+size_t variable_capacity = 0;  // always a power of two
+size_t variable_count = 0;     // slots in use, unset variables included
+char **env_cache = NULL;       // NULL terminated, also environ
+int env_count = 0;
+int env_capacity = 0;
+bool env_stale = true;  // an export or unset changed which entries belong
+
+bool is_name(const char *name, size_t len) {
+  // letters, digits and _, not starting with a digit
+  if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = name[i];
+    if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9'))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool is_assignment(const char *word) {
+  const char *equals = strchr(word, '=');
+  return equals != NULL && is_name(word, equals - word);
+}
+
+struct variable *variable_slot(const char *name, size_t len) {
+  // linear probing, the variable called name or the empty slot it goes in
+  size_t hash = 14695981039346656037ULL;  // FNV-1a, as hash_string
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+  }
+  size_t i = hash & (variable_capacity - 1);
+  while (variables[i].name && (strncmp(variables[i].name, name, len) != 0 ||
+                               variables[i].name[len] != '\0')) {
+    i = (i + 1) & (variable_capacity - 1);
+  }
+  return &variables[i];
+}
+
+void variables_grow() {
+  struct variable *old = variables;
+  size_t old_capacity = variable_capacity;
+  variable_capacity = variable_capacity ? variable_capacity * 2
+                                        : VARIABLES_INITIAL;
+  variables = calloc(variable_capacity, sizeof(struct variable));
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].name) {
+      *variable_slot(old[i].name, strlen(old[i].name)) = old[i];
+    }
+  }
+  free(old);
+}
+
+const char *variable_get(const char *name, size_t len) {
+  // the value of the variable, NULL if it is not set
+  struct variable *var = variable_slot(name, len);
+  return var->entry ? var->entry + len + 1 : NULL;
+}
+
+void env_rebuild() {
+  // collects the exported entries again after an export or unset
+  if (!env_stale) {
+    return;
+  }
+  env_count = 0;
+  for (size_t i = 0; i < variable_capacity; i++) {
+    struct variable *var = &variables[i];
+    var->env_index = -1;
+    if (var->name && var->entry && var->exported) {
+      if (env_count + 1 >= env_capacity) {
+        env_capacity = env_capacity ? env_capacity * 2 : 64;
+        env_cache = realloc(env_cache, env_capacity * sizeof(char *));
+      }
+      var->env_index = env_count;
+      env_cache[env_count++] = var->entry;
+    }
+  }
+  if (env_cache == NULL) {
+    env_capacity = 1;
+    env_cache = malloc(sizeof(char *));
+  }
+  env_cache[env_count] = NULL;
+  environ = env_cache;
+  env_stale = false;
+}
+
+void variable_set(const char *assignment, bool export) {
+  // NAME=value sets NAME, export also puts it into the environment
+  // export with a bare NAME exports the variable as it is
+  // env_rebuild has to follow once a batch of changes is done
+  const char *equals = strchr(assignment, '=');
+  size_t len = equals ? (size_t)(equals - assignment) : strlen(assignment);
+  if ((variable_count + 1) * 2 > variable_capacity) {
+    variables_grow();
+  }
+  struct variable *var = variable_slot(assignment, len);
+  if (var->name == NULL) {
+    var->name = strndup(assignment, len);
+    var->env_index = -1;
+    variable_count++;
+  }
+  if (export && !var->exported) {
+    var->exported = true;
+    env_stale = true;
+  }
+  if (equals == NULL) {
+    if (var->entry == NULL && export) {
+      var->entry = calloc(len + 2, 1);
+      memcpy(var->entry, assignment, len);
+      var->entry[len] = '=';  // export NAME of an unset NAME exports ""
+    }
+  } else {
+    char *old = var->entry;
+    var->entry = strdup(assignment);
+    if (var->exported && var->env_index >= 0 && !env_stale) {
+      env_cache[var->env_index] = var->entry;  // the one pointer that moved
+    } else if (var->exported) {
+      env_stale = true;
+    }
+    free(old);
+  }
+}
+
+void variable_unset(const char *name) {
+  struct variable *var = variable_slot(name, strlen(name));
+  if (var->name != NULL && var->entry != NULL) {
+    env_stale |= var->exported;
+    free(var->entry);
+    var->entry = NULL;
+    var->exported = false;
+  }
+}
+
+void variables_init() {
+  // every variable inherited from the environment starts out exported
+  variables_grow();
+  for (char **env = environ; *env != NULL; env++) {
+    if (is_assignment(*env)) {
+      variable_set(*env, true);
+    }
+  }
+  env_rebuild();
+}
+
+char **command_env(char **assignments, int count) {
+  // the environment for one command run as NAME=value command, in the arena
+  char **envp = arena_alloc(&parse_arena, (env_count + count + 1) *
+                                              sizeof(char *));
+  memcpy(envp, env_cache, env_count * sizeof(char *));
+  int envc = env_count;
+  for (int i = 0; i < count; i++) {
+    size_t len = strchr(assignments[i], '=') - assignments[i];
+    struct variable *var = variable_slot(assignments[i], len);
+    int at = envc;
+    if (var->name && var->exported && var->env_index >= 0) {
+      at = var->env_index;
+    }
+    for (int j = env_count; j < envc; j++) {
+      if (strncmp(envp[j], assignments[i], len + 1) == 0) {
+        at = j;  // the same name twice in the prefix, the last one wins
+      }
+    }
+    envp[at] = assignments[i];
+    envc += (at == envc);
+  }
+  envp[envc] = NULL;
+  return envp;
+}
+
+void print_variables(struct writer *out) {
+  // export without arguments lists the environment
+  for (int i = 0; i < env_count; i++) {
+    char *equals = strchr(env_cache[i], '=');
+    writer_printf(out, "export %.*s=\"%s\"\n", (int)(equals - env_cache[i]),
+                  env_cache[i], equals + 1);
+  }
+}
+
+/* ---- utilities ----
+ * echo, printf, test, [, true and false run inside the shell, scripts call
+ * them far too often to start a process each time. They print through the
+ * writers of their redirections like every other builtin, in a pipeline
+ * they run in the forked copy of the shell without an exec, and each
+ * returns the status it leaves in $?. */
+
+struct test_parser {
+  char **args;
+  int count;
+  int at;  // next argument to read
+  struct writer *err;
+  bool failed;  // a usage error was printed, the status is 2
+};
+
+bool is_utility(int builtin_id) {
+  return builtin_id >= BUILTIN_ECHO && builtin_id <= BUILTIN_FALSE;
+}
+
+const char *read_escape(const char *c, int *ch) {
+  // c is just past a \, sets *ch to what the escape stands for and returns
+  // where the text goes on; *ch is -1 for \c, which ends all output
+  switch (*c) {
+    case 'a':
+      *ch = '\a';
+      break;
+    case 'b':
+      *ch = '\b';
+      break;
+    case 'c':
+      *ch = -1;
+      break;
+    case 'e':
+      *ch = '\x1b';
+      break;
+    case 'f':
+      *ch = '\f';
+      break;
+    case 'n':
+      *ch = '\n';
+      break;
+    case 'r':
+      *ch = '\r';
+      break;
+    case 't':
+      *ch = '\t';
+      break;
+    case 'v':
+      *ch = '\v';
+      break;
+    case '\\':
+      *ch = '\\';
+      break;
+    default:
+      if (*c >= '0' && *c <= '7') {
+        // \0nnn and \nnn are both octal
+        int digits = *c == '0' ? 4 : 3;
+        int value = 0;
+        for (int i = 0; i < digits && *c >= '0' && *c <= '7'; i++) {
+          value = value * 8 + (*c++ - '0');
+        }
+        *ch = value & 0xff;
+        return c;
+      }
+      *ch = '\\';  // not an escape, the \ stays
+      return c;
+  }
+  return c + 1;
+}
+
+bool put_escaped(struct writer *out, const char *text) {
+  // writes text with its escapes replaced, false if a \c ended it
+  while (*text) {
+    size_t plain = strcspn(text, "\\");
+    writer_put(out, text, plain);
+    text += plain;
+    if (*text == '\\') {
+      int ch;
+      text = read_escape(text + 1, &ch);
+      if (ch < 0) {
+        return false;
+      }
+      char byte = ch;
+      writer_put(out, &byte, 1);
+    }
+  }
+  return true;
+}
+
+int run_echo(char **args, struct writer *out) {
+  // echo [-neE] [words], -n leaves out the newline, -e turns escapes on and
+  // -E off again
+  bool newline = true;
+  bool escapes = false;
+  int i = 1;
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' &&
+         args[i][1 + strspn(args[i] + 1, "neE")] == '\0';
+       i++) {
+    for (char *c = args[i] + 1; *c; c++) {
+      newline = newline && *c != 'n';
+      escapes = *c == 'e' || (escapes && *c != 'E');
+    }
+  }
+  for (; args[i] != NULL; i++) {
+    if (!escapes) {
+      writer_put(out, args[i], strlen(args[i]));
+    } else if (!put_escaped(out, args[i])) {
+      return 0;  // \c, not even the newline
+    }
+    if (args[i + 1] != NULL) {
+      writer_put(out, " ", 1);
+    }
+  }
+  if (newline) {
+    writer_put(out, "\n", 1);
+  }
+  return 0;
+}
+
+bool printf_number(const char *value, long long *number) {
+  // a number the way printf reads it, 'c for the code of c; false if value
+  // is not a number, *number is then what could be read of it
+  if (value[0] == '\'' || value[0] == '"') {
+    *number = (unsigned char)value[1];
+    return true;
+  }
+  char *end;
+  errno = 0;
+  *number = strtoll(value, &end, 0);
+  return *end == '\0' && errno == 0;
+}
+
+int run_printf(char **args, struct writer *out, struct writer *err) {
+  // printf format [arguments], the format is used again as long as it takes
+  // arguments and some are left
+  if (args[1] == NULL) {
+    writer_printf(err, "printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+  const char *format = args[1];
+  char **arg = args + 2;
+  int status = 0;
+  char **first;
+  do {
+    first = arg;
+    for (const char *c = format; *c;) {
+      if (*c == '\\') {
+        int ch;
+        c = read_escape(c + 1, &ch);
+        if (ch < 0) {
+          return status;
+        }
+        char byte = ch;
+        writer_put(out, &byte, 1);
+        continue;
+      } else if (*c != '%') {
+        size_t plain = strcspn(c, "\\%");
+        writer_put(out, c, plain);
+        c += plain;
+        continue;
+      } else if (c[1] == '%') {
+        writer_put(out, "%", 1);
+        c += 2;
+        continue;
+      }
+
+      // flags, width and precision go to writer_printf as they are
+      size_t len = 1 + strspn(c + 1, "-+ #0");
+      len += strspn(c + len, "0123456789");
+      if (c[len] == '.') {
+        len++;
+        len += strspn(c + len, "0123456789");
+      }
+      char conversion = c[len];
+      if (conversion == '\0' || strchr("sbcdiouxXeEfgG", conversion) == NULL ||
+          len > 16) {
+        writer_printf(err, "printf: %.*s: invalid conversion\n",
+                      (int)len + (conversion != '\0'), c);
+        return 1;
+      }
+      char spec[24];
+      memcpy(spec, c, len);
+      spec[len] = '\0';
+      c += len + 1;
+      const char *value = *arg != NULL ? *arg++ : "";
+
+      long long number;
+      if (conversion == 's') {
+        strcat(spec, "s");
+        writer_printf(out, spec, value);
+      } else if (conversion == 'b') {
+        if (!put_escaped(out, value)) {
+          return status;
+        }
+      } else if (conversion == 'c') {
+        strcat(spec, "c");
+        if (*value) {
+          writer_printf(out, spec, *value);
+        }
+      } else if (strchr("eEfgG", conversion) != NULL) {
+        char *end;
+        double real = strtod(value, &end);
+        if (*end != '\0') {
+          writer_printf(err, "printf: %s: invalid number\n", value);
+          status = 1;
+        }
+        strncat(spec, &conversion, 1);
+        writer_printf(out, spec, real);
+      } else {
+        if (!printf_number(value, &number)) {
+          writer_printf(err, "printf: %s: invalid number\n", value);
+          status = 1;
+        }
+        strcat(spec, "ll");
+        strncat(spec, &conversion, 1);
+        writer_printf(out, spec, number);
+      }
+    }
+  } while (*arg != NULL && arg > first);
+  return status;
+}
+
+bool test_integer(struct test_parser *p, const char *text, long long *number) {
+  char *end;
+  errno = 0;
+  *number = strtoll(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0) {
+    writer_printf(p->err, "test: %s: integer expression expected\n", text);
+    p->failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool is_test_binary(const char *op) {
+  static const char *ops[] = {"=",   "==",  "!=",  "<",   ">",   "-eq",
+                              "-ne", "-lt", "-le", "-gt", "-ge", "-nt",
+                              "-ot", "-ef", NULL};
+  for (int i = 0; ops[i] != NULL; i++) {
+    if (strcmp(op, ops[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool test_binary(struct test_parser *p, const char *left, const char *op,
+                 const char *right) {
+  if (op[0] != '-') {
+    int order = strcmp(left, right);
+    return op[0] == '!' ? order != 0
+           : op[0] == '<' ? order < 0
+           : op[0] == '>' ? order > 0
+                          : order == 0;
+  }
+  struct stat a;
+  struct stat b;
+  bool both = stat(left, &a) == 0 && stat(right, &b) == 0;
+  if (strcmp(op, "-nt") == 0) {
+    return both ? a.st_mtime > b.st_mtime : stat(left, &a) == 0;
+  } else if (strcmp(op, "-ot") == 0) {
+    return both ? a.st_mtime < b.st_mtime : stat(right, &b) == 0;
+  } else if (strcmp(op, "-ef") == 0) {
+    return both && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+  }
+  long long x;
+  long long y;
+  if (!test_integer(p, left, &x) || !test_integer(p, right, &y)) {
+    return false;
+  }
+  switch (op[1] << 8 | op[2]) {
+    case 'e' << 8 | 'q':
+      return x == y;
+    case 'n' << 8 | 'e':
+      return x != y;
+    case 'l' << 8 | 't':
+      return x < y;
+    case 'l' << 8 | 'e':
+      return x <= y;
+    case 'g' << 8 | 't':
+      return x > y;
+    default:
+      return x >= y;
+  }
+}
+
+bool test_unary(struct test_parser *p, char op, const char *operand) {
+  // op is the letter of -op, already known to be one of test's
+  struct stat info;
+  if (op == 'z' || op == 'n') {
+    return (*operand == '\0') == (op == 'z');
+  } else if (op == 't') {
+    long long fd;
+    return test_integer(p, operand, &fd) && fd >= 0 && fd <= INT_MAX &&
+           isatty(fd);
+  } else if (op == 'r' || op == 'w' || op == 'x') {
+    return access(operand, op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK) == 0;
+  } else if (op == 'h' || op == 'L') {
+    return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode);
+  } else if (stat(operand, &info) < 0) {
+    return false;
+  }
+  switch (op) {
+    case 'b':
+      return S_ISBLK(info.st_mode);
+    case 'c':
+      return S_ISCHR(info.st_mode);
+    case 'd':
+      return S_ISDIR(info.st_mode);
+    case 'f':
+      return S_ISREG(info.st_mode);
+    case 'p':
+      return S_ISFIFO(info.st_mode);
+    case 'S':
+      return S_ISSOCK(info.st_mode);
+    case 's':
+      return info.st_size > 0;
+    case 'g':
+      return info.st_mode & S_ISGID;
+    case 'u':
+      return info.st_mode & S_ISUID;
+    case 'k':
+      return info.st_mode & S_ISVTX;
+    case 'O':
+      return info.st_uid == geteuid();
+    case 'G':
+      return info.st_gid == getegid();
+    default:
+      return true;  // -e
+  }
+}
+
+bool test_or(struct test_parser *p);
+
+bool test_primary(struct test_parser *p) {
+  // ( expression ), a unary or binary test or a string that is true when it
+  // is not empty; a word is an operator only where it can be one
+  if (p->at >= p->count) {
+    writer_printf(p->err, "test: argument expected\n");
+    p->failed = true;
+    return false;
+  }
+  char **args = p->args + p->at;
+  int left = p->count - p->at;
+  if (left >= 3 && is_test_binary(args[1])) {
+    p->at += 3;
+    return test_binary(p, args[0], args[1], args[2]);
+  } else if (left >= 2 && strcmp(args[0], "!") == 0) {
+    p->at++;
+    return !test_primary(p);
+  } else if (left >= 2 && strcmp(args[0], "(") == 0) {
+    p->at++;
+    bool result = test_or(p);
+    if (p->at >= p->count || strcmp(p->args[p->at], ")") != 0) {
+      writer_printf(p->err, "test: ) expected\n");
+      p->failed = true;
+    }
+    p->at++;
+    return result;
+  } else if (left >= 2 && args[0][0] == '-' && args[0][1] != '\0' &&
+             args[0][2] == '\0' &&
+             strchr("bcdefghknprstuwxzLOGS", args[0][1]) != NULL) {
+    p->at += 2;
+    return test_unary(p, args[0][1], args[1]);
+  }
+  p->at++;
+  return args[0][0] != '\0';
+}
+
+bool test_and(struct test_parser *p) {
+  bool result = test_primary(p);
+  while (!p->failed && p->at < p->count && strcmp(p->args[p->at], "-a") == 0) {
+    p->at++;
+    result = test_primary(p) && result;
+  }
+  return result;
+}
+
+bool test_or(struct test_parser *p) {
+  bool result = test_and(p);
+  while (!p->failed && p->at < p->count && strcmp(p->args[p->at], "-o") == 0) {
+    p->at++;
+    result = test_and(p) || result;
+  }
+  return result;
+}
+
+int run_test(char **args, struct writer *err) {
+  // test expression or [ expression ]: 0 if it holds, 1 if not, 2 if it
+  // could not be read
+  int count = 0;
+  while (args[count + 1] != NULL) {
+    count++;
+  }
+  if (strcmp(args[0], "[") == 0) {
+    if (count == 0 || strcmp(args[count], "]") != 0) {
+      writer_printf(err, "[: missing ]\n");
+      return 2;
+    }
+    count--;
+  }
+  if (count == 0) {
+    return 1;  // nothing is false
+  }
+  struct test_parser p = {args + 1, count, 0, err, false};
+  bool result = test_or(&p);
+  if (!p.failed && p.at < p.count) {
+    writer_printf(err, "test: %s: unexpected argument\n", p.args[p.at]);
+    p.failed = true;
+  }
+  return p.failed ? 2 : !result;
+}
+
+int run_utility(int builtin_id, char **args, struct writer *out,
+                struct writer *err) {
+  switch (builtin_id) {
+    case BUILTIN_ECHO:
+      return run_echo(args, out);
+    case BUILTIN_PRINTF:
+      return run_printf(args, out, err);
+    case BUILTIN_TEST:
+    case BUILTIN_BRACKET:
+      return run_test(args, err);
+    case BUILTIN_TRUE:
+      return 0;
+    default:
+      return 1;  // false
+  }
+}
+
+/* ---- completion ----
+ * Command names complete from a trie of every executable in PATH. It is
+ * built on the first TAB and afterwards only the directories whose mtime
+ * changed are scanned again, so a PATH with tens of thousands of programs
+ * costs one stat per directory per TAB. Each name counts the directories
+ * that provide it and each node the names below it, so names can be taken
+ * out again and dead branches are skipped. Files complete from a
+ * getdents64 scan of the directory, made when TAB is pressed. */
+
+#define DIRENT_BATCH 32768
+#define COMPLETION_SHOWN 100  // candidates listed at most
+
+struct trie_node {
+  int child;    // first child, children are sorted by c; -1 if none
+  int sibling;  // next child of the same parent, -1 if none
+  int refs;     // PATH directories that have this name, 0 if not a name
+  int live;     // names in the whole subtree
+  char c;
+};
+
+struct completion_dir {
+  char *path;
+  struct timespec mtime;  // when names was scanned
+  char **names;           // executables found in it
+  int name_count;
+};
+
+struct trie_node *trie = NULL;  // node 0 is the root
+int trie_count = 0;
+int trie_capacity = 0;
+struct completion_dir *completion_dirs = NULL;
+int completion_dir_count = 0;
+char *completion_path_env = NULL;  // copy of PATH the trie was built for
+
+struct arena completion_arena;  // reset on every TAB
+
+struct candidates {
+  char **names;
+  bool *is_dir;
+  int count;     // collected, at most COMPLETION_SHOWN + 1
+  int total;     // matches, also the ones not collected
+  char *common;  // longest common prefix of every match
+};
+
+void scan_dir(int dir_fd, void (*found)(void *ctx, int dir_fd,
+                                        struct dirent64 *entry),
+              void *ctx) {
+  // calls found for every entry of dir_fd but . and .., reading the
+  // directory in large getdents64 batches
+  char *buf = malloc(DIRENT_BATCH);
+  ssize_t n;
+  while ((n = getdents64(dir_fd, buf, DIRENT_BATCH)) > 0) {
+    for (ssize_t at = 0; at < n;) {
+      struct dirent64 *entry = (struct dirent64 *)(buf + at);
+      at += entry->d_reclen;
+      char *name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      found(ctx, dir_fd, entry);
+    }
+  }
+  free(buf);
+}
+
+bool entry_is_dir(int dir_fd, struct dirent64 *entry) {
+  // d_type is enough unless it is a symlink or the file system does not
+  // fill it in
+  if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+    return entry->d_type == DT_DIR;
+  }
+  struct stat st;
+  return fstatat(dir_fd, entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+int trie_node_new(char c) {
+  if (trie_count == trie_capacity) {
+    trie_capacity = trie_capacity ? trie_capacity * 2 : 4096;
+    trie = realloc(trie, trie_capacity * sizeof(struct trie_node));
+  }
+  trie[trie_count] = (struct trie_node){-1, -1, 0, 0, c};
+  return trie_count++;
+}
+
+int trie_child(int node, char c, bool create) {
+  // the child of node for c, -1 if there is none and create is false
+  int *link = &trie[node].child;  // kept sorted for listing in order
+  while (*link != -1 && trie[*link].c < c) {
+    link = &trie[*link].sibling;
+  }
+  if (*link != -1 && trie[*link].c == c) {
+    return *link;
+  } else if (!create) {
+    return -1;
+  }
+  int fresh = trie_node_new(c);  // may move trie, find the link again
+  link = &trie[node].child;
+  while (*link != -1 && trie[*link].c < c) {
+    link = &trie[*link].sibling;
+  }
+  trie[fresh].sibling = *link;
+  *link = fresh;
+  return fresh;
+}
+
+void trie_update(const char *name, int delta) {
+  // adds (delta 1) or removes (delta -1) one directory's copy of name
+  if (trie == NULL) {
+    trie_node_new('\0');
+  }
+  int node = 0;
+  for (const char *c = name; *c; c++) {
+    node = trie_child(node, *c, true);
+  }
+  bool was_name = trie[node].refs > 0;
+  trie[node].refs += delta;
+  int change = (trie[node].refs > 0) - was_name;
+  if (change == 0) {
+    return;  // another directory has it too
+  }
+  node = 0;
+  trie[node].live += change;
+  for (const char *c = name; *c; c++) {
+    node = trie_child(node, *c, false);
+    trie[node].live += change;
+  }
+}
+
+int trie_find(const char *prefix) {
+  // node reached by prefix, -1 if no name starts with it
+  int node = trie ? 0 : -1;
+  for (const char *c = prefix; *c && node != -1; c++) {
+    node = trie_child(node, *c, false);
+  }
+  return (node != -1 && trie[node].live > 0) ? node : -1;
+}
+
+void trie_collect(int node, char *name, int len, struct candidates *found) {
+  // lists the names below node in order, name holds the first len chars
+  if (trie[node].refs > 0 && found->count <= COMPLETION_SHOWN) {
+    found->is_dir[found->count] = false;
+    found->names[found->count++] = arena_strndup(&completion_arena, name, len);
+  }
+  for (int child = trie[node].child; child != -1;
+       child = trie[child].sibling) {
+    if (trie[child].live > 0 && found->count <= COMPLETION_SHOWN &&
+        len < PATH_MAX - 1) {
+      name[len] = trie[child].c;
+      trie_collect(child, name, len + 1, found);
+    }
+  }
+}
+
+void add_executable(void *ctx, int dir_fd, struct dirent64 *entry) {
+  struct completion_dir *dir = ctx;
+  if (entry->d_type == DT_DIR || faccessat(dir_fd, entry->d_name, X_OK, 0) ||
+      entry_is_dir(dir_fd, entry)) {
+    return;
+  }
+  if ((dir->name_count & (dir->name_count - 1)) == 0) {
+    // grows at every power of two
+    dir->names = realloc(dir->names, (dir->name_count ? dir->name_count * 2
+                                                      : 1) *
+                                         sizeof(char *));
+  }
+  dir->names[dir->name_count++] = strdup(entry->d_name);
+  trie_update(entry->d_name, 1);
+}
+
+void completion_drop_dir(struct completion_dir *dir) {
+  for (int i = 0; i < dir->name_count; i++) {
+    trie_update(dir->names[i], -1);
+    free(dir->names[i]);
+  }
+  free(dir->names);
+  dir->names = NULL;
+  dir->name_count = 0;
+}
+
+void completion_refresh() {
+  // brings the trie up to date with PATH, rescanning changed directories
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL) {
+    path_env = "/usr/bin:/bin";
+  }
+  if (completion_path_env == NULL ||
+      strcmp(completion_path_env, path_env) != 0) {
+    for (int i = 0; i < completion_dir_count; i++) {
+      completion_drop_dir(&completion_dirs[i]);
+      free(completion_dirs[i].path);
+    }
+    free(completion_dirs);
+    free(completion_path_env);
+    completion_path_env = strdup(path_env);
+
+    completion_dir_count = 1;
+    for (const char *c = path_env; *c; c++) {
+      completion_dir_count += (*c == ':');
+    }
+    completion_dirs =
+        calloc(completion_dir_count, sizeof(struct completion_dir));
+    const char *start = path_env;
+    for (int i = 0; i < completion_dir_count; i++) {
+      const char *end = strchrnul(start, ':');
+      completion_dirs[i].path =
+          end == start ? strdup(".") : strndup(start, end - start);
+      completion_dirs[i].mtime.tv_sec = -2;  // never scanned
+      start = end + 1;
+    }
+  }
+
+  for (int i = 0; i < completion_dir_count; i++) {
+    struct completion_dir *dir = &completion_dirs[i];
+    struct timespec now;
+    dir_mtime(dir->path, &now);
+    if (now.tv_sec == dir->mtime.tv_sec && now.tv_nsec == dir->mtime.tv_nsec) {
+      continue;
+    }
+    completion_drop_dir(dir);
+    dir->mtime = now;
+    int dir_fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      scan_dir(dir_fd, add_executable, dir);
+      close(dir_fd);
+    }
+  }
+}
+
+void common_prefix(struct candidates *found, const char *name) {
+  // shortens found->common to what it shares with name
+  if (found->common == NULL) {
+    found->common = arena_strndup(&completion_arena, name, strlen(name));
+    return;
+  }
+  size_t same = 0;
+  while (found->common[same] && found->common[same] == name[same]) {
+    same++;
+  }
+  found->common[same] = '\0';
+}
+
+void candidate_add(struct candidates *found, const char *name, bool is_dir) {
+  // keeps the first few names and the common prefix of all of them
+  common_prefix(found, name);
+  found->total++;
+  if (found->count <= COMPLETION_SHOWN) {
+    found->is_dir[found->count] = is_dir;
+    found->names[found->count++] =
+        arena_strndup(&completion_arena, name, strlen(name));
+  }
+}
+
+struct file_match {
+  struct candidates *found;
+  const char *prefix;
+  size_t prefix_len;
+};
+
+void add_file_match(void *ctx, int dir_fd, struct dirent64 *entry) {
+  struct file_match *match = ctx;
+  if (strncmp(entry->d_name, match->prefix, match->prefix_len) != 0 ||
+      (entry->d_name[0] == '.' && match->prefix[0] != '.')) {
+    return;  // hidden files only complete when asked for
+  }
+  candidate_add(match->found, entry->d_name, entry_is_dir(dir_fd, entry));
+}
+
+void complete_command(const char *prefix, struct candidates *found) {
+  completion_refresh();
+  for (int i = 0; builtin_names[i] != NULL; i++) {
+    int node = trie_find(builtin_names[i]);
+    if (strncmp(builtin_names[i], prefix, strlen(prefix)) == 0 &&
+        (node == -1 || trie[node].refs == 0)) {
+      candidate_add(found, builtin_names[i], false);  // not also in PATH
+    }
+  }
+  int node = trie_find(prefix);
+  if (node == -1) {
+    return;
+  }
+
+  // every name below node shares the prefix up to where it branches
+  char name[PATH_MAX];
+  int len = strlen(prefix);
+  memcpy(name, prefix, len);
+  int end = node;
+  while (trie[end].refs == 0 && len < PATH_MAX - 1) {
+    int only = -1;
+    for (int child = trie[end].child; child != -1;
+         child = trie[child].sibling) {
+      if (trie[child].live > 0) {
+        only = only == -1 ? child : -2;
+      }
+    }
+    if (only < 0) {
+      break;
+    }
+    name[len++] = trie[only].c;
+    end = only;
+  }
+  name[len] = '\0';
+  common_prefix(found, name);
+  found->total += trie[node].live;
+
+  len = strlen(prefix);
+  memcpy(name, prefix, len);
+  trie_collect(node, name, len, found);
+}
+
+void complete_file(const char *word, struct candidates *found) {
+  // completes the last part of word inside the directory the rest names
+  const char *slash = strrchr(word, '/');
+  const char *prefix = slash ? slash + 1 : word;
+  char *dir = slash ? arena_strndup(&completion_arena, word, slash - word + 1)
+                    : ".";
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return;
+  }
+  struct file_match match = {found, prefix, strlen(prefix)};
+  scan_dir(dir_fd, add_file_match, &match);
+  close(dir_fd);
+}
+
+/* ---- line editor ----
+ * On a terminal the line is edited in raw mode. Keys are read through the
+ * event loop like everything else, so jobs are still reaped while the user
+ * types. ^R searches the history backwards, TAB completes. */
+
+enum edit_result { EDIT_MORE, EDIT_ACCEPT, EDIT_EOF };
+
+struct line_editor {
+  char *buf;  // the line, always NUL terminated
+  size_t len;
+  size_t cap;
+  size_t cursor;
+  int esc_state;  // 0, 1 after ESC, 2 inside ESC [ ... or ESC O ...
+  int esc_arg;    // number in ESC [ n ~
+  long history_pos;  // entry shown by up and down, history.count if none
+  char *typed;       // the new line while walking through the history
+  bool searching;    // ^R is active
+  char search[256];
+  size_t search_len;
+  long match;  // entry found by the search, -1 if none
+};
+
+struct line_editor editor;
+bool editor_enabled = false;  // stdin and stdout are a terminal
+struct termios cooked_mode;    // terminal settings outside the editor
+char edit_pending[4096];       // keys read but not handled yet
+size_t edit_pending_len = 0;
+
+void raw_mode(bool on) {
+  if (!on) {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked_mode);
+    return;
+  }
+  struct termios raw = cooked_mode;
+  // ^C, ^Z and ^R are keys while editing, output processing stays on
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_iflag &= ~(IXON | ICRNL);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+void edit_reserve(size_t len) {
+  if (len + 1 > editor.cap) {
+    editor.cap = editor.cap ? editor.cap * 2 : 256;
+    if (editor.cap < len + 1) {
+      editor.cap = len + 1;
+    }
+    editor.buf = realloc(editor.buf, editor.cap);
+  }
+}
+
+void edit_set(const char *text, size_t len) {
+  // replaces the whole line, the cursor goes to the end
+  edit_reserve(len);
+  memmove(editor.buf, text, len);
+  editor.buf[len] = '\0';
+  editor.len = editor.cursor = len;
+}
+
+void edit_insert(const char *text, size_t len) {
+  edit_reserve(editor.len + len);
+  memmove(editor.buf + editor.cursor + len, editor.buf + editor.cursor,
+          editor.len - editor.cursor + 1);
+  memcpy(editor.buf + editor.cursor, text, len);
+  editor.len += len;
+  editor.cursor += len;
+}
+
+void edit_delete(size_t from, size_t to) {
+  memmove(editor.buf + from, editor.buf + to, editor.len - to + 1);
+  editor.len -= to - from;
+  editor.cursor = from;
+}
+
+void edit_redraw() {
+  // one terminal line: prompt and text, then the cursor is put back
+  struct writer out = {.fd = STDOUT_FILENO};
+  if (editor.searching) {
+    size_t len = 0;
+    char *found = editor.match >= 0 ? history_entry(editor.match, &len) : "";
+    writer_printf(&out, "\r(reverse-i-search)`%s': %.*s\x1b[K", editor.search,
+                  (int)len, found);
+  } else {
+    writer_printf(&out, "\r%s%s\x1b[K\r\x1b[%zuC", prompt, editor.buf,
+                  strlen(prompt) + editor.cursor);
+  }
+  writer_flush(&out);
+}
+
+void edit_history(long pos) {
+  // shows entry pos, or the line being typed when pos is history.count
+  history_sync();
+  if (pos < 0 || pos > (long)history.count) {
+    return;
+  }
+  if (editor.history_pos == (long)history.count) {
+    free(editor.typed);
+    editor.typed = strdup(editor.buf);
+  }
+  editor.history_pos = pos;
+  if (pos == (long)history.count) {
+    edit_set(editor.typed, strlen(editor.typed));
+  } else {
+    size_t len;
+    char *entry = history_entry(pos, &len);
+    edit_set(entry, len);
+  }
+}
+
+void edit_search(long before) {
+  // finds the next older entry containing the search text
+  history_sync();
+  long found = history_search(editor.search, before, false);
+  if (found >= 0) {
+    editor.match = found;
+  } else {
+    write(STDOUT_FILENO, "\a", 1);
+  }
+}
+
+void show_candidates(struct candidates *found) {
+  // lists them in columns under the line, the line is redrawn afterwards
+  struct winsize size;
+  int width = 80;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+    width = size.ws_col;
+  }
+  int longest = 1;
+  int shown = found->count < COMPLETION_SHOWN ? found->count : COMPLETION_SHOWN;
+  for (int i = 0; i < shown; i++) {
+    int len = strlen(found->names[i]) + found->is_dir[i];
+    longest = len > longest ? len : longest;
+  }
+  int columns = width / (longest + 2);
+  columns = columns > 0 ? columns : 1;
+
+  struct writer out = {.fd = STDOUT_FILENO};
+  writer_printf(&out, "\n");
+  for (int i = 0; i < shown; i++) {
+    bool last = (i + 1) % columns == 0 || i + 1 == shown;
+    writer_printf(&out, "%s%s%*s", found->names[i],
+                  found->is_dir[i] ? "/" : "",
+                  last ? 0
+                       : longest + 2 - (int)strlen(found->names[i]) -
+                             found->is_dir[i],
+                  "");
+    if (last) {
+      writer_printf(&out, "\n");
+    }
+  }
+  if (found->total > shown) {
+    writer_printf(&out, "... and %d more\n", found->total - shown);
+  }
+  writer_flush(&out);
+}
+
+void edit_complete() {
+  // completes the word before the cursor as a command or a file name
+  size_t start = editor.cursor;
+  while (start > 0 && !strchr(" \t|&;<>", editor.buf[start - 1])) {
+    start--;
+  }
+  size_t before = start;
+  while (before > 0 && strchr(" \t", editor.buf[before - 1])) {
+    before--;
+  }
+  char *word = strndup(editor.buf + start, editor.cursor - start);
+  bool command = (before == 0 || strchr("|&;", editor.buf[before - 1])) &&
+                 strchr(word, '/') == NULL;
+
+  // a > continuation line is completed while the tokens of the lines
+  // before it still live in parse_arena, so completion has its own
+  arena_reset(&completion_arena);
+  struct candidates found = {0};
+  found.names = arena_alloc(&completion_arena,
+                            (COMPLETION_SHOWN + 1) * sizeof(char *));
+  found.is_dir = arena_alloc(&completion_arena, COMPLETION_SHOWN + 1);
+  if (command) {
+    complete_command(word, &found);
+  } else {
+    complete_file(word, &found);
+  }
+
+  const char *typed = strrchr(word, '/') ? strrchr(word, '/') + 1 : word;
+  size_t typed_len = strlen(typed);
+  if (found.total == 0) {
+    write(STDOUT_FILENO, "\a", 1);
+  } else if (strlen(found.common) > typed_len || found.total == 1) {
+    // insert what every match agrees on, escaping what the lexer would split
+    for (char *c = found.common + typed_len; *c; c++) {
+      if (strchr(" \t\\'\"|&;<>#*?[$", *c)) {
+        edit_insert("\\", 1);
+      }
+      edit_insert(c, 1);
+    }
+    if (found.total == 1) {
+      edit_insert(found.is_dir[0] ? "/" : " ", 1);
+    }
+  } else {
+    show_candidates(&found);
+  }
+  free(word);
+}
+
+enum edit_result edit_key(unsigned char key) {
+  // handles one byte of input
+  if (editor.esc_state == 1) {
+    editor.esc_state = (key == '[' || key == 'O') ? 2 : 0;
+    editor.esc_arg = 0;
+    return EDIT_MORE;
+  } else if (editor.esc_state == 2) {
+    if (key >= '0' && key <= '9') {
+      editor.esc_arg = editor.esc_arg * 10 + key - '0';
+      return EDIT_MORE;
+    } else if (key < 0x40) {
+      return EDIT_MORE;  // ; and other parameter bytes
+    }
+    editor.esc_state = 0;
+    // the final byte names the key, keys as ESC [ n ~ use n
+    if (key == '~') {
+      key = editor.esc_arg == 3                         ? 4
+            : editor.esc_arg == 1 || editor.esc_arg == 7 ? 1
+            : editor.esc_arg == 4 || editor.esc_arg == 8 ? 5
+                                                         : 0;
+    } else {
+      key = key == 'A'   ? 16
+            : key == 'B' ? 14
+            : key == 'C' ? 6
+            : key == 'D' ? 2
+            : key == 'H' ? 1
+            : key == 'F' ? 5
+                         : 0;
+    }
+    if (key == 0) {
+      return EDIT_MORE;
+    }
+    if (key == 4 && editor.cursor == editor.len) {
+      return EDIT_MORE;  // delete at the end, not end of input
+    }
+  }
+
+  if (editor.searching) {
+    // ^R mode: text goes into the search, most other keys take the match
+    if (key == 18) {
+      edit_search(editor.match >= 0 ? editor.match : (long)history.count);
+      return EDIT_MORE;
+    } else if (key == 127 || key == 8) {
+      editor.search_len -= editor.search_len > 0;
+      editor.search[editor.search_len] = '\0';
+      editor.match = -1;
+      edit_search(history.count);
+      return EDIT_MORE;
+    } else if (key >= 32 && key != 127 &&
+               editor.search_len + 1 < sizeof(editor.search)) {
+      editor.search[editor.search_len++] = key;
+      editor.search[editor.search_len] = '\0';
+      edit_search(editor.match >= 0 ? editor.match + 1 : (long)history.count);
+      return EDIT_MORE;
+    }
+    editor.searching = false;
+    if (key == 3 || key == 7) {
+      return EDIT_MORE;  // ^C and ^G give the line back unchanged
+    }
+    if (editor.match >= 0) {
+      size_t len;
+      char *entry = history_entry(editor.match, &len);
+      edit_set(entry, len);
+    }
+    if (key == 27) {
+      return EDIT_MORE;
+    }
+  }
+
+  switch (key) {
+    case '\r':
+    case '\n':
+      return EDIT_ACCEPT;
+    case 1:  // ^A, home
+      editor.cursor = 0;
+      break;
+    case 2:  // ^B, left
+      editor.cursor -= editor.cursor > 0;
+      break;
+    case 3:  // ^C drops the line
+      write(STDOUT_FILENO, "^C\n", 3);
+      edit_set("", 0);
+      break;
+    case 4:  // ^D, end of input on an empty line, delete otherwise
+      if (editor.len == 0) {
+        return EDIT_EOF;
+      }
+      if (editor.cursor < editor.len) {
+        edit_delete(editor.cursor, editor.cursor + 1);
+      }
+      break;
+    case 5:  // ^E, end
+      editor.cursor = editor.len;
+      break;
+    case 6:  // ^F, right
+      editor.cursor += editor.cursor < editor.len;
+      break;
+    case 8:  // ^H and backspace
+    case 127:
+      if (editor.cursor > 0) {
+        edit_delete(editor.cursor - 1, editor.cursor);
+      }
+      break;
+    case '\t':
+      edit_complete();
+      break;
+    case 11:  // ^K cuts to the end
+      edit_delete(editor.cursor, editor.len);
+      editor.cursor = editor.len;
+      break;
+    case 12:  // ^L clears the screen
+      write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+      break;
+    case 14:  // ^N, down
+      edit_history(editor.history_pos + 1);
+      break;
+    case 16:  // ^P, up
+      edit_history(editor.history_pos - 1);
+      break;
+    case 18:  // ^R starts a reverse search
+      editor.searching = true;
+      editor.search_len = 0;
+      editor.search[0] = '\0';
+      editor.match = -1;
+      break;
+    case 21:  // ^U cuts to the start
+      edit_delete(0, editor.cursor);
+      break;
+    case 23: {  // ^W cuts the word before the cursor
+      size_t start = editor.cursor;
+      while (start > 0 && editor.buf[start - 1] == ' ') {
+        start--;
+      }
+      while (start > 0 && editor.buf[start - 1] != ' ') {
+        start--;
+      }
+      edit_delete(start, editor.cursor);
+      break;
+    }
+    case 27:
+      editor.esc_state = 1;
+      return EDIT_MORE;
+    default:
+      if (key >= 32) {
+        char c = key;
+        edit_insert(&c, 1);
+      }
+      break;
+  }
+  return EDIT_MORE;
+}
+
+char *edit_line() {
+  // reads one line with the editor, NULL at the end of input
+  history_sync();
+  edit_set("", 0);
+  editor.history_pos = history.count;
+  editor.searching = false;
+  editor.esc_state = 0;
+  raw_mode(true);
+  need_prompt = false;
+  edit_redraw();
+
+  enum edit_result result = EDIT_MORE;
+  while (result == EDIT_MORE) {
+    if (edit_pending_len == 0) {
+      watch_stdin(true);
+      stdin_ready = false;
+      while (!stdin_ready) {
+        process_events(-1);
+        if (need_prompt) {
+          edit_redraw();  // a message was printed over the line
+          need_prompt = false;
+        }
+      }
+      ssize_t n = read(STDIN_FILENO, edit_pending, sizeof(edit_pending));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        result = EDIT_EOF;
+        break;
+      }
+      edit_pending_len = n;
+    }
+    // handle what was read, keys after an accepted line wait for the next
+    size_t used = 0;
+    while (used < edit_pending_len && result == EDIT_MORE) {
+      result = edit_key(edit_pending[used++]);
+    }
+    edit_pending_len -= used;
+    memmove(edit_pending, edit_pending + used, edit_pending_len);
+    if (result == EDIT_MORE) {
+      edit_redraw();
+    }
+  }
+
+  editor.searching = false;
+  edit_redraw();
+  write(STDOUT_FILENO, "\n", 1);
+  raw_mode(false);
+  need_prompt = false;
+  return result == EDIT_ACCEPT ? editor.buf : NULL;
+}
+
+/* ---- placement ----
+ * run [--cpus LIST] [--nice N] [--cgroup NAME [--cpu-max LIMIT]
+ * [--mem-max LIMIT]] command places a job when it starts: every process
+ * joins the cgroup, takes the CPU affinity and the nice value in the child
+ * before exec, so nothing runs unplaced. run [options] %id moves the live
+ * processes of a running job instead. Groups are cgroup v2 directories
+ * under /sys/fs/cgroup, or $CSHELL_CGROUP_ROOT. */
+
+const char *cgroup_root() {
+  const char *root = getenv("CSHELL_CGROUP_ROOT");
+  return root != NULL ? root : "/sys/fs/cgroup";
+}
+
+bool parse_cpus(const char *list, cpu_set_t *set) {
+  // "2-5,7" style lists, as taskset -c takes them
+  CPU_ZERO(set);
+  const char *c = list;
+  while (*c) {
+    char *end;
+    long first = strtol(c, &end, 10);
+    long last = first;
+    if (end == c || first < 0) {
+      return false;
+    }
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c || last < first) {
+        return false;
+      }
+    }
+    if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    c = *end ? end + 1 : end;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+bool cgroup_write(const char *group, const char *file, const char *value) {
+  // writes one cgroup interface file, enabling the controller in the parent
+  // group first if the file is missing
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", group, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  char parent[PATH_MAX];
+  snprintf(parent, sizeof(parent), "%s", group);
+  char *slash = strrchr(parent, '/');
+  if (fd < 0 && errno == ENOENT && slash != NULL &&
+      strncmp(file, "cgroup.", 7) != 0) {
+    char controller[32];
+    *slash = '\0';
+    snprintf(controller, sizeof(controller), "+%.*s",
+             (int)(strchr(file, '.') - file), file);
+    cgroup_write(parent, "cgroup.subtree_control", controller);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+  }
+  bool ok = fd >= 0 && write(fd, value, strlen(value)) >= 0;
+  if (!ok) {
+    fprintf(stderr, "Cannot write %s to %s: ", value, path);
+    perror("");
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return ok;
+}
+
+bool cpu_max_value(const char *limit, char *value, size_t size) {
+  // max, a percentage of one CPU such as 150%, or quota[/period] in us
+  long quota, period = 100000;
+  char *end;
+  if (strcmp(limit, "max") == 0) {
+    snprintf(value, size, "max %ld", period);
+    return true;
+  }
+  quota = strtol(limit, &end, 10);
+  if (end == limit || quota <= 0) {
+    return false;
+  } else if (strcmp(end, "%") == 0) {
+    quota = quota * period / 100;
+  } else if (*end == '/') {
+    period = strtol(end + 1, &end, 10);
+  }
+  if (*end != '\0' && strcmp(end, "%") != 0) {
+    return false;
+  }
+  snprintf(value, size, "%ld %ld", quota, period);
+  return period > 0;
+}
+
+bool mem_max_value(const char *limit, char *value, size_t size) {
+  // max or bytes with an optional K, M or G
+  char *end;
+  if (strcmp(limit, "max") == 0) {
+    snprintf(value, size, "max");
+    return true;
+  }
+  long long bytes = strtoll(limit, &end, 10);
+  const char *units = "KMG";
+  const char *unit = *end ? strchr(units, *end & ~0x20) : NULL;
+  if (end == limit || bytes <= 0 || (*end && (unit == NULL || end[1]))) {
+    return false;
+  }
+  for (int i = 0; unit != NULL && i <= unit - units; i++) {
+    bytes *= 1024;
+  }
+  snprintf(value, size, "%lld", bytes);
+  return true;
+}
+
+void placement_free(struct placement *place) {
+  if (place != NULL) {
+    if (place->procs_fd >= 0) {
+      close(place->procs_fd);
+    }
+    free(place);
+  }
+}
+
+bool cgroup_prepare(struct placement *place, char *cpu_max, char *mem_max) {
+  // creates the group on first use, sets its limits and opens cgroup.procs
+  char group[PATH_MAX];
+  char value[64];
+  snprintf(group, sizeof(group), "%s/%s", cgroup_root(), place->cgroup);
+  if (mkdir(group, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create cgroup %s: ", group);
+    perror("");
+    return false;
+  }
+  if (cpu_max && !cpu_max_value(cpu_max, value, sizeof(value))) {
+    printf("run: --cpu-max should be max, N%% or quota[/period].\n");
+    return false;
+  } else if (cpu_max && !cgroup_write(group, "cpu.max", value)) {
+    return false;
+  }
+  if (mem_max && !mem_max_value(mem_max, value, sizeof(value))) {
+    printf("run: --mem-max should be max or bytes with K, M or G.\n");
+    return false;
+  } else if (mem_max && !cgroup_write(group, "memory.max", value)) {
+    return false;
+  }
+  // opened once here, each child only writes itself into it
+  strcat(group, "/cgroup.procs");
+  place->procs_fd = open(group, O_WRONLY | O_CLOEXEC);
+  if (place->procs_fd < 0) {
+    fprintf(stderr, "Cannot open file %s: ", group);
+    perror("");
+    return false;
+  }
+  return true;
+}
+
+char **placement_parse(char **args, struct placement **result) {
+  // takes the options after run and returns where the command starts
+  // NULL with a message if an option is wrong
+  struct placement *place = calloc(1, sizeof(struct placement));
+  place->procs_fd = -1;
+  char *cpu_max = NULL;
+  char *mem_max = NULL;
+  bool ok = true;
+  int i = 1;
+  for (; ok && args[i] != NULL && strncmp(args[i], "--", 2) == 0; i += 2) {
+    char *value = args[i + 1];
+    if (value == NULL) {
+      break;
+    } else if (strcmp(args[i], "--cpus") == 0) {
+      ok = strlen(value) < sizeof(place->cpus) &&
+           parse_cpus(value, &place->cpu_set);
+      if (!ok) {
+        printf("run: %s is not a CPU list such as 2-5,7.\n", value);
+      }
+      snprintf(place->cpus, sizeof(place->cpus), "%s", value);
+    } else if (strcmp(args[i], "--nice") == 0) {
+      place->renice = true;
+      place->nice = atoi(value);
+    } else if (strcmp(args[i], "--cgroup") == 0) {
+      snprintf(place->cgroup, sizeof(place->cgroup), "%s", value);
+    } else if (strcmp(args[i], "--cpu-max") == 0) {
+      cpu_max = value;
+    } else if (strcmp(args[i], "--mem-max") == 0) {
+      mem_max = value;
+    } else {
+      break;
+    }
+  }
+  if (ok && (args[i] == NULL || strncmp(args[i], "--", 2) == 0)) {
+    printf(
+        "run: usage: run [--cpus LIST] [--nice N] [--cgroup NAME "
+        "[--cpu-max LIMIT] [--mem-max LIMIT]] command | %%id\n");
+    ok = false;
+  } else if (ok && (cpu_max || mem_max) && place->cgroup[0] == '\0') {
+    printf("run: --cpu-max and --mem-max need --cgroup.\n");
+    ok = false;
+  } else if (ok && place->cgroup[0] != '\0') {
+    ok = cgroup_prepare(place, cpu_max, mem_max);
+  }
+  if (!ok) {
+    placement_free(place);
+    return NULL;
+  }
+  *result = place;
+  return args + i;
+}
+
+bool place_thread(struct placement *place, pid_t tid, pid_t pid) {
+  // CPUs and nice value of one thread of pid, false after printing why not;
+  // a thread that has just exited is not an error
+  if (place->cpus[0] != '\0' &&
+      sched_setaffinity(tid, sizeof(cpu_set_t), &place->cpu_set) < 0 &&
+      errno != ESRCH) {
+    fprintf(stderr, "run: cannot bind %d to CPUs %s: %s\n",
+            pid ? pid : getpid(), place->cpus, strerror(errno));
+    return false;
+  }
+  if (place->renice && setpriority(PRIO_PROCESS, tid, place->nice) < 0 &&
+      errno != ESRCH) {
+    fprintf(stderr, "run: cannot set nice %d: %s\n", place->nice,
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void place_process(struct placement *place, pid_t pid) {
+  // puts one process where place says, pid 0 is the calling process
+  char buf[16];
+  if (place->procs_fd >= 0) {
+    int len = snprintf(buf, sizeof(buf), "%d", pid);
+    if (write(place->procs_fd, buf, len) < 0) {
+      fprintf(stderr, "run: cannot move %d into cgroup %s: %s\n",
+              pid ? pid : getpid(), place->cgroup, strerror(errno));
+    }
+  }
+  if (place->cpus[0] == '\0' && !place->renice) {
+    return;
+  }
+
+  // affinity and nice belong to threads, so a running process has every
+  // thread in /proc/pid/task moved; the cgroup above already took them all
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  DIR *tasks = pid ? opendir(path) : NULL;
+  if (tasks == NULL) {
+    place_thread(place, pid, pid);  // not started yet, or no /proc
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(tasks)) != NULL) {
+    pid_t tid = atoi(entry->d_name);
+    if (tid > 0 && !place_thread(place, tid, pid)) {
+      break;
+    }
+  }
+  closedir(tasks);
+}
+
+void place_job(int slot, struct placement *place) {
+  // run [options] %id: moves every live process of the job and remembers
+  // the new settings in its entry for jobs -l
+  struct job_control *job = &processes[slot];
+  for (int i = 0; i < job->proc_count; i++) {
+    if (!job->procs[i].done) {
+      place_process(place, job->procs[i].pid);
+    }
+  }
+  if (place->procs_fd >= 0) {
+    close(place->procs_fd);
+    place->procs_fd = -1;
+  }
+  struct placement *old = job->place;
+  if (old != NULL) {
+    // options that were not given stay as they were
+    if (place->cpus[0] == '\0') {
+      strcpy(place->cpus, old->cpus);
+      place->cpu_set = old->cpu_set;
+    }
+    if (!place->renice) {
+      place->renice = old->renice;
+      place->nice = old->nice;
+    }
+    if (place->cgroup[0] == '\0') {
+      strcpy(place->cgroup, old->cgroup);
+    }
+  }
+  placement_free(old);
+  job->place = place;
+}
+
+/* ---- launching ----
+ * External commands are started by one of two engines. The fork engine sets
+ * the child up by hand after fork(), which has to copy the shell's page
+ * tables first. The spawn engine hands the same work to posix_spawn, which
+ * glibc runs on a CLONE_VFORK child that shares the shell's memory, so its
+ * cost does not grow with the size of the shell. */
+
+enum launch_engine { LAUNCH_FORK, LAUNCH_SPAWN };
+enum launch_engine launch_engine = LAUNCH_FORK;
+
+struct redirect {
+  struct redirect_op *op;  // which fd and how
+  char *target;            // file name, or the fd to copy for >& and <&
+};
+
+struct launch {
+  char *path;      // resolved by hash_lookup, NULL to run args[0] as given
+  char **args;     // NULL terminated argument vector
+  struct redirect *redirects;  // the redirection plan, in command order
+  int redirect_count;
+  int in_fd;       // pipe end to use as stdin, 0 to inherit
+  int out_fd;      // pipe end to use as stdout, 0 to inherit
+  int err_fd;      // fd to use as stderr, 0 to inherit
+  pid_t pgid;      // process group to join, 0 to start a new one
+  bool foreground;  // hand the terminal to the new process group
+  struct placement *place;  // run options, applied in the child before exec
+  int *documents;   // fds holding here-documents, closed once launched
+  int document_count;
+  char **envp;      // environment with NAME=value prefixes, NULL for environ
+};
+
+void take_redirections(struct launch *cmd) {
+  // moves every redirection out of args and into cmd's plan, in the order
+  // they were given, since 2>&1 > file and > file 2>&1 mean different things
+  int count = 0;
+  for (int i = 0; cmd->args[i] != NULL; i++) {
+    count += as_redirect(cmd->args[i]) != NULL;
+  }
+  cmd->redirects = arena_alloc(&parse_arena, count * sizeof(struct redirect));
+  cmd->redirect_count = 0;
+
+  int kept = 0;
+  for (int i = 0; cmd->args[i] != NULL; i++) {
+    char *arg = cmd->args[i];
+    struct redirect_op *op = as_redirect(arg);
+    if (op != NULL && cmd->args[i + 1] != NULL) {
+      struct redirect *redirect = &cmd->redirects[cmd->redirect_count++];
+      redirect->op = op;
+      redirect->target = cmd->args[++i];
+    } else if (op == NULL) {
+      cmd->args[kept++] = arg;
+    }
+  }
+  cmd->args[kept] = NULL;
+}
+
+int document_fd(const char *text) {
+  // a readable fd holding text: a pipe when one write is sure to fit,
+  // otherwise a memfd, so here-documents never touch the filesystem
+  size_t len = strlen(text);
+  int fds[2];
+  if (len <= PIPE_BUF && pipe2(fds, O_CLOEXEC) == 0) {
+    write(fds[1], text, len);
+    close(fds[1]);
+    return fds[0];
+  }
+  int fd = memfd_create("here-document", MFD_CLOEXEC);
+  if (fd < 0 || write(fd, text, len) != (ssize_t)len) {
+    perror("here-document");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+void open_documents(struct launch *cmd) {
+  // turns each << and <<< of the plan into <&N from a fd with the text
+  cmd->documents = arena_alloc(&parse_arena, cmd->redirect_count * sizeof(int));
+  cmd->document_count = 0;
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    struct redirect *redirect = &cmd->redirects[i];
+    enum redirect_kind kind = redirect->op->kind;
+    if (kind != REDIRECT_HEREDOC && kind != REDIRECT_HERESTRING) {
+      continue;
+    }
+    int fd = document_fd(redirect->target);
+    char target[16];
+    snprintf(target, sizeof(target), "%d", fd);
+    redirect->op = &redirect_ops[redirect->op->fd][REDIRECT_DUP];
+    redirect->target = arena_strndup(&parse_arena, target, strlen(target));
+    if (fd >= 0) {
+      cmd->documents[cmd->document_count++] = fd;
+    }
+  }
+}
+
+void close_documents(struct launch *cmd) {
+  for (int i = 0; i < cmd->document_count; i++) {
+    close(cmd->documents[i]);
+  }
+}
+
+int redirect_flags(struct redirect_op *op) {
+  if (op->kind == REDIRECT_IN) {
+    return O_RDONLY;
+  }
+  return O_WRONLY | O_CREAT | (op->kind == REDIRECT_APPEND ? O_APPEND : O_TRUNC);
+}
+
+int dup_source(struct redirect *redirect) {
+  // the fd named by >&N, -1 for >&- and -2 if it is not an fd at all
+  char *end;
+  char *target = redirect->target;
+  if (strcmp(target, "-") == 0) {
+    return -1;
+  }
+  long fd = strtol(target, &end, 10);
+  return (*target && *end == '\0' && fd >= 0 && fd < INT_MAX) ? fd : -2;
+}
+
+int open_redirect(char *file, int flags) {
+  // opens a redirection target, exits the child on failure
+  int fd = open(file, flags | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open file %s: ", file);
+    perror("");
+    exit(1);
+  }
+  return fd;
+}
+
+void apply_redirects(struct launch *cmd) {
+  // runs the plan in a freshly forked child, after the pipes are in place
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    struct redirect *redirect = &cmd->redirects[i];
+    int target_fd = redirect->op->fd;
+    if (redirect->op->kind != REDIRECT_DUP) {
+      int fd = open_redirect(redirect->target, redirect_flags(redirect->op));
+      dup2(fd, target_fd);
+      close(fd);
+      continue;
+    }
+    int source = dup_source(redirect);
+    if (source == -1) {
+      close(target_fd);
+    } else if (source < 0 || dup2(source, target_fd) < 0) {
+      fprintf(stderr, "%s: Bad file descriptor\n", redirect->target);
+      exit(1);
+    }
+  }
+}
+
+char *unopenable_file(struct launch *cmd) {
+  // the first file of the plan that cannot be opened, NULL if there is none
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    struct redirect *redirect = &cmd->redirects[i];
+    if (redirect->op->kind == REDIRECT_DUP) {
+      continue;
+    }
+    int fd = open(redirect->target, redirect_flags(redirect->op) | O_CLOEXEC,
+                  S_IRWXU | S_IRWXG | S_IRWXO);
+    if (fd < 0) {
+      return redirect->target;
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+bool redirects_fd(struct launch *cmd, int fd) {
+  // true if the plan points fd somewhere else
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    if (cmd->redirects[i].op->fd == fd) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct builtin_io {
+  int fds[10];    // what each fd of the builtin refers to, -1 if closed
+  int *opened;    // files opened for the plan, closed by builtin_io_close
+  int opened_count;
+};
+
+bool builtin_io_open(struct launch *cmd, struct builtin_io *io) {
+  // resolves the plan of a builtin without touching the shell's own fds,
+  // prints what went wrong and returns false if a file cannot be opened
+  for (int fd = 0; fd < 10; fd++) {
+    io->fds[fd] = fd;
+  }
+  io->opened = arena_alloc(&parse_arena, cmd->redirect_count * sizeof(int));
+  io->opened_count = 0;
+
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    struct redirect *redirect = &cmd->redirects[i];
+    int target_fd = redirect->op->fd;
+    enum redirect_kind kind = redirect->op->kind;
+    if (kind == REDIRECT_HEREDOC || kind == REDIRECT_HERESTRING) {
+      int fd = document_fd(redirect->target);
+      if (fd < 0) {
+        return false;
+      }
+      io->opened[io->opened_count++] = fd;
+      io->fds[target_fd] = fd;
+      continue;
+    } else if (kind != REDIRECT_DUP) {
+      int fd = open(redirect->target, redirect_flags(redirect->op) | O_CLOEXEC,
+                    S_IRWXU | S_IRWXG | S_IRWXO);
+      if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s: ", redirect->target);
+        perror("");
+        return false;
+      }
+      io->opened[io->opened_count++] = fd;
+      io->fds[target_fd] = fd;
+      continue;
+    }
+    int source = dup_source(redirect);
+    if (source >= 10 || source == -2 || (source >= 0 && io->fds[source] < 0)) {
+      fprintf(stderr, "%s: Bad file descriptor\n", redirect->target);
+      return false;
+    }
+    io->fds[target_fd] = source == -1 ? -1 : io->fds[source];
+  }
+  return true;
+}
+
+void builtin_io_close(struct builtin_io *io) {
+  for (int i = 0; i < io->opened_count; i++) {
+    close(io->opened[i]);
+  }
+  io->opened_count = 0;
+}
+
+void child_setup(struct launch *cmd) {
+  // process group, terminal, signals and fds of a freshly forked child
+  setpgid(0, cmd->pgid);
+  if (cmd->foreground) {
+    give_terminal(getpgrp());
+  }
+  child_reset_signals();
+  if (cmd->place != NULL) {
+    place_process(cmd->place, 0);
+  }
+  if (cmd->in_fd > 0) {
+    dup2(cmd->in_fd, STDIN_FILENO);  // pipe ends are O_CLOEXEC, the dup is not
+  }
+  if (cmd->out_fd > 0) {
+    dup2(cmd->out_fd, STDOUT_FILENO);
+  }
+  if (cmd->err_fd > 0) {
+    dup2(cmd->err_fd, STDERR_FILENO);
+  }
+  apply_redirects(cmd);
+}
+
+pid_t launch_fork(struct launch *cmd) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Fork failed.\n");
+    return -1;
+  } else if (pid == 0) {
+    child_setup(cmd);
+    exec_command(cmd->path, cmd->args, cmd->envp ? cmd->envp : environ);
+  }
+  // also from the parent so there is no window where the group is missing
+  setpgid(pid, cmd->pgid ? cmd->pgid : pid);
+  return pid;
+}
+
+pid_t launch_spawn(struct launch *cmd) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t defaults;  // signals reset to SIG_DFL in the child
+  pid_t pid = -1;
+  short flags =
+      POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+
+  posix_spawn_file_actions_init(&actions);
+#if __GLIBC_PREREQ(2, 35)
+  if (cmd->foreground && interactive) {
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+  }
+#endif
+  if (cmd->in_fd > 0) {
+    posix_spawn_file_actions_adddup2(&actions, cmd->in_fd, STDIN_FILENO);
+  }
+  if (cmd->out_fd > 0) {
+    posix_spawn_file_actions_adddup2(&actions, cmd->out_fd, STDOUT_FILENO);
+  }
+  if (cmd->err_fd > 0) {
+    posix_spawn_file_actions_adddup2(&actions, cmd->err_fd, STDERR_FILENO);
+  }
+  bool bad_fd = false;
+  for (int i = 0; i < cmd->redirect_count; i++) {
+    // the same plan as apply_redirects, as file actions
+    struct redirect *redirect = &cmd->redirects[i];
+    int source = dup_source(redirect);
+    if (redirect->op->kind != REDIRECT_DUP) {
+      posix_spawn_file_actions_addopen(
+          &actions, redirect->op->fd, redirect->target,
+          redirect_flags(redirect->op), S_IRWXU | S_IRWXG | S_IRWXO);
+    } else if (source == -1) {
+      posix_spawn_file_actions_addclose(&actions, redirect->op->fd);
+    } else if (source < 0 || posix_spawn_file_actions_adddup2(
+                                 &actions, source, redirect->op->fd) != 0) {
+      bad_fd = true;
+    }
+  }
+
+  posix_spawnattr_init(&attr);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGINT);
+  sigaddset(&defaults, SIGTSTP);
+  sigaddset(&defaults, SIGCHLD);
+  sigaddset(&defaults, SIGPIPE);
+  sigaddset(&defaults, SIGTTOU);
+  sigaddset(&defaults, SIGTTIN);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &default_mask);
+  posix_spawnattr_setpgroup(&attr, cmd->pgid);
+  posix_spawnattr_setflags(&attr, flags);
+
+  // same fallback as exec_command: a stale cached path, then args[0] as is
+  char **envp = cmd->envp ? cmd->envp : environ;
+  int err = bad_fd ? EBADF : ENOENT;
+  if (!bad_fd && cmd->path != NULL) {
+    err = posix_spawn(&pid, cmd->path, &actions, &attr, cmd->args, envp);
+  }
+  if (!bad_fd && err != 0) {
+    err = posix_spawn(&pid, cmd->args[0], &actions, &attr, cmd->args, envp);
+  }
+  char *file;
+  if (err == EBADF) {
+    // a >&N or <&N named an fd that is not open
+    fprintf(stderr, "Bad file descriptor in redirection.\n");
+    pid = -1;
+  } else if (err != 0 && (file = unopenable_file(cmd)) != NULL) {
+    // an open file action failed rather than the exec
+    fprintf(stderr, "Cannot open file %s: %s\n", file, strerror(errno));
+    pid = -1;
+  } else if (err != 0) {
+    printf("%s file could not be executed: %s\n", cmd->args[0], strerror(err));
+    pid = -1;
+  }
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return pid;
+}
+
+pid_t launch(struct launch *cmd) {
+  // starts the command with the selected engine, -1 if it could not start
+  uint64_t start = monotonic_ns();
+  pid_t pid;
+  if (launch_engine == LAUNCH_SPAWN && cmd->place == NULL) {
+    // posix_spawn cannot place the child, run jobs always fork
+    pid = launch_spawn(cmd);
+  } else {
+    pid = launch_fork(cmd);
+  }
+  time_since(T_LAUNCH, start);
+  return pid;
+}
+
+void copy_fd(int in, int out) {
+  // moves everything from in to out, through the kernel when one side is a
+  // pipe and through a buffer otherwise
+  char buf[65536];
+  ssize_t n;
+
+  while ((n = splice(in, NULL, out, NULL, sizeof(buf), SPLICE_F_MOVE)) > 0) {
+  }
+  if (n == 0) {
+    return;
+  }
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, n) != n) {
+      return;
+    }
+  }
+}
+
+void tee_fd(int in, int out, int file_fd) {
+  // copies a pipe into both the next pipe and a file, duplicating the pipe
+  // buffer with tee() so the data never enters userspace
+  char buf[65536];
+  ssize_t n;
+
+  while ((n = tee(in, out, sizeof(buf), 0)) > 0) {
+    while (n > 0) {
+      ssize_t moved = splice(in, NULL, file_fd, NULL, n, SPLICE_F_MOVE);
+      if (moved <= 0) {
+        return;
+      }
+      n -= moved;
+    }
+  }
+  if (n == 0) {
+    return;
+  }
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, n) != n || write(file_fd, buf, n) != n) {
+      return;
+    }
+  }
+}
+
+void run_relay(struct launch *cmd) {
+  // a stage with no command, such as < file | sort or ls | > out | wc: the
+  // shell copies the data itself, child_setup has already applied the plan
+  if (cmd->out_fd > 0 && redirects_fd(cmd, STDOUT_FILENO)) {
+    tee_fd(STDIN_FILENO, cmd->out_fd, STDOUT_FILENO);  // keep a copy
+  } else {
+    copy_fd(STDIN_FILENO, STDOUT_FILENO);
+  }
+}
+
+void print_jobs(struct writer *out, bool long_format) {
+  // with long_format every job also gets its wall time and the CPU, memory
+  // and context switches of the processes reaped so far
+  for (int i = job_head; i != -1; i = processes[i].next) {
+    // only print if not terminated and show is true
+    if ((!processes[i].terminated) && (processes[i].show)) {
+      writer_printf(out, "[%i] (%i) %s  %s\n", processes[i].job_id,
+                    processes[i].job_pid,
+                    processes[i].running ? "Running" : "Stopped",
+                    processes[i].command);
+      if (long_format) {
+        struct job_usage *usage = &processes[i].usage;
+        writer_printf(out,
+                      "    wall %.2fs  user %.2fs  sys %.2fs  maxrss %ld KB  "
+                      "ctxsw %ld/%ld\n",
+                      usage_wall(usage), timeval_seconds(&usage->utime),
+                      timeval_seconds(&usage->stime), usage->maxrss,
+                      usage->nvcsw, usage->nivcsw);
+        struct placement *place = processes[i].place;
+        if (place != NULL) {
+          char nice[16] = "-";
+          if (place->renice) {
+            snprintf(nice, sizeof(nice), "%d", place->nice);
+          }
+          writer_printf(out, "    cpus %s  nice %s  cgroup %s\n",
+                        place->cpus[0] ? place->cpus : "-", nice,
+                        place->cgroup[0] ? place->cgroup : "-");
+        }
+      }
+    }
+  }
+}
+
+void print_working_dir(struct writer *out) {
+  char working_dir[PATH_MAX];  // current working directory
+  writer_printf(out, "%s\n", getcwd(working_dir, PATH_MAX));
+}
+
+pid_t launch_stage(struct launch *cmd) {
+  // starts one pipeline stage; relays and builtins run in a forked copy of
+  // the shell, everything else goes through the selected engine
+  char *name = cmd->args[0];
+  int builtin_id = name != NULL ? builtin_find(name) : -1;
+  bool listing = builtin_id == BUILTIN_EXPORT && cmd->args[1] == NULL;
+  if (name != NULL && builtin_id != BUILTIN_PWD &&
+      builtin_id != BUILTIN_JOBS && !listing && !is_utility(builtin_id)) {
+    return launch(cmd);
+  }
+
+  fflush(stdout);  // or the child would print what is still buffered again
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Fork failed.\n");
+    return -1;
+  } else if (pid == 0) {
+    child_setup(cmd);
+    struct writer out = {.fd = STDOUT_FILENO};
+    struct writer err = {.fd = STDERR_FILENO};
+    int status = 0;
+    if (name == NULL) {
+      run_relay(cmd);
+    } else if (builtin_id == BUILTIN_PWD) {
+      print_working_dir(&out);
+    } else if (listing) {
+      print_variables(&out);
+    } else if (is_utility(builtin_id)) {
+      status = run_utility(builtin_id, cmd->args, &out, &err);
+    } else {
+      print_jobs(&out, cmd->args[1] && strcmp(cmd->args[1], "-l") == 0);
+    }
+    writer_flush(&out);
+    writer_flush(&err);
+    _exit(status);
+  }
+  setpgid(pid, cmd->pgid ? cmd->pgid : pid);
+  return pid;
+}
+
+bool launch_job(char **args, bool background, struct placement *place,
+                char **envp) {
+  // runs args, split into stages at each |, as one job in one process group
+  // the stages are connected with pipes and all go into processes[]
+  // place comes from run and is owned by the job from here on, envp is the
+  // environment of every stage, NULL for the shell's own
+  int stage_count = 1;
+  for (int i = 0; args[i] != NULL; i++) {
+    stage_count += (args[i] == OP_PIPE);
+  }
+
+  struct job_control job = {0};
+  job.procs = calloc(stage_count, sizeof(struct job_process));
+  job.running = true;
+  job.foreground = !background;
+  job.show = background;  // foreground jobs only show up once stopped
+  job.command = strdup(original);
+  job.place = place;
+  clock_gettime(CLOCK_MONOTONIC, &job.usage.start);
+
+  char **stage_args = args;
+  int prev_read = 0;  // read end of the pipe from the previous stage
+  for (int s = 0; s < stage_count; s++) {
+    // cut this stage off at the next |
+    char **next = stage_args;
+    while (*next != NULL && *next != OP_PIPE) {
+      next++;
+    }
+    bool last = (*next == NULL);
+    *next = NULL;
+
+    uint64_t setup_start = monotonic_ns();
+    struct launch cmd = {0};
+    int pipe_fds[2] = {0, 0};
+    if (!last && pipe2(pipe_fds, O_CLOEXEC) < 0) {
+      perror("pipe");
+      break;
+    }
+    cmd.args = stage_args;
+    cmd.in_fd = prev_read;
+    cmd.out_fd = pipe_fds[1];
+    cmd.pgid = job.job_pid ? job.job_pid : job_group;
+    cmd.foreground = !background;
+    cmd.place = place;
+    cmd.envp = envp;
+    take_redirections(&cmd);
+    open_documents(&cmd);
+    time_since(T_REDIRECT, setup_start);
+    if (cmd.args[0] != NULL) {
+      cmd.path = hash_lookup(cmd.args[0]);
+    }
+
+    pid_t pid = launch_stage(&cmd);
+    close_documents(&cmd);
+    if (prev_read > 0) {
+      close(prev_read);
+    }
+    if (!last) {
+      close(pipe_fds[1]);
+    }
+    prev_read = pipe_fds[0];
+
+    if (pid > 0) {
+      if (job.proc_count == 0) {
+        time_since(T_DISPATCH, command_start);
+        job.job_pid = pid;  // the first stage leads the process group
+        if (!background) {
+          give_terminal(pid);
+        }
+      }
+      job.procs[job.proc_count].pid = pid;
+      job.procs[job.proc_count].pidfd = watch_child(pid);
+      job.proc_count++;
+    }
+    stage_args = next + 1;
+  }
+  if (prev_read > 0) {
+    close(prev_read);
+  }
+  if (place != NULL && place->procs_fd >= 0) {
+    close(place->procs_fd);  // every stage has joined the cgroup
+    place->procs_fd = -1;
+  }
+
+  if (job.proc_count == 0) {
+    free(job.procs);
+    free(job.command);
+    free(job.place);
+    give_terminal(shell_pgid);
+    return false;
+  }
+  job.live_count = job.proc_count;
+  if (!background) {
+    foreground = true;
+    foreground_pid = job.job_pid;  // store foreground process group
+  }
+  // add job to the table
+  int slot = add_job(&job);
+  if (background) {
+    set_job_id(slot);
+  }
+  return true;
+}
+
+/* ---- parallel ----
+ * parallel [-j N] [-a file] command [args...] runs command once per input
+ * line with up to N items in flight. Items are ordinary jobs started with
+ * launch(), and the next one is dispatched from the job's on_done hook when
+ * sigchld_handler reaps it. Each running item writes into its own pair of
+ * memfds, which are copied out in one piece when it finishes so the output
+ * of different items never interleaves. */
+
+struct parallel_slot {
+  int out_fd;  // memfd collecting the item's stdout
+  int err_fd;  // memfd collecting the item's stderr
+  pid_t pgid;  // process group of the item running here, 0 if idle
+};
+
+struct parallel_run {
+  char **command;   // argument template, {} is replaced by the item
+  int command_len;
+  char **items;     // input lines
+  int item_count;
+  int next_item;    // next item to dispatch
+  int running;
+  int failed;
+  int out_fd;       // where grouped stdout goes, -1 to drop it
+  int err_fd;       // the same for stderr
+  int null_fd;      // /dev/null, stdin of every item
+  struct parallel_slot *slots;
+};
+
+struct parallel_run *parallel_run = NULL;  // the run in progress, if any
+
+char *replace_braces(char *arg, char *item) {
+  // arg with every {} replaced by item, allocated in parse_arena
+  size_t item_len = strlen(item);
+  size_t len = strlen(arg);
+  for (char *c = strstr(arg, "{}"); c; c = strstr(c + 2, "{}")) {
+    len += item_len - 2;
+  }
+  char *out = arena_alloc(&parse_arena, len + 1);
+  char *o = out;
+  for (char *c = arg; *c;) {
+    if (c[0] == '{' && c[1] == '}') {
+      memcpy(o, item, item_len);
+      o += item_len;
+      c += 2;
+    } else {
+      *o++ = *c++;
+    }
+  }
+  *o = '\0';
+  return out;
+}
+
+char **parallel_args(struct parallel_run *run, char *item) {
+  // the argument vector for one item: {} is substituted, or the item is
+  // appended when the template has no {}
+  char **args = arena_alloc(&parse_arena,
+                            (run->command_len + 2) * sizeof(char *));
+  bool substituted = false;
+  for (int i = 0; i < run->command_len; i++) {
+    args[i] = run->command[i];
+    if (strstr(args[i], "{}")) {
+      args[i] = replace_braces(args[i], item);
+      substituted = true;
+    }
+  }
+  int argc = run->command_len;
+  if (!substituted) {
+    args[argc++] = item;
+  }
+  args[argc] = NULL;
+  return args;
+}
+
+void parallel_done(void *owner, int status, struct job_usage *usage);
+
+bool parallel_start(struct parallel_run *run, struct parallel_slot *slot) {
+  // launches the next item into slot, false if it could not be started
+  char *item = run->items[run->next_item++];
+  struct launch cmd = {0};
+  cmd.args = parallel_args(run, item);
+  cmd.path = hash_lookup(cmd.args[0]);
+  cmd.in_fd = run->null_fd;
+  cmd.out_fd = slot->out_fd;
+  cmd.err_fd = slot->err_fd;
+  pid_t pid = launch(&cmd);
+  if (pid <= 0) {
+    run->failed++;
+    return false;
+  }
+
+  // a regular job in its own group, hidden from jobs
+  struct job_control job = {0};
+  job.procs = calloc(1, sizeof(struct job_process));
+  job.procs[0].pid = pid;
+  job.procs[0].pidfd = watch_child(pid);
+  job.proc_count = 1;
+  job.live_count = 1;
+  job.job_pid = pid;
+  job.running = true;
+  job.command = strdup(item);
+  clock_gettime(CLOCK_MONOTONIC, &job.usage.start);
+  job.on_done = parallel_done;
+  job.owner = slot;
+  add_job(&job);
+  slot->pgid = pid;
+  run->running++;
+  return true;
+}
+
+void parallel_flush(int from, int to) {
+  // copies the collected output to its destination and empties the memfd
+  lseek(from, 0, SEEK_SET);
+  if (to >= 0) {
+    copy_fd(from, to);
+  }
+  ftruncate(from, 0);
+  lseek(from, 0, SEEK_SET);
+}
+
+void parallel_done(void *owner, int status, struct job_usage *usage) {
+  // an item finished: emit its output in one piece and reuse the slot
+  struct parallel_run *run = parallel_run;
+  struct parallel_slot *slot = owner;
+  run->running--;
+  slot->pgid = 0;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    run->failed++;
+  }
+  parallel_flush(slot->out_fd, run->out_fd);
+  parallel_flush(slot->err_fd, run->err_fd);
+
+  while (run->next_item < run->item_count) {
+    if (parallel_start(run, slot)) {
+      break;
+    }
+  }
+}
+
+void parallel_cancel() {
+  // CTRL + C while parallel runs: stop the items in flight, start no more
+  struct parallel_run *run = parallel_run;
+  run->next_item = run->item_count;
+  for (int i = 0; run->slots[i].out_fd >= 0; i++) {
+    if (run->slots[i].pgid > 0) {
+      kill(-run->slots[i].pgid, SIGINT);
+    }
+  }
+}
+
+char *read_all(int fd, size_t *len) {
+  // reads fd to the end into a malloc'd, NUL terminated buffer
+  size_t cap = 65536;
+  char *buf = malloc(cap);
+  *len = 0;
+  ssize_t n;
+  while ((n = read(fd, buf + *len, cap - *len - 1)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    *len += n;
+    if (*len + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  buf[*len] = '\0';
+  return buf;
+}
+
+void run_parallel(char **args, struct builtin_io *io) {
+  // the parallel builtin, args[0] is "parallel", io holds its redirections
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  char *input_file = NULL;
+  int i = 1;
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    // -j N, -jN, -a file
+    char *value = args[i][2] ? args[i] + 2 : args[i + 1];
+    if (value == NULL || (args[i][1] != 'j' && args[i][1] != 'a')) {
+      break;
+    }
+    if (args[i][1] == 'j') {
+      jobs = atol(value);
+    } else {
+      input_file = value;
+    }
+    i += (value == args[i + 1]);
+  }
+  if (args[i] == NULL || jobs < 1) {
+    printf("parallel: usage: parallel [-j N] [-a file] command [args...]\n");
+    return;
+  }
+
+  // read every item up front, one per line
+  int in = io->fds[STDIN_FILENO];
+  if (input_file != NULL) {
+    in = open(input_file, O_RDONLY | O_CLOEXEC);
+  } else if (in == STDIN_FILENO && isatty(STDIN_FILENO)) {
+    printf("parallel: give the items with -a file or < file\n");
+    return;
+  }
+  if (in < 0) {
+    fprintf(stderr, "Cannot open file %s: ", input_file ? input_file : "-");
+    perror("");
+    return;
+  }
+  size_t len;
+  char *input = read_all(in, &len);
+  if (input_file != NULL) {
+    close(in);
+  }
+
+  struct parallel_run run = {0};
+  run.command = args + i;
+  while (run.command[run.command_len] != NULL) {
+    run.command_len++;
+  }
+  int capacity = 0;
+  for (char *line = strtok(input, "\n"); line; line = strtok(NULL, "\n")) {
+    if (run.item_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      char **items = arena_alloc(&parse_arena, capacity * sizeof(char *));
+      if (run.item_count > 0) {
+        memcpy(items, run.items, run.item_count * sizeof(char *));
+      }
+      run.items = items;
+    }
+    run.items[run.item_count++] = line;
+  }
+
+  run.out_fd = io->fds[STDOUT_FILENO];
+  run.err_fd = io->fds[STDERR_FILENO];
+  run.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (jobs > run.item_count) {
+    jobs = run.item_count;
+  }
+  run.slots = calloc(jobs + 1, sizeof(struct parallel_slot));
+  for (int s = 0; s < jobs; s++) {
+    run.slots[s].out_fd = memfd_create("parallel-out", MFD_CLOEXEC);
+    run.slots[s].err_fd = memfd_create("parallel-err", MFD_CLOEXEC);
+  }
+  run.slots[jobs].out_fd = -1;  // end marker
+
+  // fill every slot, then let sigchld_handler keep them busy
+  fflush(stdout);
+  parallel_run = &run;
+  interrupt_hook = parallel_cancel;
+  for (int s = 0; s < jobs; s++) {
+    while (run.next_item < run.item_count &&
+           !parallel_start(&run, &run.slots[s])) {
+    }
+  }
+  watch_stdin(false);
+  while (run.running > 0) {
+    process_events(-1);
+  }
+  parallel_run = NULL;
+  interrupt_hook = NULL;
+
+  if (run.failed > 0) {
+    printf("parallel: %d of %d items failed\n", run.failed, run.item_count);
+  }
+  for (int s = 0; s < jobs; s++) {
+    close(run.slots[s].out_fd);
+    close(run.slots[s].err_fd);
+  }
+  free(run.slots);
+  close(run.null_fd);
+  free(input);
+}
+
+/* ---- server ----
+ * shell --listen PATH serves command lines on a Unix socket. A client sends
+ * each line as one SOCK_SEQPACKET message with its stdin, stdout and stderr
+ * attached (SCM_RIGHTS). The line goes through eval with those three fds
+ * swapped onto 0, 1 and 2, so builtins, error messages and the job's
+ * processes write straight to the client with no copying in the shell. The
+ * job is an ordinary background job; its on_done hook sends the exit status
+ * back, so one shell serves any number of clients at once. A line with ;,
+ * && or || or a compound command is parsed by the server and then run in
+ * order by a forked copy, as one job with one reply; like sh -c, what that
+ * copy changes (the directory, variables) stays in it. A line that only
+ * defines functions runs in the server itself. */
+
+#define CLIENT_LINE_MAX (256 * 1024)  // longest line a client can send
+
+struct client {
+  int sock;
+  int fds[3];    // the client's stdin, stdout and stderr while a line runs
+  bool waiting;  // a job of this client is running
+  bool timed;    // the line started with time
+  int status;    // exit status sent back for the current line
+};
+
+int listen_fd = -1;
+const char *listen_path = NULL;
+bool serving_stop = false;    // set by CTRL + C, the server shuts down
+struct client **clients;      // indexed by socket fd
+int client_capacity = 0;
+struct client *serving = NULL;  // client whose line eval is running
+int server_fds[3];              // the shell's own 0, 1 and 2 while serving
+char *client_line;              // receive buffer
+
+void session_enter(struct client *client) {
+  // swaps the client's fds onto 0, 1 and 2 for the duration of one line
+  fflush(stdout);
+  for (int i = 0; i < 3; i++) {
+    dup2(client->fds[i], i);
+  }
+  serving = client;
+}
+
+void session_leave() {
+  fflush(stdout);
+  for (int i = 0; i < 3; i++) {
+    dup2(server_fds[i], i);
+  }
+  serving = NULL;
+}
+
+void client_reply(struct client *client) {
+  // sends the exit status of the line and waits for the next one
+  char reply[16];
+  int len = snprintf(reply, sizeof(reply), "%d", client->status);
+  send(client->sock, reply, len, MSG_NOSIGNAL);
+  for (int i = 0; i < 3; i++) {
+    close(client->fds[i]);
+    client->fds[i] = -1;
+  }
+  client->waiting = false;
+  watch_fd(client->sock, EV_CLIENT, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+void client_done(void *owner, int status, struct job_usage *usage) {
+  // on_done of a client's job
+  struct client *client = owner;
+  if (client->timed) {
+    session_enter(client);
+    time_done(NULL, status, usage);
+    session_leave();
+  }
+  client->status = exit_code(status);
+  client_reply(client);
+}
+
+void client_started(bool started, bool background, bool timed) {
+  // called by eval after launching a client's line as a job
+  if (started && !background) {
+    processes[job_tail].on_done = client_done;
+    processes[job_tail].owner = serving;
+    serving->waiting = true;
+    serving->timed = timed;
+  }
+}
+
+pid_t client_fork() {
+  // forks the copy that runs a client's compound line; the copy leaves the
+  // server's jobs, sockets and events behind, and its own jobs join its
+  // process group so a hangup or kill reaches all of them
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Fork failed.\n");
+  } else if (pid == 0) {
+    subshell_init();
+    setpgid(0, 0);
+    job_group = getpid();
+    interactive = false;
+    while (job_head != -1) {
+      remove_job(job_head);
+    }
+    close(listen_fd);
+    for (int fd = 0; fd < client_capacity; fd++) {
+      if (clients[fd] != NULL) {
+        close(fd);
+      }
+    }
+    serving = NULL;
+  } else {
+    setpgid(pid, pid);
+  }
+  return pid;
+}
+
+void client_job(pid_t pid) {
+  // the forked line is one job of the client, replying when it exits
+  struct job_control job = {0};
+  job.procs = calloc(1, sizeof(struct job_process));
+  job.procs[0].pid = pid;
+  job.procs[0].pidfd = watch_child(pid);
+  job.proc_count = 1;
+  job.live_count = 1;
+  job.job_pid = pid;
+  job.running = true;
+  job.show = true;
+  job.command = strdup(original);
+  clock_gettime(CLOCK_MONOTONIC, &job.usage.start);
+  set_job_id(add_job(&job));
+  client_started(true, false, false);
+}
+
+void client_close(struct client *client) {
+  // the client hung up, its running job gets SIGHUP like a closed terminal
+  for (int i = job_head; i != -1; i = processes[i].next) {
+    if (processes[i].owner == client) {
+      processes[i].on_done = NULL;
+      processes[i].owner = NULL;
+      kill(-processes[i].job_pid, SIGHUP);
+      kill(-processes[i].job_pid, SIGCONT);
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    if (client->fds[i] >= 0) {
+      close(client->fds[i]);
+    }
+  }
+  clients[client->sock] = NULL;
+  close(client->sock);  // also drops it from the epoll set
+  free(client);
+}
+
+void client_accept() {
+  int sock;
+  while ((sock = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    if (sock >= client_capacity) {
+      int capacity = client_capacity ? client_capacity : 64;
+      while (capacity <= sock) {
+        capacity *= 2;
+      }
+      clients = realloc(clients, capacity * sizeof(struct client *));
+      memset(clients + client_capacity, 0,
+             (capacity - client_capacity) * sizeof(struct client *));
+      client_capacity = capacity;
+    }
+    struct client *client = calloc(1, sizeof(struct client));
+    client->sock = sock;
+    client->fds[0] = client->fds[1] = client->fds[2] = -1;
+    clients[sock] = client;
+    watch_fd(sock, EV_CLIENT, EPOLLIN, EPOLL_CTL_ADD);
+  }
+}
+
+void client_read(struct client *client) {
+  // receives one line with its three fds and runs it
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {.iov_base = client_line, .iov_len = CLIENT_LINE_MAX};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  ssize_t n = recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0 && errno == EAGAIN) {
+    return;
+  }
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)) ||
+      (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    // end of the connection, or a message that does not follow the protocol
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+      int *fds = (int *)CMSG_DATA(cmsg);
+      for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+           i++) {
+        close(fds[i]);
+      }
+    }
+    client_close(client);
+    return;
+  }
+  memcpy(client->fds, CMSG_DATA(cmsg), sizeof(client->fds));
+  client_line[n] = '\0';
+
+  // no more lines until this one is done, a hangup is still reported
+  watch_fd(client->sock, EV_CLIENT, 0, EPOLL_CTL_MOD);
+  session_enter(client);
+  // here-documents come from the lines after the command in the message
+  buffer_next = client_line;
+  buffer_end = client_line + n;
+  more_input = buffer_line;
+  bool keep_going = eval(buffer_line());
+  more_input = NULL;
+  session_leave();
+  if (!keep_going) {
+    serving_stop = true;  // quit shuts the whole server down
+  }
+  if (!client->waiting) {
+    client->status = last_status;  // no job left, a builtin or a failure
+    client_reply(client);
+  }
+}
+
+void server_event(enum event_source source, int fd, uint32_t events) {
+  // called by process_events for the listening socket and the clients
+  if (source == EV_LISTEN) {
+    client_accept();
+    return;
+  }
+  struct client *client = fd < client_capacity ? clients[fd] : NULL;
+  if (client == NULL) {
+    return;
+  } else if (!client->waiting) {
+    client_read(client);
+  } else if (events & (EPOLLHUP | EPOLLERR)) {
+    client_close(client);
+  }
+}
+
+void server_interrupt() {
+  serving_stop = true;
+}
+
+int run_server(const char *path) {
+  // listens on path until CTRL + C or a client runs quit
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Socket path %s is too long.\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);  // left behind by a server that was killed
+  }
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "Cannot listen on %s: ", path);
+    perror("");
+    return 1;
+  }
+  listen_path = path;
+  client_line = malloc(CLIENT_LINE_MAX + 1);
+  for (int i = 0; i < 3; i++) {
+    server_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+  }
+  watch_stdin(false);  // lines only come from clients
+  watch_fd(listen_fd, EV_LISTEN, EPOLLIN, EPOLL_CTL_ADD);
+  interrupt_hook = server_interrupt;
+
+  while (!serving_stop) {
+    process_events(-1);
+  }
+
+  for (int i = job_head; i != -1; i = processes[i].next) {
+    kill(-processes[i].job_pid, SIGHUP);
+  }
+  for (int fd = 0; fd < client_capacity; fd++) {
+    if (clients[fd] != NULL) {
+      client_close(clients[fd]);
+    }
+  }
+  close(listen_fd);
+  unlink(path);
+  return 0;
+}
+
+int run_client(const char *path, char *command) {
+  // shell --connect PATH [-c command] sends command, or every line of stdin,
+  // to a server and exits with the status of the last one
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Cannot connect to %s: ", path);
+    perror("");
+    return 1;
+  }
+  // lines read from stdin leave the commands nothing to read
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  if (command == NULL) {
+    fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  int status = 0;
+  char *line = command;
+  size_t cap = 0;
+  ssize_t len = command ? (ssize_t)strlen(command) : 0;
+  while (command != NULL || (len = getline(&line, &cap, stdin)) >= 0) {
+    if (command == NULL && len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      if (command != NULL) {
+        break;
+      }
+      continue;  // the server reads an empty message as a hangup
+    }
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {.iov_base = line, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    char reply[16];
+    ssize_t n;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ||
+        (n = recv(sock, reply, sizeof(reply) - 1, 0)) <= 0) {
+      fprintf(stderr, "Lost the connection to %s.\n", path);
+      status = 1;
+      break;
+    }
+    reply[n] = '\0';
+    status = atoi(reply);
+    if (command != NULL) {
+      break;
+    }
+  }
+  if (command == NULL) {
+    free(line);  // grown by getline
+  }
+  close(sock);
+  return status;
+}
+
+/* ---- control flow ----
+ * A line with ;, && or || or one that starts with if, while, until, for,
+ * { or a function definition is parsed once into a tree of nodes and then
+ * run, reading more lines while a construct is still open. A simple command
+ * keeps its tokens unexpanded, so a loop expands them again on every pass
+ * but never tokenizes or parses its body again; what an expansion
+ * allocates is handed back to the arena after each command. Functions keep
+ * a malloc'd copy of their tree. */
+
+#define FUNCTION_BUCKETS 64
+#define FUNCTION_DEPTH 1000  // calls nested deeper than this fail
+#define LOOP_POLL 256        // passes of a loop between looks at CTRL + C
+
+enum node_kind {
+  NODE_COMMAND,
+  NODE_AND,
+  NODE_OR,
+  NODE_IF,
+  NODE_WHILE,
+  NODE_UNTIL,
+  NODE_FOR,
+  NODE_GROUP,
+  NODE_FUNCTION
+};
+
+struct node {
+  enum node_kind kind;
+  char **words;       // COMMAND: its tokens, FOR: the words after in, or
+                      // NULL for "$@"; NULL terminated
+  char *text;         // COMMAND: the words joined, as jobs shows it
+  char *name;         // FOR: the variable, FUNCTION: the function
+  struct node *cond;  // IF and loops: the condition, AND, OR: the left side
+  struct node *body;  // IF: then, loops: do, AND, OR: the right side,
+                      // GROUP, FUNCTION: the commands
+  struct node *other;  // IF: elif or else
+  struct node *next;   // the next command of the same list
+};
+
+struct parser {
+  struct token_list tokens;  // every line so far, joined with OP_SEMI
+  int at;
+  bool more;  // ran out of tokens in the middle of a construct
+  bool error;
+};
+
+struct function {
+  char *name;
+  struct node *body;
+  struct function *next;  // next in the same bucket
+};
+
+struct function *functions[FUNCTION_BUCKETS];
+int function_depth = 0;
+bool quitting = false;  // quit ran inside a compound command
+int loop_depth = 0;     // loops running around the current command
+
+// return, break and continue unwind the lists they ran in until the
+// function or the loop they name has seen them
+enum unwind { UNWIND_NONE, UNWIND_RETURN, UNWIND_BREAK, UNWIND_CONTINUE };
+enum unwind unwinding = UNWIND_NONE;
+int unwind_loops = 0;  // loops break or continue still has to get out of
+
+bool run_command(char **args, int argc);
+int run_list(struct node *node);
+
+bool is_word(const char *token, const char *word) {
+  // a reserved word is only one when it is not quoted
+  return token != NULL && !is_operator((char *)token) &&
+         strcmp(token, word) == 0;
+}
+
+bool is_function_name(const char *token) {
+  // name() starts a function definition
+  size_t len = token ? strlen(token) : 0;
+  return len > 2 && !is_operator((char *)token) &&
+         strcmp(token + len - 2, "()") == 0 && is_name(token, len - 2);
+}
+
+bool is_compound(struct token_list *tokens) {
+  // whether the line needs the parser, most lines are one simple command
+  char *first = tokens->count > 0 ? tokens->items[0] : NULL;
+  if (first == NULL) {
+    return false;
+  } else if (is_word(first, "if") || is_word(first, "while") ||
+             is_word(first, "until") || is_word(first, "for") ||
+             is_word(first, "{") || is_word(first, "function") ||
+             is_function_name(first)) {
+    return true;
+  }
+  for (int i = 0; i < tokens->count; i++) {
+    char *token = tokens->items[i];
+    if (token == OP_SEMI || token == OP_AND || token == OP_OR) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct node *node_new(enum node_kind kind) {
+  struct node *node = arena_alloc(&parse_arena, sizeof(struct node));
+  *node = (struct node){kind};
+  return node;
+}
+
+char *parser_peek(struct parser *p) {
+  return p->at < p->tokens.count ? p->tokens.items[p->at] : NULL;
+}
+
+void parser_fail(struct parser *p, const char *near) {
+  if (!p->error && !p->more) {
+    fprintf(stderr, "Syntax error near %s.\n", near);
+  }
+  p->error = true;
+}
+
+bool parser_expect(struct parser *p, const char *word) {
+  // consumes word, false (and more or an error) if it is not next
+  char *token = parser_peek(p);
+  if (token == NULL) {
+    p->more = true;
+    return false;
+  } else if (!is_word(token, word)) {
+    parser_fail(p, token);
+    return false;
+  }
+  p->at++;
+  return true;
+}
+
+void parser_skip_separators(struct parser *p) {
+  while (parser_peek(p) == OP_SEMI) {
+    p->at++;
+  }
+}
+
+bool is_terminator(const char *token) {
+  // words that end the list they follow instead of starting a command
+  static const char *words[] = {"then", "elif", "else", "fi",
+                                "do",   "done", "}",    NULL};
+  for (int i = 0; words[i] != NULL; i++) {
+    if (is_word(token, words[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct node *parse_list(struct parser *p, bool nested);
+
+struct node *parse_simple(struct parser *p) {
+  // the words up to a separator; & ends a command and stays in it
+  struct node *node = node_new(NODE_COMMAND);
+  struct token_list words = {0};
+  size_t text_len = 0;
+  char *token;
+  while ((token = parser_peek(p)) != NULL && token != OP_SEMI &&
+         token != OP_AND && token != OP_OR) {
+    token_push(&words, token);
+    text_len += strlen(token) + 1;
+    p->at++;
+    if (token == OP_BACKGROUND) {
+      break;
+    }
+  }
+  if (words.count == 0) {
+    parser_fail(p, token);
+    return NULL;
+  }
+  node->words = words.items;
+  node->text = arena_alloc(&parse_arena, text_len);
+  char *at = node->text;
+  for (int i = 0; i < words.count; i++) {
+    at = stpcpy(at, words.items[i]);
+    *at++ = ' ';
+  }
+  at[-1] = '\0';
+  return node;
+}
+
+struct node *parse_if(struct parser *p) {
+  // after if or elif: list then list [elif ... | else list] fi
+  struct node *node = node_new(NODE_IF);
+  node->cond = parse_list(p, true);
+  if (node->cond == NULL || !parser_expect(p, "then") ||
+      (node->body = parse_list(p, true)) == NULL) {
+    return NULL;
+  }
+  char *token = parser_peek(p);
+  if (is_word(token, "elif")) {
+    p->at++;
+    node->other = parse_if(p);
+    return node->other ? node : NULL;
+  } else if (is_word(token, "else")) {
+    p->at++;
+    if ((node->other = parse_list(p, true)) == NULL) {
+      return NULL;
+    }
+  }
+  return parser_expect(p, "fi") ? node : NULL;
+}
+
+struct node *parse_loop(struct parser *p, enum node_kind kind) {
+  // after while or until: list do list done
+  struct node *node = node_new(kind);
+  node->cond = parse_list(p, true);
+  if (node->cond == NULL || !parser_expect(p, "do") ||
+      (node->body = parse_list(p, true)) == NULL ||
+      !parser_expect(p, "done")) {
+    return NULL;
+  }
+  return node;
+}
+
+struct node *parse_for(struct parser *p) {
+  // after for: NAME [in words] ; do list done
+  struct node *node = node_new(NODE_FOR);
+  node->name = parser_peek(p);
+  if (node->name == NULL) {
+    p->more = true;
+    return NULL;
+  } else if (is_operator(node->name) ||
+             !is_name(node->name, strlen(node->name))) {
+    parser_fail(p, node->name);
+    return NULL;
+  }
+  p->at++;
+  if (is_word(parser_peek(p), "in")) {
+    struct token_list words = {0};
+    token_push(&words, NULL);  // an empty list is still a list
+    words.count = 0;
+    char *token;
+    for (p->at++; (token = parser_peek(p)) != NULL && token != OP_SEMI;
+         p->at++) {
+      if (is_operator(token)) {
+        parser_fail(p, token);
+        return NULL;
+      }
+      token_push(&words, token);
+    }
+    node->words = words.items;
+  }
+  parser_skip_separators(p);
+  if (!parser_expect(p, "do") || (node->body = parse_list(p, true)) == NULL ||
+      !parser_expect(p, "done")) {
+    return NULL;
+  }
+  return node;
+}
+
+struct node *parse_command(struct parser *p) {
+  // one command: a compound one or a simple one
+  char *token = parser_peek(p);
+  if (token == NULL) {
+    p->more = true;
+    return NULL;
+  }
+  struct node *node = NULL;
+  if (is_word(token, "if")) {
+    p->at++;
+    return parse_if(p);
+  } else if (is_word(token, "while") || is_word(token, "until")) {
+    p->at++;
+    return parse_loop(p, *token == 'w' ? NODE_WHILE : NODE_UNTIL);
+  } else if (is_word(token, "for")) {
+    p->at++;
+    return parse_for(p);
+  } else if (is_word(token, "{")) {
+    p->at++;
+    node = node_new(NODE_GROUP);
+    node->body = parse_list(p, true);
+    return node->body && parser_expect(p, "}") ? node : NULL;
+  } else if (is_word(token, "function") || is_function_name(token)) {
+    // name() { list } or function name [()] { list }
+    p->at++;
+    node = node_new(NODE_FUNCTION);
+    node->name = token;
+    if (is_word(token, "function")) {
+      node->name = parser_peek(p);
+      p->at++;
+    }
+    if (node->name == NULL) {
+      p->more = true;
+      return NULL;
+    }
+    size_t len = strlen(node->name);
+    len -= len > 2 && strcmp(node->name + len - 2, "()") == 0 ? 2 : 0;
+    if (is_operator(node->name) || !is_name(node->name, len)) {
+      parser_fail(p, node->name);
+      return NULL;
+    }
+    node->name = arena_strndup(&parse_arena, node->name, len);
+    parser_skip_separators(p);
+    if (parser_peek(p) == NULL) {
+      p->more = true;
+      return NULL;
+    } else if (!is_word(parser_peek(p), "{")) {
+      parser_fail(p, parser_peek(p));
+      return NULL;
+    }
+    node->body = parse_command(p);
+    return node->body ? node : NULL;
+  } else if (is_terminator(token)) {
+    parser_fail(p, token);
+    return NULL;
+  }
+  return parse_simple(p);
+}
+
+struct node *parse_and_or(struct parser *p) {
+  // commands joined with && and ||, grouped from the left
+  struct node *node = parse_command(p);
+  char *token;
+  while (node != NULL &&
+         ((token = parser_peek(p)) == OP_AND || token == OP_OR)) {
+    p->at++;
+    parser_skip_separators(p);  // a line may end after && or ||
+    struct node *joined = node_new(token == OP_AND ? NODE_AND : NODE_OR);
+    joined->cond = node;
+    joined->body = parse_command(p);
+    node = joined->body ? joined : NULL;
+  }
+  return node;
+}
+
+struct node *parse_list(struct parser *p, bool nested) {
+  // commands separated by ; or new lines; a nested list ends at a
+  // terminator word, the whole line at the end of the tokens
+  struct node *first = NULL;
+  struct node **tail = &first;
+  while (1) {
+    parser_skip_separators(p);
+    char *token = parser_peek(p);
+    if (token == NULL) {
+      p->more |= nested;
+      return nested ? NULL : first;
+    } else if (nested && is_terminator(token)) {
+      if (first == NULL) {
+        parser_fail(p, token);
+      }
+      return first;
+    }
+    struct node *node = parse_and_or(p);
+    if (node == NULL) {
+      return NULL;
+    }
+    *tail = node;
+    tail = &node->next;
+    if (parser_peek(p) != NULL && parser_peek(p) != OP_SEMI &&
+        node->kind != NODE_COMMAND) {
+      // a compound command has to be followed by a separator
+      parser_fail(p, parser_peek(p));
+      return NULL;
+    }
+  }
+}
+
+/* A function keeps its tree after the line that defined it is gone. */
+
+char **words_copy(char **words) {
+  if (words == NULL) {
+    return NULL;
+  }
+  int count = 0;
+  while (words[count] != NULL) {
+    count++;
+  }
+  char **copy = malloc((count + 1) * sizeof(char *));
+  for (int i = 0; i < count; i++) {
+    copy[i] = is_operator(words[i]) ? words[i] : strdup(words[i]);
+  }
+  copy[count] = NULL;
+  return copy;
+}
+
+struct node *node_copy(struct node *node) {
+  if (node == NULL) {
+    return NULL;
+  }
+  struct node *copy = malloc(sizeof(struct node));
+  *copy = *node;
+  copy->words = words_copy(node->words);
+  copy->text = node->text ? strdup(node->text) : NULL;
+  copy->name = node->name ? strdup(node->name) : NULL;
+  copy->cond = node_copy(node->cond);
+  copy->body = node_copy(node->body);
+  copy->other = node_copy(node->other);
+  copy->next = node_copy(node->next);
+  return copy;
+}
+
+void node_free(struct node *node) {
+  if (node == NULL) {
+    return;
+  }
+  for (int i = 0; node->words && node->words[i] != NULL; i++) {
+    if (!is_operator(node->words[i])) {
+      free(node->words[i]);
+    }
+  }
+  free(node->words);
+  free(node->text);
+  free(node->name);
+  node_free(node->cond);
+  node_free(node->body);
+  node_free(node->other);
+  node_free(node->next);
+  free(node);
+}
+
+struct function *function_find(const char *name) {
+  struct function *fn = functions[hash_string(name) % FUNCTION_BUCKETS];
+  while (fn != NULL && strcmp(fn->name, name) != 0) {
+    fn = fn->next;
+  }
+  return fn;
+}
+
+void function_define(const char *name, struct node *body) {
+  // a function that is running keeps its old tree, so that one is only
+  // freed when no function runs
+  struct function *fn = function_find(name);
+  if (fn == NULL) {
+    fn = calloc(1, sizeof(struct function));
+    fn->name = strdup(name);
+    struct function **bucket = &functions[hash_string(name) % FUNCTION_BUCKETS];
+    fn->next = *bucket;
+    *bucket = fn;
+  } else if (function_depth == 0) {
+    node_free(fn->body);
+  }
+  fn->body = node_copy(body);
+}
 
-void sigint_handler() {
-  // handles the CTRL + C (SIGINT) signal
-  int delete_index = -1;
-  foreground = false;
+int call_function(struct function *fn, char **args, int argc) {
+  // runs the body with args[1...] as $1 ...
+  if (function_depth >= FUNCTION_DEPTH) {
+    fprintf(stderr, "%s: functions nested too deep.\n", fn->name);
+    return 1;
+  }
+  char **saved = positional;
+  int saved_count = positional_count;
+  positional = args + 1;
+  positional_count = argc - 1;
+  int saved_loops = loop_depth;
+  loop_depth = 0;  // break in the body does not reach the caller's loops
+  function_depth++;
+  int status = run_list(fn->body);
+  function_depth--;
+  loop_depth = saved_loops;
+  unwinding = UNWIND_NONE;  // a return ends here
+  positional = saved;
+  positional_count = saved_count;
+  return status;
+}
 
-  if (foreground_pid > 0) {
-    // send signal to kill the process
-    for (int i = 0; i < MAX_PROCESS; i++) {
-      if (processes[i].job_pid == foreground_pid) {
-        // decrement max_jobs
-        max_jobs--;
-        delete_index = i;
-        kill(foreground_pid, SIGINT);  // terminate the process
-      }
+/* Running the tree. */
+
+int run_simple(struct node *node) {
+  // expands a copy of the tokens, everything it allocates is given back
+  struct arena_mark mark = arena_mark(&parse_arena);
+  struct token_list tokens = {0};
+  for (int i = 0; node->words[i] != NULL; i++) {
+    token_push(&tokens, node->words[i]);
+  }
+  original = node->text;
+  command_start = monotonic_ns();
+  release_listings();  // a directory may have changed since the last pass
+  expand_words(&tokens, true);
+  time_since(T_PARSE, command_start);
+  read_documents(&tokens, true);
+  if (tokens.count > 0 && !run_command(tokens.items, tokens.count)) {
+    quitting = true;
+  }
+  arena_release(&parse_arena, mark);
+  return last_status;
+}
+
+bool loop_stopped(int *passes) {
+  // CTRL + C ends a loop, even one that only runs builtins
+  if (++*passes % LOOP_POLL == 0) {
+    process_events(0);
+  }
+  return quitting || interrupted;
+}
+
+bool stopping() {
+  // the rest of a list is skipped after quit, return, break or continue
+  return quitting || unwinding != UNWIND_NONE;
+}
+
+bool loop_unwound() {
+  // after a pass of a loop, true if the loop ends here; break N and
+  // continue N end N - 1 loops and then break or continue the next one
+  if (unwinding == UNWIND_BREAK || unwinding == UNWIND_CONTINUE) {
+    if (unwind_loops > 1) {
+      unwind_loops--;
+      return true;
     }
+    bool ends = unwinding == UNWIND_BREAK;
+    unwinding = UNWIND_NONE;
+    return ends;
+  }
+  return unwinding != UNWIND_NONE;
+}
+
+int unwind_start(enum unwind kind, char **args, struct writer *err) {
+  // return [N], break [N] and continue [N], returns the builtin's status
+  char *end = "";
+  long n = args[1] ? strtol(args[1], &end, 10) : 0;
+  if (args[1] != NULL && (*end != '\0' || end == args[1])) {
+    writer_printf(err, "%s: %s: numeric argument required\n", args[0],
+                  args[1]);
+    return 2;
+  } else if (kind == UNWIND_RETURN && function_depth == 0) {
+    writer_printf(err, "return: not in a function\n");
+    return 1;
+  } else if (kind != UNWIND_RETURN && loop_depth == 0) {
+    writer_printf(err, "%s: not in a loop\n", args[0]);
+    return 1;
+  } else if (kind != UNWIND_RETURN && args[1] != NULL && n < 1) {
+    writer_printf(err, "%s: %s: loop count out of range\n", args[0],
+                  args[1]);
+    return 1;
+  }
+  unwinding = kind;
+  if (kind == UNWIND_RETURN) {
+    return args[1] ? n & 0xff : last_status;
+  }
+  unwind_loops = args[1] == NULL ? 1 : n < loop_depth ? n : loop_depth;
+  return 0;
+}
 
-    // remove from jobs
-    if (delete_index != -1) {
-      // removes the struct and shifts the rest
-      for (int i = delete_index; i < MAX_PROCESS - 1; i++) {
-        processes[i] = processes[i + 1];
+int run_node(struct node *node) {
+  int status = 0;
+  int passes = 0;
+  switch (node->kind) {
+    case NODE_COMMAND:
+      return run_simple(node);
+    case NODE_AND:
+    case NODE_OR:
+      status = run_node(node->cond);
+      if ((status == 0) == (node->kind == NODE_AND) && !stopping()) {
+        status = run_node(node->body);
+      }
+      return status;
+    case NODE_IF:
+      if (run_list(node->cond) == 0) {
+        return stopping() ? last_status : run_list(node->body);
+      }
+      if (stopping()) {
+        return last_status;  // return in the condition
+      }
+      return node->other ? run_list(node->other) : 0;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+      loop_depth++;
+      while (!loop_stopped(&passes)) {
+        bool pass = (run_list(node->cond) == 0) == (node->kind == NODE_WHILE);
+        if (unwinding != UNWIND_NONE) {
+          if (loop_unwound()) {
+            break;
+          }
+          continue;  // continue in the condition tests it again
+        } else if (!pass) {
+          break;
+        }
+        status = run_list(node->body);
+        if (loop_unwound()) {
+          break;
+        }
       }
+      loop_depth--;
+      return unwinding == UNWIND_RETURN ? last_status : status;
+    case NODE_FOR: {
+      // the words are expanded once, then each is assigned in turn
+      struct arena_mark mark = arena_mark(&parse_arena);
+      struct token_list values = {0};
+      if (node->words == NULL) {
+        for (int i = 0; i < positional_count; i++) {
+          token_push(&values, positional[i]);
+        }
+      } else {
+        for (int i = 0; node->words[i] != NULL; i++) {
+          token_push(&values, node->words[i]);
+        }
+        expand_words(&values, true);
+      }
+      size_t name_len = strlen(node->name);
+      loop_depth++;
+      for (int i = 0; i < values.count && !loop_stopped(&passes); i++) {
+        size_t len = strlen(values.items[i]);
+        char *assignment = arena_alloc(&parse_arena, name_len + len + 2);
+        memcpy(assignment, node->name, name_len);
+        assignment[name_len] = '=';
+        memcpy(assignment + name_len + 1, values.items[i], len + 1);
+        variable_set(assignment, false);
+        env_rebuild();
+        status = run_list(node->body);
+        if (loop_unwound()) {
+          break;
+        }
+      }
+      loop_depth--;
+      arena_release(&parse_arena, mark);
+      return unwinding == UNWIND_RETURN ? last_status : status;
     }
+    case NODE_GROUP:
+      return run_list(node->body);
+    case NODE_FUNCTION:
+      function_define(node->name, node->body);
+      return 0;
   }
+  return status;
+}
 
-  if (foreground_pid == 0) {
-    printf("\nprompt > ");
-    fflush(stdout);
+int run_list(struct node *node) {
+  // runs the commands of a list, the status is the last one's
+  int status = 0;
+  for (; node != NULL && !stopping(); node = node->next) {
+    status = run_node(node);
+    last_status = status;
   }
+  return status;
+}
 
-  return;
+bool only_definitions(struct node *node) {
+  // a line of function definitions, which a client can run in the server
+  for (; node != NULL; node = node->next) {
+    if (node->kind != NODE_FUNCTION) {
+      return false;
+    }
+  }
+  return true;
 }
 
-void sigtstp_handler() {
-  // handles the CTRL + Z (SIGTSTP) signal
+void read_line_documents(struct token_list *tokens, int from) {
+  // here-documents are read as their line comes in, before the lines after
+  // them are parsed, and a loop must not read them again on every pass
+  for (int i = from; i + 1 < tokens->count; i++) {
+    struct redirect_op *op = as_redirect(tokens->items[i]);
+    char *word = tokens->items[i + 1];
+    if (op != NULL && op->kind == REDIRECT_HEREDOC && !is_operator(word)) {
+      tokens->items[i + 1] = read_document(remove_quotes(word));
+    }
+  }
+}
 
-  foreground = false;
+void run_compound(struct token_list *tokens) {
+  // parses the line, with as many more lines as it takes, and runs it
+  struct parser p = {*tokens};
+  struct node *tree;
+  read_line_documents(&p.tokens, 0);
+  while ((tree = parse_list(&p, false)) == NULL && p.more && !p.error) {
+    char *line = more_input ? more_input() : NULL;
+    if (line == NULL) {
+      fprintf(stderr, "Unexpected end of input.\n");
+      last_status = 2;
+      return;
+    }
+    token_push(&p.tokens, OP_SEMI);
+    int from = p.tokens.count;
+    if (!tokenize(line, &p.tokens)) {
+      last_status = 2;
+      return;
+    }
+    read_line_documents(&p.tokens, from);
+    p = (struct parser){p.tokens};
+  }
+  time_since(T_PARSE, command_start);
+  if (p.error) {
+    last_status = 2;
+    return;
+  }
+  if (serving != NULL && !only_definitions(tree)) {
+    // a client's line runs in order without holding up the server
+    pid_t pid = client_fork();
+    if (pid == 0) {
+      last_status = 0;
+      run_list(tree);
+      fflush(stdout);
+      _exit(last_status);
+    } else if (pid > 0) {
+      client_job(pid);
+    } else {
+      last_status = 1;
+    }
+    return;
+  }
+  run_list(tree);
+}
 
-  if ((foreground_pid > 0) && (builtin == false)) {
-    max_jobs++;
-    struct job_control job;  // initialize a new job
+void eval_reset(char *user_str) {
+  // starts the next command line, what the last one used is given back
+  original = user_str;
+  command_start = monotonic_ns();
+  release_captures();
+  release_listings();
+  arena_reset(&parse_arena);
+}
+
+bool eval_tokens(struct token_list tokens);
 
-    // set the attributes
-    job.job_id = job_counter;
-    job.job_pid = foreground_pid;
-    job.running = true;
-    job.foreground = true;
-    job.terminated = false;
-    job.show = true;
-    strncpy(job.command, original, MAX);
+bool eval(char *user_str) {
+  // parses and runs one command line, returns false when the shell should quit
+  struct token_list tokens = {0};
+  eval_reset(user_str);
 
-    job_counter++;  // increment the ID
-    // add job to the array
-    processes[job_index] = job;
-    job_index++;  // increment index
+  // split the input into args, everything lives in parse_arena
+  if (!tokenize(user_str, &tokens)) {
+    last_status = 2;  // a syntax error, like the parser's
+    return true;
   }
+  return eval_tokens(tokens);
+}
 
-  // add the process in case quit randomly
-  child_processes[child_process_num] = foreground_pid;
-  child_process_num++;
-  if (foreground_pid > 0) {
-    for (int i = 0; i < MAX_PROCESS; i++) {
-      if (processes[i].job_pid == foreground_pid) {
-        processes[i].running = false;
-        processes[i].terminated = false;
-        processes[i].show = true;
-        kill(foreground_pid, SIGTSTP);  // sends stop signal
+bool eval_tokens(struct token_list tokens) {
+  // runs a tokenized command line, from eval or the rc cache
+  bool keep_going = true;
+  interrupted = false;
+  if (is_compound(&tokens)) {
+    run_compound(&tokens);
+  } else {
+    expand_words(&tokens, false);
+    time_since(T_PARSE, command_start);
+    read_documents(&tokens, false);
+    keep_going = tokens.count == 0 || run_command(tokens.items, tokens.count);
+  }
+  keep_going = keep_going && !quitting;
+  quitting = false;
+  unwinding = UNWIND_NONE;
+  return keep_going;
+}
+
+bool run_command(char **args, int argc) {
+  // runs one expanded command, returns false when the shell should quit
+  // args is NULL terminated
+
+  /* ----  defining the variables ---- */
+  // a trailing & runs the command in the background
+  bool background = (argc > 1) && (args[argc - 1] == OP_BACKGROUND);
+  if (background) {
+    argc--;
+    args[argc] = NULL;
+  }
+
+  // time in front of a command reports its usage once it is done
+  bool timed = argc > 1 && strcmp(args[0], "time") == 0;
+  if (timed) {
+    args++;
+    argc--;
+  }
+
+  // NAME=value words alone set variables, in front of a command they only
+  // go into that command's environment
+  int assignments = 0;
+  while (assignments < argc && !is_operator(args[assignments]) &&
+         is_assignment(args[assignments])) {
+    assignments++;
+  }
+  if (assignments == argc) {
+    for (int i = 0; i < argc; i++) {
+      variable_set(args[i], false);
+    }
+    env_rebuild();
+    last_status = capture_status;  // x=$(false) fails like the capture
+    return true;
+  }
+  char **envp = assignments > 0 ? command_env(args, assignments) : NULL;
+  args += assignments;
+  argc -= assignments;
+
+  // run [options] places the job, or with %id moves a running one
+  struct placement *place = NULL;
+  if (strcmp(args[0], "run") == 0) {
+    char **command = placement_parse(args, &place);
+    if (command == NULL) {
+      last_status = 1;
+      return true;
+    }
+    argc -= command - args;
+    args = command;
+    if (args[0][0] == '%' && argc == 1) {
+      int slot = find_job_arg(args[0]);
+      if (slot != -1) {
+        place_job(slot, place);
+      } else {
+        placement_free(place);
       }
+      last_status = slot != -1 ? 0 : 1;
+      return true;
     }
   }
 
-  if (foreground_pid == 0) {
-    printf("\nprompt > ");
-    fflush(stdout);
+  bool pipeline = false;  // true if the stages are connected with |
+  for (int i = 0; i < argc; i++) {
+    if (args[i] == OP_PIPE) {
+      pipeline = true;
+    }
   }
 
-  return;
-}
+  // a function runs in the shell itself, with the words after it as $1 ...
+  struct function *fn =
+      pipeline || place != NULL ? NULL : function_find(args[0]);
+  struct job_usage timing;  // time around a function or a builtin
+  if (timed) {
+    usage_now(&timing);
+  }
+  if (fn != NULL) {
+    last_status = call_function(fn, args, argc);
+    if (timed) {
+      usage_since(&timing);
+      time_done(NULL, 0, &timing);
+    }
+    return !quitting;
+  }
 
-void sigchld_handler() {
-  int waitCondition = WUNTRACED | WCONTINUED | WNOHANG;
-  // option to track stopped (due to signal), continued, process
-  // WNOHANG: waitpid return status info immediately, without waiting for
-  // process to terminate;
+  // a builtin has its redirections resolved here and prints through out and
+  // err, every other command carries its plan into the child in launch_job
+  int builtin_id = pipeline || place != NULL ? -1 : builtin_find(args[0]);
+  bool run_builtin = builtin_id >= 0;
+  int builtin_status = 0;  // what the builtin leaves in $?
+  struct builtin_io io;
+  struct writer out;
+  struct writer err;
+  if (run_builtin) {
+    struct launch plan = {0};
+    plan.args = args;
+    take_redirections(&plan);  // args keeps only the words
+    if (!builtin_io_open(&plan, &io)) {
+      builtin_io_close(&io);
+      last_status = 1;
+      return true;
+    }
+    out.fd = io.fds[STDOUT_FILENO];
+    out.len = 0;
+    err.fd = io.fds[STDERR_FILENO];
+    err.len = 0;
+  }
 
-  int childStatus;
-  int delete_index = -1;
-  pid_t child_pid;
+  /* ---- executing the commands ---- */
+  bool keep_going = true;
+  if (!run_builtin) {
+    // EXTERNAL COMMAND or PIPELINE, pwd, jobs, export and utility stages
+    // run in a forked copy of the shell
+    builtin = false;
+    // a client's line never holds up the shell, its job reports back instead
+    bool started =
+        launch_job(args, background || serving != NULL, place, envp);
+    if (!started || background || serving != NULL) {
+      last_status = started ? 0 : 1;  // a foreground job sets it when done
+    }
+    if (serving != NULL) {
+      client_started(started, background, timed);
+    } else if (started && timed) {
+      processes[job_tail].on_done = time_done;
+    }
+  } else if (builtin_id == BUILTIN_CD) {
+    builtin = true;
+    // change working directory
+    char *change_dir = args[1];  // directory to change to if command is cd
+    int change;  // int for chrdir to check if error occurred
 
-  // handles when the child is terminated - call waitpid to reap the child
-  //  waitpid first arg pid -1 is any child that terminates
-  while ((child_pid = waitpid(-1, &childStatus, waitCondition)) > 0) {
-    if ((WIFEXITED(childStatus)) && WEXITSTATUS(childStatus)) {
-      // error
-      foreground = false;
-      printf("prompt > ");
-      fflush(stdout);
-    } else if (WIFEXITED(childStatus)) {
-      // regular termiate
-      foreground = false;
+    change = chdir(change_dir);
 
-      for (int i = 0; i < MAX_PROCESS; i++) {
-        if (processes[i].job_pid == child_pid) {
-          delete_index = i;
-          processes[i].terminated = true;
-          processes[i].show = false;  // make show false if it is background
-          if (max_jobs > 0) {
-            max_jobs--;
-          }
+    if (change != 0) {
+      writer_printf(&err, "Cannot change to directory %s: %s\n", change_dir,
+                    strerror(errno));
+      builtin_status = 1;
+    }
+  } else if (builtin_id == BUILTIN_PWD) {
+    builtin = true;
+    // show working directory
+    print_working_dir(&out);
+  } else if (builtin_id == BUILTIN_JOBS) {
+    builtin = true;
+    // show all the processes (jobs)
+    print_jobs(&out, args[1] && strcmp(args[1], "-l") == 0);
+    if (out.fd == STDOUT_FILENO) {
+      record_jobs();  // a replay only sees what reached the terminal
+    }
+  } else if (builtin_id == BUILTIN_KILL) {
+    // kill
+    builtin = true;
+    int status;
+    int slot = find_job_arg(args[1]);
+    if (slot != -1) {
+      // kill and reap every process in the job's process group, the last
+      // one removes the job and runs its on_done like sigchld_handler does
+      struct job_control *job = &processes[slot];
+      int live = job->live_count;
+      kill(-job->job_pid, SIGKILL);
+      for (int i = 0; live > 0 && i < job->proc_count; i++) {
+        struct job_process *proc = &processes[slot].procs[i];
+        struct rusage ru;
+        if (!proc->done && wait4(proc->pid, &status, 0, &ru) == proc->pid) {
+          live--;
+          process_reaped(slot, proc, status, &ru);
         }
       }
-
-      if (delete_index != -1) {
-        // removes the struct and shifts the rest
-        for (int i = delete_index; i < MAX_PROCESS - 1; i++) {
-          processes[i] = processes[i + 1];
-        }
+    } else {
+      builtin_status = 1;
+    }
+  } else if (builtin_id == BUILTIN_FG) {
+    builtin = true;
+    int slot = find_job_arg(args[1]);
+    if (slot != -1) {
+      // changing to fg
+      struct job_control *job = &processes[slot];
+      job->foreground = true;
+      foreground_pid = job->job_pid;  // Store foreground group
+      foreground = true;
+      give_terminal(foreground_pid);
+      // Send a SIGCONT signal to resume the job if it's stopped
+      if (!job->running) {
+        job->running = true;
+        kill(-job->job_pid, SIGCONT);  // Resume the pipeline
       }
-
-    } else if (WIFSIGNALED(childStatus)) {
-      // ctrl + c
+    } else {
+      builtin_status = 1;
+    }
+  } else if (builtin_id == BUILTIN_BG) {
+    builtin = true;
+    int slot = find_job_arg(args[1]);
+    // changing to bg
+    struct job_control *job = slot != -1 ? &processes[slot] : NULL;
+    // Changing a foreground job to the background
+    if (job && (job->foreground) && (!job->running)) {
+      job->foreground = false;
+      job->running = true;
       foreground = false;
-      for (int i = 0; i < MAX_PROCESS; i++) {
-        if (processes[i].job_pid == child_pid) {
-          delete_index = i;
-          processes[i].terminated = true;
-          processes[i].show = false;  // make show false if it is background
-          if (max_jobs > 0) {
-            max_jobs--;
+      kill(-job->job_pid, SIGCONT);  // Resume the pipeline
+      // Send a SIGCONT signal to resume the job if it's stopped
+    } else if (job == NULL) {
+      builtin_status = 1;
+    }
+  } else if (builtin_id == BUILTIN_HASH) {
+    builtin = true;
+    if (args[1] == NULL) {
+      // show the remembered commands
+      if (hash_count == 0) {
+        writer_printf(&out, "hash: hash table empty\n");
+      } else {
+        writer_printf(&out, "hits\tcommand\n");
+        for (size_t i = 0; i < hash_capacity; i++) {
+          if (hash_table[i].name) {
+            writer_printf(&out, "%4d\t%s\n", hash_table[i].hits,
+                          hash_table[i].path);
           }
         }
       }
-
-      if (delete_index != -1) {
-        // removes the struct and shifts the rest
-        for (int i = delete_index; i < MAX_PROCESS - 1; i++) {
-          processes[i] = processes[i + 1];
+    } else if (strcmp(args[1], "-r") == 0) {
+      // forget every remembered location
+      if (hash_table != NULL) {
+        hash_clear();
+      }
+    } else {
+      // look up and remember the given commands
+      for (int i = 1; args[i] != NULL; i++) {
+        if (hash_lookup(args[i]) == NULL && strchr(args[i], '/') == NULL) {
+          writer_printf(&out, "hash: %s: not found\n", args[i]);
+          builtin_status = 1;
         }
       }
-
-      printf("prompt > ");
-      fflush(stdout);
-    } else if (WIFSTOPPED(childStatus)) {
-      //  ctrl + z
-      foreground = false;
-      printf("prompt > ");
-      fflush(stdout);
     }
-    if (WIFCONTINUED(childStatus)) {
-      foreground = true;
+  } else if (builtin_id == BUILTIN_EXPORT) {
+    builtin = true;
+    // export NAME[=value]..., alone it lists the environment
+    if (args[1] == NULL) {
+      print_variables(&out);
     }
+    for (int i = 1; args[i] != NULL; i++) {
+      if (is_name(args[i], strcspn(args[i], "="))) {
+        variable_set(args[i], true);
+      } else {
+        writer_printf(&err, "export: %s: not a valid name\n", args[i]);
+        builtin_status = 1;
+      }
+    }
+    env_rebuild();
+  } else if (builtin_id == BUILTIN_UNSET) {
+    builtin = true;
+    for (int i = 1; args[i] != NULL; i++) {
+      variable_unset(args[i]);
+    }
+    env_rebuild();
+  } else if (builtin_id == BUILTIN_PARALLEL) {
+    builtin = true;
+    run_parallel(args, &io);
+  } else if (builtin_id == BUILTIN_STATS) {
+    builtin = true;
+    // latency histograms of the shell itself, -r starts them over
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+      reset_stats();
+    } else {
+      print_stats(&out);
+    }
+  } else if (builtin_id == BUILTIN_HISTORY) {
+    builtin = true;
+    print_history(&out, args);
+  } else if (builtin_id == BUILTIN_RETURN) {
+    builtin = true;
+    builtin_status = unwind_start(UNWIND_RETURN, args, &err);
+  } else if (builtin_id == BUILTIN_BREAK) {
+    builtin = true;
+    builtin_status = unwind_start(UNWIND_BREAK, args, &err);
+  } else if (builtin_id == BUILTIN_CONTINUE) {
+    builtin = true;
+    builtin_status = unwind_start(UNWIND_CONTINUE, args, &err);
+  } else if (builtin_id == BUILTIN_QUIT) {
+    builtin = true;
+    // terminate all processes and shell processes then break
+    for (int i = job_head; i != -1; i = processes[i].next) {
+      kill(-processes[i].job_pid, SIGKILL);
+    }
+    keep_going = false;
+  } else if (builtin_id == BUILTIN_LAUNCH) {
+    builtin = true;
+    // shows or picks the engine used to start external commands
+    if (args[1] == NULL) {
+      writer_printf(&out, "%s\n",
+                    launch_engine == LAUNCH_SPAWN ? "spawn" : "fork");
+    } else if (strcmp(args[1], "spawn") == 0) {
+      launch_engine = LAUNCH_SPAWN;
+    } else if (strcmp(args[1], "fork") == 0) {
+      launch_engine = LAUNCH_FORK;
+    } else {
+      writer_printf(&out, "launch: engine should be fork or spawn.\n");
+      builtin_status = 1;
+    }
+  } else if (is_utility(builtin_id)) {
+    builtin = true;
+    // echo, printf, test, [, true and false
+    builtin_status = run_utility(builtin_id, args, &out, &err);
+  }
+
+  if (run_builtin) {
+    writer_flush(&out);
+    writer_flush(&err);
+    builtin_io_close(&io);
+    last_status = builtin_status;
   }
+  if (foreground) {
+    // block until the foreground job finishes or stops
+    wait_foreground();
+  }
+  if (run_builtin && timed) {
+    usage_since(&timing);
+    time_done(NULL, 0, &timing);
+  }
+  return keep_going;
 }
 
-int main() {
-  /* ----  signal handlers ---- */
-  signal(SIGINT, sigint_handler);
-  signal(SIGTSTP, sigtstp_handler);
-  signal(SIGCHLD, sigchld_handler);
+void run_buffer(char *buf, size_t len) {
+  // runs every line of buf in place, the newlines are overwritten with NULs
+  // so no line is copied; buf[len] has to be writable
+  buffer_next = buf;
+  buffer_end = buf + len;
+  more_input = buffer_line;  // here-documents continue in the buffer
+  char *line;
+  while ((line = buffer_line()) != NULL) {
+    char *first = line + strspn(line, " \t");
+    if (*first != '#' && !eval(line)) {  // skip comments and #! lines
+      break;
+    }
+  }
+  more_input = NULL;
+}
+
+int run_script(char *path) {
+  // maps the script privately so run_buffer can terminate lines in place,
+  // returns the status of the last command the way sh does
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Cannot open file %s: ", path);
+    perror("");
+    return 1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
 
-  mode_t mode = S_IRWXU | S_IRWXG | S_IRWXO;  // permission bits
+  size_t len = st.st_size;
+  char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  madvise(map, len, MADV_SEQUENTIAL);
 
-  // continous loop of input until user quits
-  while (1) {
-    output_redirect = false;
-    input_redirect = false;
-    append = false;
-    if (foreground) {
-      // if foreground is true just continue without prompting
-      continue;
+  long page = sysconf(_SC_PAGESIZE);
+  if (map[len - 1] == '\n' || len % page != 0) {
+    // the terminator lands on a newline or in the zeroed tail of the page
+    run_buffer(map, len);
+  } else {
+    // the last line runs up to the end of a page, give it its own copy
+    size_t last_start = len;
+    while (last_start > 0 && map[last_start - 1] != '\n') {
+      last_start--;
     }
+    char *tail = strndup(map + last_start, len - last_start);
+    run_buffer(map, last_start);
+    run_buffer(tail, strlen(tail));
+    free(tail);
+  }
+  munmap(map, len);
+  return last_status;
+}
 
-    /* ----  defining the variables ---- */
-    char user_str[MAX];   // defining input string
-    char *args[MAX + 1];  // argument array (stores 80 args + 1 for the command)
+/* ---- startup ----
+ * ~/.cshellrc (or $CSHELL_RC) runs before the first prompt. Its tokens are
+ * kept in a binary cache next to it, stamped with the rc file's mtime and
+ * size, so a later start maps the cache and hands the tokens straight to
+ * eval_tokens instead of tokenizing the file again. The cache holds one
+ * record per command line: the line itself, then each token as an op code
+ * or a length-prefixed word. An rc file with here-documents, or a line
+ * that does not tokenize, is run as a plain script and not cached.
+ * --startup-profile prints how long each step up to the first prompt took. */
 
-    char *token;  // first token (command from user)
+#define RC_CACHE_MAGIC "CSHRC\0\0"
+#define RC_CACHE_VERSION 2
+#define STARTUP_MARKS 8
 
-    /* --- prompting user and parsing input */
-    printf("prompt > ");
-    fgets(user_str, MAX, stdin);  // using fgets to take input from stdin
+enum rc_token {
+  RC_WORD,
+  RC_PIPE,
+  RC_BACKGROUND,
+  RC_AND,
+  RC_OR,
+  RC_SEMI,
+  RC_REDIRECT
+};
 
-    // Remove newline character from input
-    size_t len = strlen(user_str);
-    if (len > 0 && user_str[len - 1] == '\n') {
-      user_str[len - 1] = '\0';
-    }
+// the operators in the order of enum rc_token
+char *rc_operators[] = {NULL, OP_PIPE, OP_BACKGROUND, OP_AND, OP_OR, OP_SEMI};
 
-    strncpy(original, user_str, MAX);
+struct rc_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t lines;
+  int64_t mtime_sec;  // of the rc file the tokens came from
+  int64_t mtime_nsec;
+  int64_t size;
+};
 
-    // split the input into args
-    int argc = 0;
-    char delimiter[] = " \t";
-    token = strtok(user_str, delimiter);  // get the first token (user command)
-    while (token != NULL) {
-      // Remove the newline character if it's present
-      args[argc] = token;
-      token = strtok(NULL, delimiter);
-      argc++;
-    }
+struct rc_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
 
-    int file_delete_index = -1;
+struct startup_mark {
+  const char *what;
+  uint64_t at;
+};
 
-    for (int i = 0; i < argc; i++) {
-      if (strcmp(args[i], ">") == 0) {
-        output_redirect = true;
-        if (input_redirect) {
-          file2 = args[i + 1];
-        }
-        file = args[i + 1];
-        file_delete_index = i;
-      }
-      if (strcmp(args[i], "<") == 0) {
-        input_redirect = true;
-        if (output_redirect) {
-          file2 = args[i + 1];
-        }
-        file = args[i + 1];
-        file_delete_index = i;
+bool startup_profile = false;
+uint64_t startup_begin = 0;
+struct startup_mark startup_marks[STARTUP_MARKS];
+int startup_mark_count = 0;
+const char *rc_source = "none";  // how the rc file was run, for the profile
+
+void startup_mark(const char *what) {
+  if (startup_profile && startup_mark_count < STARTUP_MARKS) {
+    startup_marks[startup_mark_count++] =
+        (struct startup_mark){what, monotonic_ns()};
+  }
+}
+
+void startup_report() {
+  // one line per step, on stderr so it does not mix with the prompt
+  if (!startup_profile) {
+    return;
+  }
+  fprintf(stderr, "%-10s %9s %9s\n", "startup", "step", "total");
+  uint64_t last = startup_begin;
+  for (int i = 0; i < startup_mark_count; i++) {
+    uint64_t at = startup_marks[i].at;
+    fprintf(stderr, "%-10s %9.3f %9.3f\n", startup_marks[i].what,
+            (at - last) / 1e6, (at - startup_begin) / 1e6);
+    last = at;
+  }
+  fprintf(stderr, "(milliseconds, rc %s)\n", rc_source);
+  startup_profile = false;
+}
+
+void rc_put(struct rc_buffer *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->cap) {
+    buf->cap = buf->cap * 2 > buf->len + len ? buf->cap * 2 : buf->len + 4096;
+    buf->data = realloc(buf->data, buf->cap);
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+void rc_put_text(struct rc_buffer *buf, const char *text) {
+  // length first, then the text with its NUL so it can be used in place
+  uint32_t len = strlen(text);
+  rc_put(buf, &len, sizeof(len));
+  rc_put(buf, text, len + 1);
+}
+
+bool rc_get(char **at, char *end, void *out, size_t len) {
+  if ((size_t)(end - *at) < len) {
+    return false;
+  }
+  memcpy(out, *at, len);
+  *at += len;
+  return true;
+}
+
+char *rc_get_text(char **at, char *end) {
+  // the text in place, NULL if the record is cut short
+  uint32_t len;
+  if (!rc_get(at, end, &len, sizeof(len)) || (size_t)(end - *at) <= len ||
+      (*at)[len] != '\0') {
+    return NULL;
+  }
+  char *text = *at;
+  *at += len + 1;
+  return text;
+}
+
+char *rc_cache_tokens(char *at, char *end, struct token_list *tokens) {
+  // reads the tokens of the record whose line was just read, returns where
+  // the next record starts or NULL if the cache is damaged; tokens may be
+  // NULL to only check them
+  uint32_t count;
+  if (!rc_get(&at, end, &count, sizeof(count))) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t kind;
+    uint8_t index = 0;
+    char *token = NULL;
+    if (!rc_get(&at, end, &kind, 1)) {
+      return NULL;
+    } else if (kind == RC_WORD) {
+      token = rc_get_text(&at, end);
+    } else if (kind < RC_REDIRECT) {
+      token = rc_operators[kind];
+    } else if (kind == RC_REDIRECT && rc_get(&at, end, &index, 1) &&
+               index < 10 * REDIRECT_KINDS) {
+      token = redirect_ops[index / REDIRECT_KINDS][index % REDIRECT_KINDS].text;
+    }
+    if (token == NULL) {
+      return NULL;
+    } else if (tokens != NULL) {
+      token_push(tokens, token);
+    }
+  }
+  return at;
+}
+
+bool rc_cache_build(char *text, size_t len, struct stat *st,
+                    struct rc_buffer *buf) {
+  // tokenizes every line of the rc file into buf, false if the file has to
+  // run as a script instead
+  struct rc_cache_header header = {RC_CACHE_MAGIC, RC_CACHE_VERSION, 0,
+                                   st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                                   st->st_size};
+  rc_put(buf, &header, sizeof(header));
+  buffer_next = text;
+  buffer_end = text + len;
+  char *line;
+  while ((line = buffer_line()) != NULL) {
+    char *first = line + strspn(line, " \t");
+    struct token_list tokens = {0};
+    arena_reset(&parse_arena);
+    if (*first == '#' || *first == '\0') {
+      continue;  // comments and blank lines are left out
+    } else if (!tokenize(line, &tokens)) {
+      return false;
+    }
+    rc_put_text(buf, line);
+    uint32_t count = tokens.count;
+    rc_put(buf, &count, sizeof(count));
+    for (int i = 0; i < tokens.count; i++) {
+      char *token = tokens.items[i];
+      struct redirect_op *op = as_redirect(token);
+      uint8_t kind = op != NULL ? RC_REDIRECT : RC_WORD;
+      for (int k = RC_PIPE; k < RC_REDIRECT; k++) {
+        kind = token == rc_operators[k] ? k : kind;
       }
-      if (strcmp(args[i], ">>") == 0) {
-        append = true;
-        file = args[i + 1];
-        file_delete_index = i;
+      rc_put(buf, &kind, 1);
+      if (op != NULL && op->kind == REDIRECT_HEREDOC) {
+        return false;  // the document is in the lines that follow
+      } else if (op != NULL) {
+        uint8_t index = op->fd * REDIRECT_KINDS + op->kind;
+        rc_put(buf, &index, 1);
+      } else if (kind == RC_WORD) {
+        rc_put_text(buf, token);
       }
     }
+    header.lines++;
+  }
+  memcpy(buf->data, &header, sizeof(header));
+  return true;
+}
 
-    args[argc] = NULL;  // to ensure execv and execve understand the args when
-                        // passed in
+void rc_cache_save(const char *path, struct rc_buffer *buf) {
+  // written to a temporary file and renamed, so a shell starting at the
+  // same time never maps half a cache; failing to save is not an error
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  bool written = write(fd, buf->data, buf->len) == (ssize_t)buf->len;
+  close(fd);
+  if (!written || rename(tmp, path) < 0) {
+    unlink(tmp);
+  }
+}
 
-    /* ---- executing the commands ---- */
-    // execute only if command exist and current jobs is 5 or less
-    if (args[0]) {
-      if (strcmp(args[0], "cd") == 0) {
-        builtin = true;
-        // change working directory
-        char *change_dir = args[1];  // directory to change to if command is cd
-        int change;  // int for chrdir to check if error occurred
+// the record the cache runs next, and how many are left
+char *rc_at;
+char *rc_end;
+uint32_t rc_left;
 
-        change = chdir(change_dir);
+char *rc_next_line() {
+  // a compound command goes on in the next record, its line is tokenized
+  // again by the parser and its cached tokens are skipped
+  if (rc_left == 0) {
+    return NULL;
+  }
+  rc_left--;
+  char *line = rc_get_text(&rc_at, rc_end);
+  rc_at = rc_cache_tokens(rc_at, rc_end, NULL);
+  return line;
+}
 
-        if (change != 0) {
-          fprintf(stderr, "Cannot change to directory %s: ", change_dir);
-          perror("");
-        }
-      } else if (strcmp(args[0], "pwd") == 0) {
-        builtin = true;
-        if (output_redirect) {
-          int fd;
-          int original_stdout = dup(1);
-
-          // open file and store into fd
-          if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0) {
-            fprintf(stderr, "Cannot open file %s: ", file);
-            perror("");
-            exit(1);
-          }
+bool rc_cache_run(char *data, size_t len) {
+  // runs the lines of a checked cache, false if one of them was quit
+  struct rc_cache_header header;
+  memcpy(&header, data, sizeof(header));
+  rc_at = data + sizeof(header);
+  rc_end = data + len;
+  rc_left = header.lines;
+  more_input = rc_next_line;
+  bool keep_going = true;
+  while (keep_going && rc_left > 0) {
+    struct token_list tokens = {0};
+    rc_left--;
+    eval_reset(rc_get_text(&rc_at, rc_end));
+    rc_at = rc_cache_tokens(rc_at, rc_end, &tokens);
+    keep_going = eval_tokens(tokens);
+  }
+  more_input = NULL;
+  return keep_going;
+}
 
-          // dup the file descriptor to point STDOUT to the file
-          dup2(fd, STDOUT_FILENO);
-          char working_dir[MAX];  // current working directory
-          printf("%s\n", getcwd(working_dir, MAX));
-          close(fd);
-          dup2(original_stdout, 1);
-          close(original_stdout);
-          output_redirect = false;
-        } else if (append) {
-          int fd;
-          int original_stdout = dup(1);
-
-          // open file and store into fd
-          if ((fd = open(file, O_CREAT | O_APPEND | O_WRONLY, mode)) < 0) {
-            fprintf(stderr, "Cannot open file %s: ", file);
-            perror("");
-            exit(1);
-          }
+char *rc_cache_load(const char *path, struct stat *st, size_t *len) {
+  // maps the cache if it was made from this version of the rc file and is
+  // whole, NULL otherwise
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat cache_st;
+  if (fd < 0 || fstat(fd, &cache_st) < 0 ||
+      cache_st.st_size < (off_t)sizeof(struct rc_cache_header)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  *len = cache_st.st_size;
+  // private and writable, expanding a word may write into it
+  char *map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
 
-          // dup the file descriptor to point STDOUT to the file
-          dup2(fd, STDOUT_FILENO);
-          char working_dir[MAX];  // current working directory
-          printf("%s\n", getcwd(working_dir, MAX));
-          close(fd);
-          dup2(original_stdout, 1);
-          close(original_stdout);
-          append = false;
-        } else {
-          // show working directory
-          char working_dir[MAX];  // current working directory
-          printf("%s\n", getcwd(working_dir, MAX));
-        }
-      } else if (strcmp(args[0], "jobs") == 0) {
-        builtin = true;
-        // show all the processes (jobs)
-        if (output_redirect) {
-          int fd;                        // file descriptor
-          int original_stdout = dup(1);  // stores original stdout
-
-          // open file and store into fd
-          if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0) {
-            fprintf(stderr, "Cannot open file %s: ", file);
-            perror("");
-            exit(1);
-          }
-          // dup the file descriptor to point STDOUT to the file
-          dup2(fd, STDOUT_FILENO);
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            char status[MAX];
-            // only print if not terminated and show is true
-            if ((!processes[i].terminated) && (processes[i].show)) {
-              printf("[%i] (%i) ", processes[i].job_id, processes[i].job_pid);
-              if (processes[i].running) {
-                printf("%s ", "Running ");
-              } else {
-                printf("%s ", "Stopped ");
-              }
-              printf("%s\n", processes[i].command);
-            }
-          }
-          close(fd);
-          dup2(original_stdout, 1);
-          close(original_stdout);
-          output_redirect = false;
-        } else if (append) {
-          int fd;
-          int original_stdout = dup(1);
-
-          // open file and store into fd
-          if ((fd = open(file, O_CREAT | O_APPEND | O_WRONLY, mode)) < 0) {
-            fprintf(stderr, "Cannot open file %s: ", file);
-            perror("");
-            exit(1);
-          }
+  struct rc_cache_header header;
+  memcpy(&header, map, sizeof(header));
+  bool valid =
+      memcmp(header.magic, RC_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+      header.version == RC_CACHE_VERSION &&
+      header.mtime_sec == st->st_mtim.tv_sec &&
+      header.mtime_nsec == st->st_mtim.tv_nsec && header.size == st->st_size;
+  char *at = map + sizeof(header);
+  for (uint32_t i = 0; valid && i < header.lines; i++) {
+    valid = rc_get_text(&at, map + *len) != NULL &&
+            (at = rc_cache_tokens(at, map + *len, NULL)) != NULL;
+  }
+  if (!valid) {
+    munmap(map, *len);
+    return NULL;
+  }
+  return map;
+}
 
-          // dup the file descriptor to point STDOUT to the file
-          dup2(fd, STDOUT_FILENO);
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            char status[MAX];
-            // only print if not terminated and show is true
-            if ((!processes[i].terminated) && (processes[i].show)) {
-              printf("[%i] (%i) ", processes[i].job_id, processes[i].job_pid);
-              if (processes[i].running) {
-                printf("%s ", "Running ");
-              } else {
-                printf("%s ", "Stopped ");
-              }
-              printf("%s\n", processes[i].command);
-            }
-          }
-          close(fd);
-          dup2(original_stdout, 1);
-          close(original_stdout);
-          append = false;
-        } else {
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            char status[MAX];
-            // only print if not terminated and show is true
-            if ((!processes[i].terminated) && (processes[i].show)) {
-              printf("[%i] (%i) ", processes[i].job_id, processes[i].job_pid);
-              if (processes[i].running) {
-                printf("%s ", "Running ");
-              } else {
-                printf("%s ", "Stopped ");
-              }
-              printf("%s\n", processes[i].command);
-            }
-          }
-        }
-      } else if (strcmp(args[0], "kill") == 0) {
-        // kill
-        builtin = true;
-        pid_t change_fg_pid = 0;
-        int status;
-        int jobID = -1;
-        int delete_index = -1;
-        if (args[1][0] == '%') {
-          // job_id
-          jobID = args[1][1] - '0';
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            if (processes[i].job_id == jobID) {
-              change_fg_pid = processes[i].job_pid;
-            }
-          }
-        } else {
-          // check if it's pid or job_id
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            if (processes[i].job_id == atoi(args[1])) {
-              printf("%% should be placed before a Job ID.\n");
-              break;  // exit with error
-            }
-            if (processes[i].job_pid == atoi(args[1])) {
-              change_fg_pid = atoi(args[1]);
-            }
-          }
-          // if we exit for loop and never found PID/ JID
-          if (change_fg_pid == 0) {
-            printf(
-                "Process ID or Job ID should be an existing process or has "
-                "been formatted wrong.\n");
-            continue;
-          }
-        }
-        // kill and reap
-        kill(change_fg_pid, SIGKILL);
-        waitpid(change_fg_pid, &status, 0);
-        // remove from jobs array
-        for (int i = 0; i < MAX_PROCESS; i++) {
-          if (processes[i].job_pid == change_fg_pid) {
-            delete_index = i;
-            processes[i].terminated = true;
-            if (max_jobs > 0) {
-              max_jobs--;
-            }
-            processes[i].show = false;  // make show false if it is background
-          }
-        }
+bool run_rc() {
+  // runs the rc file, from its cache when that is current; false if the rc
+  // file quit the shell
+  char *path = getenv("CSHELL_RC");
+  char default_path[PATH_MAX];
+  if (path == NULL) {
+    char *home = getenv("HOME");
+    if (home == NULL) {
+      return true;
+    }
+    snprintf(default_path, sizeof(default_path), "%s/.cshellrc", home);
+    path = default_path;
+  }
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    return true;  // no rc file is fine
+  }
+  char cache_path[PATH_MAX + 8];  // room for .cache
+  snprintf(cache_path, sizeof(cache_path), "%s.cache", path);
 
-        if (delete_index != -1) {
-          // removes the struct and shifts the rest
-          for (int i = delete_index; i < MAX_PROCESS - 1; i++) {
-            processes[i] = processes[i + 1];
-          }
-        }
+  size_t len;
+  char *map = rc_cache_load(cache_path, &st, &len);
+  if (map != NULL) {
+    rc_source = "cached";
+    bool keep_going = rc_cache_run(map, len);
+    munmap(map, len);
+    return keep_going;
+  }
 
-      } else if (strcmp(args[0], "fg") == 0) {
-        builtin = true;
-        pid_t change_fg_pid = 0;
-        if (args[1][0] == '%') {
-          // job_id
-          change_fg_pid = args[1][1] - '0';
-        } else {
-          // check if it's pid or job_id
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            if (processes[i].job_id == atoi(args[1])) {
-              printf("%% should be placed before a Job ID.\n");
-              break;  // exit with error
-            }
-            if (processes[i].job_pid == atoi(args[1])) {
-              change_fg_pid = atoi(args[1]);
-            }
-          }
-          // if we exit for loop and never found PID/ JID
-          if (change_fg_pid == 0) {
-            printf(
-                "Process ID or Job ID should be an existing process or has "
-                "been formatted wrong.\n");
-            continue;
-          }
-        }
+  // tokenize the file once, save the tokens and run them
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  char *text = fd >= 0 ? malloc(st.st_size + 1) : NULL;
+  bool read_all =
+      text != NULL && read(fd, text, st.st_size) == (ssize_t)st.st_size;
+  if (fd >= 0) {
+    close(fd);
+  }
+  struct rc_buffer buf = {0};
+  bool keep_going = true;
+  if (read_all && rc_cache_build(text, st.st_size, &st, &buf)) {
+    rc_source = "parsed";
+    rc_cache_save(cache_path, &buf);
+    keep_going = rc_cache_run(buf.data, buf.len);
+  } else {
+    rc_source = "run as a script";
+    run_script(path);
+  }
+  free(buf.data);
+  free(text);
+  return keep_going;
+}
 
-        // changing to fg
-        for (int i = 0; i < MAX_PROCESS; i++) {
-          if (processes[i].job_pid == change_fg_pid ||
-              processes[i].job_id == change_fg_pid) {
-            foreground_pid = processes[i].job_pid;
-            // Changing a background job to the foreground
-            if (!processes[i].foreground) {
-              processes[i].foreground = true;
-              foreground_pid = processes[i].job_pid;  // Store foreground PID
-              foreground = true;
-              // Send a SIGCONT signal to resume the job if it's stopped
-            }
-            if (!processes[i].running) {
-              processes[i].running = true;
-              foreground = true;
-              kill(processes[i].job_pid, SIGCONT);  // Resume process
-            }
-          }
-        }
-      } else if (strcmp(args[0], "bg") == 0) {
-        builtin = true;
-        pid_t change_fg_pid = 0;
-        if (args[1][0] == '%') {
-          // job_id
-          change_fg_pid = args[1][1] - '0';
-        } else {
-          // check if it's pid or job_id
-          for (int i = 0; i < MAX_PROCESS; i++) {
-            if (processes[i].job_id == atoi(args[1])) {
-              printf("%% should be placed before a Job ID.\n");
-              break;  // exit with error
-            }
-            if (processes[i].job_pid == atoi(args[1])) {
-              change_fg_pid = atoi(args[1]);
-            }
-          }
-          // if we exit for loop and never found PID/ JID
-          if (change_fg_pid == 0) {
-            printf(
-                "Process ID or Job ID should be an existing process or has "
-                "been formatted wrong.\n");
-            continue;
-          }
-        }
+char *prompt_more() {
+  // a line of a here-document typed at the prompt
+  prompt = "> ";
+  need_prompt = true;
+  char *line = editor_enabled ? edit_line() : read_line();
+  prompt = PROMPT;
+  if (line != NULL) {
+    record_event("more", "%s", line);
+  }
+  return line;
+}
 
-        // changing to bg
-        for (int i = 0; i < MAX_PROCESS; i++) {
-          if (processes[i].job_pid == change_fg_pid ||
-              processes[i].job_id == change_fg_pid) {
-            setpgid(processes[i].job_pid, 0);
-
-            // Changing a foreground job to the background
-            if ((processes[i].foreground) && (!processes[i].running)) {
-              processes[i].foreground = false;
-              processes[i].running = true;
-              foreground_pid = processes[i].job_pid;  // Store foreground PID
-              foreground = false;
-              kill(processes[i].job_pid, SIGCONT);  // Resume process
-              // Send a SIGCONT signal to resume the job if it's stopped
-            }
-          }
-        }
+void run_interactive() {
+  // continous loop of input until user quits
+  history_open();
+  // the line editor needs a terminal on both ends that understands escapes
+  const char *term = getenv("TERM");
+  editor_enabled = interactive && isatty(STDOUT_FILENO) &&
+                   (term == NULL || strcmp(term, "dumb") != 0) &&
+                   tcgetattr(STDIN_FILENO, &cooked_mode) == 0;
+  more_input = prompt_more;
+  startup_mark("editor");
+  startup_report();
+  while (1) {
+    /* --- prompting user and parsing input */
+    need_prompt = true;
+    char *user_str = editor_enabled ? edit_line() : read_line();
+    if (user_str != NULL) {
+      record_event("line", "%s", user_str);  // as typed, before any ! event
+    }
+    if (user_str == NULL) {
+      // stdin was closed, same as quit
+      user_str = "quit";
+    } else if ((user_str = history_expand(user_str)) == NULL) {
+      continue;  // the ! event was not found
+    } else {
+      history_add(user_str);
+    }
+    if (!eval(user_str)) {
+      break;
+    }
+  }
+}
 
-      } else if (strcmp(args[0], "quit") == 0) {
-        builtin = true;
-        // terminate all processes and shell processes then break
-        for (int i = 0; i < MAX_PROCESS; i++) {
-          kill(processes[i].job_pid, SIGKILL);
-        }
-        break;
-      } else if ((args[1] != NULL) && (strcmp(args[argc - 1], "&") == 0) &&
-                 (max_jobs < 5)) {
-        // BACKGROUND JOB
-        pid_t pid = fork();
-        if (pid < 0) {
-          fprintf(stderr, "Fork failed.");
-          // exit failure
-          exit(1);
-        } else if (pid == 0) {
-          setpgid(pid, 0);  // second argument sets my pid to be the pgid
-
-          // if the file is not found exit child process
-          if (execvp(args[0], args) < 0) {
-            if (execv(args[0], args) < 0) {
-              printf("%s file could not be executed.\n", args[0]);
-              exit(1);  // exit with error status
-            }
-          }
-          // }
-
-        } else {
-          // parent process
-          builtin = false;
-          foreground = false;
-          max_jobs++;
-          struct job_control job;  // initialize a new job
-
-          // set the attributes
-          job.job_id = job_counter;
-          job.job_pid = pid;
-          job.running = true;
-          job.foreground = false;
-          job.terminated = false;
-          job.show = true;
-          strncpy(job.command, original, MAX);
-
-          job_counter++;  // increment the ID
-          // add job to the array
-          processes[job_index] = job;
-          job_index++;  // increment index
-
-          // add the process to processes array
-          child_processes[child_process_num] = pid;
-          child_process_num++;
-        }
-      } else if (max_jobs < 5) {
-        // FOREGROUND JOB (local executables)
-        pid_t pid = fork();
-        if (pid < 0) {
-          fprintf(stderr, "Fork failed.");
-          // exit failure
-          exit(1);
-        } else if (pid == 0) {  // child process
-          if (output_redirect) {
-            int fd;
-            int original_stdout = dup(1);
-
-            fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, mode);
-            if (fd < 0) {
-              fprintf(stderr, "Cannot open file %s: ", file);
-              perror("");
-              exit(1);
-            }
-
-            // dup the file descriptor to point STDOUT to the file
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-
-            if (file_delete_index != -1) {
-              for (int i = file_delete_index; i < argc - 1; i++) {
-                args[i] = args[i + 1];
-              }
-            }
-
-            // exec
-            if (execvp(args[0], args) < 0) {
-              if (execv(args[0], args) < 0) {
-                printf("%s file could not be executed.\n", args[0]);
-                exit(1);  // exit with error status
-              }
-            }
-
-            dup2(original_stdout, 1);
-            close(original_stdout);
-            output_redirect = false;
-          } else if (append) {
-            int fd;
-            int original_stdout = dup(1);
-
-            // open file and store into fd
-            if ((fd = open(file, O_CREAT | O_APPEND | O_WRONLY, mode)) < 0) {
-              fprintf(stderr, "Cannot open file %s: ", file);
-              perror("");
-              exit(1);
-            }
-
-            // dup the file descriptor to point STDOUT to the file
-            dup2(fd, STDOUT_FILENO);
-
-            if (file_delete_index != -1) {
-              for (int i = file_delete_index; i < argc - 1; i++) {
-                args[i] = args[i + 1];
-              }
-            }
-
-            // exec
-            if (execvp(args[0], args) < 0) {
-              if (execv(args[0], args) < 0) {
-                printf("%s file could not be executed.\n", args[0]);
-                exit(1);  // exit with error status
-              }
-            }
-
-            close(fd);
-            dup2(original_stdout, 1);
-            close(original_stdout);
-            append = false;
-          } else if (input_redirect) {
-            int fd;
-            int original_stdin = dup(0);
-            int nbytes;
-
-            // open file and store in fd
-            if ((fd = open(file, O_RDONLY, mode)) < 0) {
-              fprintf(stderr, "Cannot open file %s: ", file);
-              perror("");
-              exit(1);
-            }
-
-            // dup the file descriptor to point STDIN to the file
-            dup2(fd, STDIN_FILENO);
-
-            if (file_delete_index != -1) {
-              for (int i = file_delete_index; i < argc; i++) {
-                args[i] = args[i + 1];
-              }
-            }
-
-            // exec
-            if (execvp(args[0], args) < 0) {
-              if (execv(args[0], args) < 0) {
-                printf("%s file could not be executed.\n", args[0]);
-                exit(1);  // exit with error status
-              }
-            }
-            close(fd);
-            dup2(original_stdin, 0);
-            close(original_stdin);
-
-            input_redirect = false;
-          } else {
-            signal(SIGTSTP, SIG_DFL);  // reset to default signal handler
-
-            // if the file is not found exit child process
-            if (execvp(args[0], args) < 0) {
-              if (execv(args[0], args) < 0) {
-                printf("%s file could not be executed.\n", args[0]);
-                exit(1);  // exit with error status
-              }
-            }
-          }
-        } else {  // parent process
-          foreground = true;
-          builtin = false;
-          foreground_pid = pid;  // store foreground pid
-        }
-      } else if (max_jobs >= 5) {
-        printf(
-            "Maximum number of jobs that can be running concurrently is "
-            "5.\n");
-      }
+int main(int argc, char **argv) {
+  // --stats-file PATH [--stats-interval SECONDS] export the latency stats
+  // --listen PATH serves clients, --connect PATH is one
+  // --startup-profile times the steps up to the first prompt
+  // --record PATH logs the session for bench/replay
+  startup_begin = monotonic_ns();
+  const char *listen_on = NULL;
+  const char *connect_to = NULL;
+  const char *record_to = NULL;
+  while (argc > 1 && strcmp(argv[1], "--startup-profile") == 0) {
+    startup_profile = true;
+    argc--;
+    argv++;
+  }
+  while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--stats-file") == 0) {
+      stats_file = argv[2];
+    } else if (strcmp(argv[1], "--stats-interval") == 0 && atoi(argv[2]) > 0) {
+      stats_interval = atoi(argv[2]);
+    } else if (strcmp(argv[1], "--listen") == 0) {
+      listen_on = argv[2];
+    } else if (strcmp(argv[1], "--connect") == 0) {
+      connect_to = argv[2];
+    } else if (strcmp(argv[1], "--record") == 0) {
+      record_to = argv[2];
+    } else {
+      printf("Unknown option %s.\n", argv[1]);
+      return 1;
     }
+    argc -= 2;
+    argv += 2;
   }
-  return 0;
+  if (connect_to != NULL) {
+    // a client keeps the default signals, CTRL + C just ends it
+    bool one_line = argc > 2 && strcmp(argv[1], "-c") == 0;
+    return run_client(connect_to, one_line ? argv[2] : NULL);
+  }
+
+  if (record_to != NULL && !record_open(record_to)) {
+    return 1;
+  }
+
+  builtins_init();
+  variables_init();
+  startup_mark("variables");
+
+  /* ----  signal handlers ---- */
+  // SIGINT, SIGTSTP and SIGCHLD arrive through the event loop
+  event_init();
+  if (stats_file != NULL) {
+    start_stats_export();
+  }
+  startup_mark("events");
+
+  // the rc file sets up shells that stay around, not scripts or -c
+  bool script = argc > 1;
+  if (!script) {
+    show_prompt = false;
+    bool keep_going = run_rc();
+    show_prompt = true;
+    startup_mark("rc");
+    if (!keep_going) {
+      return 0;
+    }
+  }
+  if (listen_on != NULL || script) {
+    startup_report();
+  }
+
+  int status = 0;
+  if (listen_on != NULL) {
+    // shell --listen PATH, lines come from clients
+    show_prompt = false;
+    status = run_server(listen_on);
+  } else if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    // shell -c "command", no prompt
+    show_prompt = false;
+    run_buffer(argv[2], strlen(argv[2]));
+    status = last_status;
+  } else if (argc > 1) {
+    // shell script.sh, no prompt
+    show_prompt = false;
+    status = run_script(argv[1]);
+  } else {
+    run_interactive();
+  }
+
+  if (stats_file != NULL) {
+    export_stats();  // the last numbers, the timer may not have fired yet
+  }
+  return status;
 }
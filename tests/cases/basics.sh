@@ -0,0 +1,40 @@
+# external commands, quoting, pipelines and the early builtins
+
+check "external command" 0 "hi" "/bin/echo hi"
+check "quoting and escapes" 0 "a  b c d e f" "/bin/echo 'a  b' \"c d\" e\\ f"
+check "pipeline" 0 "HELLO" "/bin/echo hello | tr a-z A-Z"
+check "three stage pipeline" 0 "a
+b
+c" "/bin/echo b a c | tr ' ' '\n' | sort"
+check "pipeline relays to a stage with no command" 0 "3" \
+  "/bin/echo one two three | tr ' ' '\n' | wc -l"
+check "unknown command" 1 "nosuchcmd file could not be executed." \
+  "nosuchcmd"
+
+check_script "script with comments" 0 "x
+y" "#!/path/to/shell
+# a comment
+/bin/echo x
+
+/bin/echo y"
+check_script "cd and pwd" 0 "/" "cd /
+pwd"
+check_script "cd to a missing directory" 1 \
+  "Cannot change to directory /nonexistent: No such file or directory" \
+  "cd /nonexistent"
+check_script "last line without a newline" 0 "end" "$(printf '/bin/echo end')"
+
+check "hash remembers a command" 0 "" "hash cat"
+check "hash of a missing command" 1 "hash: nosuchcmd: not found" \
+  "hash nosuchcmd"
+check "launch picks an engine" 0 "" "launch spawn"
+check_script "launch shows the engine" 0 "fork" "launch fork
+launch"
+
+printf 'one\ntwo\nthree\n' > "$scratch/work/items"
+check "parallel runs every item" 0 "got one
+got two
+got three" "parallel -j 1 -a items /bin/echo got"
+check "parallel with {}" 0 "[one]
+[two]
+[three]" "parallel -j 1 -a items /bin/echo [{}]"
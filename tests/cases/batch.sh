@@ -0,0 +1,14 @@
+# shell -c and scripts exit with the status of their last command
+
+check "-c exits with a failing command's status" 1 "" "/bin/false"
+check "-c exits with the command's own status" 4 "" "/bin/sh -c 'exit 4'"
+check "-c exits with 0 after a success" 0 "" "/bin/true"
+check "a background job does not set the status" 0 "" "/bin/sh -c 'exit 3' &"
+check "-c runs every line" 3 "a" "/bin/echo a
+/bin/sh -c 'exit 3'"
+
+check_script "script ends with a failure" 1 "a" "/bin/echo a
+/bin/false"
+check_script "script ends with a success" 0 "" "/bin/false
+/bin/true"
+check_script "killed command" 137 "" "/bin/sh -c 'kill -9 \$\$'"
@@ -0,0 +1,26 @@
+# echo, printf, test/[ and true/false run inside the shell
+
+check "echo" 0 "a b" "echo a   b"
+check "echo -n" 0 "ab" "echo -n a; echo b"
+check "echo -e" 0 "a	b" "echo -e 'a\tb'"
+check "echo --" 0 "-- a" "echo -- a"
+check "printf" 0 "x-1" "printf '%s-%d\n' x 1"
+check "printf reuses the format" 0 "a-1
+b-2" "printf '%s-%d\n' a 1 b 2"
+check "printf width" 0 "    x|" "printf '%5s|\n' x"
+check "printf hex and octal" 0 "ff 10" "printf '%x %o\n' 255 8"
+check "printf percent" 0 "%" "printf '%%\n'"
+check "test true" 0 "" "test 1 -lt 2"
+check "test false" 1 "" "test -n ''"
+check "test negation" 0 "" "test ! -f /nonexistent"
+check "bracket" 0 "" "[ -d / ]"
+check "bracket false" 1 "" "[ a = b ]"
+check "bracket missing ]" 2 "[: missing ]" "[ a = a"
+check "test bad argument" 2 "test: -lt: unexpected argument" "[ 1 -lt ]"
+check "true" 0 "" "true"
+check "false" 1 "" "false"
+check "echo redirected" 0 "hi" "echo hi > f; /bin/cat f"
+check "echo appended" 0 "1
+2" "echo 1 > f; echo 2 >> f; /bin/cat f"
+check "echo in a pipeline" 0 "ABC" "echo abc | tr a-z A-Z"
+check "test in a condition" 0 "yes" "if [ -d / ]; then echo yes; fi"
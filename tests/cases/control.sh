@@ -0,0 +1,90 @@
+# ;, &&, ||, if, while, until, for, functions and $?
+
+check "semicolon" 0 "a
+b" "/bin/echo a; /bin/echo b"
+check "and" 1 "" "/bin/false && /bin/echo no"
+check "or" 0 "yes" "/bin/false || /bin/echo yes"
+check "and then or" 0 "b" "/bin/false && /bin/echo a || /bin/echo b"
+check "status" 0 "1 0" "/bin/false; x=\$?; /bin/true; /bin/echo \$x \$?"
+check "if" 0 "yes" "if /bin/true; then /bin/echo yes; else /bin/echo no; fi"
+check "else" 0 "no" "if /bin/false; then /bin/echo yes; else /bin/echo no; fi"
+check "elif" 0 "two" "if /bin/false; then /bin/echo one
+elif /bin/true; then /bin/echo two
+fi"
+check "for" 0 "a
+b
+c" "for i in a b c; do /bin/echo \$i; done"
+check "for over a glob" 1 "" "for f in *.none; do /bin/false; done"
+check_script "while" 0 "x
+xx
+xxx" "i=
+while /bin/sh -c \"[ \\\"\$i\\\" != xxx ]\"; do
+  i=\${i}x
+  /bin/echo \$i
+done"
+check_script "until" 0 "1" "i=
+until /bin/sh -c \"[ -n '\$i' ]\"; do i=1; done
+/bin/echo \$i"
+check_script "function" 0 "hello world
+2" "greet() {
+  /bin/echo hello \$1
+  /bin/echo \$#
+}
+greet world again"
+check_script "function status" 3 "" "fail() { /bin/sh -c 'exit 3'; }
+fail"
+check_script "nested loops" 0 "a1 a2 b1 b2" "out=
+for x in a b; do for y in 1 2; do out=\"\$out \$x\$y\"; done; done
+/bin/echo \$out"
+check "syntax error" 2 "Syntax error near fi." "if /bin/true; fi"
+check "unexpected end" 2 "Unexpected end of input." "if /bin/true; then"
+check "unterminated quote" 2 "Unterminated quote or \$(." "/bin/echo \"abc"
+check_script "here-document in a loop" 0 "in
+in" "for i in 1 2; do
+cat <<EOF
+in
+EOF
+done"
+
+# return, break and continue
+check "return N" 3 "" "f() { return 3; }; f"
+check "return ends the function" 0 "a
+0" "f() { echo a; return; echo b; }; false; f; echo \$?"
+check "return keeps the last status" 1 "" "f() { false; return; }; f"
+check "return from inside a loop" 7 "1" \
+  "f() { for i in 1 2 3; do if [ \$i = 2 ]; then return 7; fi; echo \$i; done; echo no; }; f"
+check "return from a while condition" 4 "" \
+  "f() { while return 4; do echo no; done; echo no; }; f"
+check "return skips the rest of an && list" 2 "x" \
+  "f() { /bin/echo x && return 2 || echo no; echo no; }; f"
+check "return N wraps at 256" 44 "" "f() { return 300; }; f"
+check "return outside a function" 1 "return: not in a function" "return"
+check "return with a word" 2 "return: x: numeric argument required" \
+  "f() { return x; }; f"
+check "break" 0 "1
+0" "for i in 1 2 3; do if [ \$i = 2 ]; then break; fi; echo \$i; done; echo \$?"
+check "break out of while" 0 "xxx" \
+  "i=; while true; do i=x\$i; if [ \$i = xxx ]; then break; fi; done; echo \$i"
+check "break out of until" 0 "" "until false; do break; done"
+check "continue" 0 "1
+3" "for i in 1 2 3; do if [ \$i = 2 ]; then continue; fi; echo \$i; done"
+check "continue 2" 0 "a1
+b1" "for i in a b; do for j in 1 2; do if [ \$j = 2 ]; then continue 2; fi; echo \$i\$j; done; echo no; done"
+check "break 2" 0 "out" \
+  "for i in a b; do for j in 1 2; do break 2; done; echo no; done; echo out"
+check "break N past the outermost loop" 0 "out" \
+  "for i in a; do for j in 1; do break 5; done; echo no; done; echo out"
+check "break outside a loop" 1 "break: not in a loop" "break"
+check "break in a function does not reach the caller's loop" 0 \
+  "break: not in a loop
+1
+break: not in a loop
+2" "f() { break; }; for i in 1 2; do f; echo \$i; done"
+check "break 0" 1 "break: 0: loop count out of range" \
+  "for i in 1; do break 0; done"
+check_script "return in a script function" 5 "in f" "f() {
+  echo in f
+  return 5
+  echo no
+}
+f"
@@ -0,0 +1,23 @@
+# *, ?, [...] and ** patterns
+
+mkdir -p "$scratch/work/src/lib/deep" "$scratch/work/.hidden"
+touch "$scratch/work/a.c" "$scratch/work/b.c" "$scratch/work/c.h" \
+  "$scratch/work/.dot.c" "$scratch/work/src/x.c" "$scratch/work/src/lib/y.c" \
+  "$scratch/work/src/lib/deep/z.c" "$scratch/work/.hidden/h.c"
+
+check "star" 0 "a.c b.c" "/bin/echo *.c"
+check "question mark" 0 "a.c b.c c.h" "/bin/echo ?.?"
+check "bracket" 0 "a.c c.h" "/bin/echo [ac].*"
+check "negated bracket" 0 "b.c" "/bin/echo [!ac].*"
+check "range" 0 "a.c b.c" "/bin/echo [a-b].c"
+check "dot files need a dot" 0 ".dot.c" "/bin/echo .*.c"
+check "pattern in a directory" 0 "src/lib/y.c" "/bin/echo src/*/y.c"
+check "trailing slash keeps directories" 0 "src/" "/bin/echo s*/"
+check "double star" 0 "a.c b.c src/lib/deep/z.c src/lib/y.c src/x.c" \
+  "/bin/echo **/*.c"
+check "no match stays as typed" 0 "*.none" "/bin/echo *.none"
+check "quoted pattern is not expanded" 0 "*.c" "/bin/echo '*.c'"
+check "escaped star is not expanded" 0 "*.c" "/bin/echo \\*.c"
+check "half quoted pattern" 0 "a.c" "/bin/echo a'.'*"
+check "pattern with a variable" 0 "a.c b.c" "x=c
+/bin/echo *.\$x"
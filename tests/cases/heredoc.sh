@@ -0,0 +1,26 @@
+# here-documents and here-strings
+
+check "here-document" 0 "one
+two" "cat <<EOF
+one
+two
+EOF"
+check "here-document with a quoted delimiter" 0 "a b" "cat <<'END'
+a b
+END"
+check "here-document into a pipeline" 0 "ONE" "cat <<EOF | tr a-z A-Z
+one
+EOF"
+check "here-string" 0 "word" "cat <<< word"
+check "here-string with spaces" 0 "3" "wc -w <<< 'a b c'"
+check "here-document bigger than a pipe" 0 "20000" "cat <<EOF | wc -l
+$(seq 20000)
+EOF"
+check "here-document for a builtin" 0 "hash: hash table empty" "hash <<EOF
+ignored
+EOF"
+check_script "commands after a here-document" 0 "in
+after" "cat <<EOF
+in
+EOF
+/bin/echo after"
@@ -0,0 +1,52 @@
+# the history log in $CSHELL_HISTORY, ! events and history -s
+
+rm -f "$CSHELL_HISTORY"
+check_session "history lists the lines" 0 "one
+two
+    1  /bin/echo one
+    2  /bin/echo two
+    3  history" "/bin/echo one
+/bin/echo two
+history"
+check_session "carried over to the next run" 0 "    1  /bin/echo one
+    2  /bin/echo two
+    3  history
+    4  history 4" "history 4"
+check_session "history N" 0 "    4  history 4
+    5  history 2" "history 2"
+check_session "!N" 0 "/bin/echo two
+two" "!2"
+check_session "!prefix takes the newest match" 0 "/bin/echo two
+two" "!/bin/echo"
+check_session "!prefix keeps the words after it" 0 "/bin/echo two x
+two x" "!/bin/echo x"
+check_session "!!" 0 "hi
+/bin/echo hi
+hi" "/bin/echo hi
+!!"
+check_session "!-N" 0 "a
+b
+/bin/echo a
+a" "/bin/echo a
+/bin/echo b
+!-2"
+check_session "missing event" 0 "!99999: event not found
+!nosuch: event not found" "!99999
+!nosuch"
+check_session "history -s" 0 "   12  history -s two
+    7  /bin/echo two x
+    6  /bin/echo two
+    2  /bin/echo two" "history -s two"
+check_session "history -s needs text" 0 "history: -s needs the text to search for" \
+  "history -s"
+rm -f "$CSHELL_HISTORY"
+check_session "repeats and blank lines are left out" 0 "x
+x
+    1  /bin/echo x
+    2  history" "/bin/echo x
+
+/bin/echo x
+history"
+check_session "lines another session appended" 0 "    4  /bin/echo other
+    5  history 2" "/bin/sh -c \"echo '/bin/echo other' | '$shell_under_test' > /dev/null\"
+history 2"
@@ -0,0 +1,59 @@
+# run: options, placing new jobs, pipelines and running jobs, and cgroup
+# limits written into a stand-in group under CSHELL_CGROUP_ROOT
+
+usage="run: usage: run [--cpus LIST] [--nice N] [--cgroup NAME [--cpu-max LIMIT] [--mem-max LIMIT]] command | %id"
+nice_of_self="/bin/sh -c 'cut -d\" \" -f19 /proc/\$\$/stat'"
+
+check "run --cpus" 0 "Cpus_allowed_list:	0" \
+  "run --cpus 0 /bin/grep Cpus_allowed_list /proc/self/status"
+check "run --nice" 0 "7" "run --nice 7 $nice_of_self"
+check "run --cpus and --nice" 0 "Cpus_allowed_list:	0
+5" "run --cpus 0 --nice 5 /bin/sh -c 'grep Cpus_allowed_list /proc/self/status; cut -d\" \" -f19 /proc/\$\$/stat'"
+check "run places every stage of a pipeline" 0 "3
+3" "run --nice 3 $nice_of_self | /bin/sh -c 'cat; cut -d\" \" -f19 /proc/\$\$/stat'"
+check "run keeps the command's status" 3 "" "run --nice 1 /bin/sh -c 'exit 3'"
+check "run with a missing command" 1 "nosuchcmd file could not be executed." \
+  "run --nice 1 nosuchcmd"
+check "run moves a running job" 0 "    cpus -  nice 6  cgroup -" \
+  "/bin/sleep 5 & run --nice 6 %1; jobs -l | /bin/grep cpus; kill %1"
+check "run on a missing job" 1 "Job ID %9 does not exist." "run --nice 6 %9"
+
+check "run alone" 1 "$usage" "run"
+check "run without a command" 1 "$usage" "run --cpus 0"
+check "run option without a value" 1 "$usage" "run --nice"
+check "run with an unknown option" 1 "$usage" "run --bogus 1 /bin/true"
+check "run with a bad CPU list" 1 "run: x is not a CPU list such as 2-5,7." \
+  "run --cpus x /bin/true"
+check "run with a backwards CPU range" 1 \
+  "run: 3-1 is not a CPU list such as 2-5,7." "run --cpus 3-1 /bin/true"
+check "limits need a group" 1 "run: --cpu-max and --mem-max need --cgroup." \
+  "run --mem-max 1G /bin/true"
+
+# a cgroup v2 tree is not writable here, plain files stand in for it
+export CSHELL_CGROUP_ROOT="$scratch/work/cgroup"
+mkdir "$CSHELL_CGROUP_ROOT"
+for group in a b c d; do
+  mkdir "$CSHELL_CGROUP_ROOT/$group"
+  touch "$CSHELL_CGROUP_ROOT/$group/cgroup.procs" \
+    "$CSHELL_CGROUP_ROOT/$group/cpu.max" "$CSHELL_CGROUP_ROOT/$group/memory.max"
+done
+check "run --cgroup with limits" 0 "150000 100000
+67108864
+0" "run --cgroup a --cpu-max 150% --mem-max 64M /bin/true
+/bin/cat cgroup/a/cpu.max; /bin/echo; /bin/cat cgroup/a/memory.max; /bin/echo
+/bin/cat cgroup/a/cgroup.procs"
+check "--cpu-max quota/period" 0 "2000 10000" \
+  "run --cgroup b --cpu-max 2000/10000 /bin/true; /bin/cat cgroup/b/cpu.max"
+check "--cpu-max max and --mem-max max" 0 "max 100000
+max" "run --cgroup c --cpu-max max --mem-max max /bin/true
+/bin/cat cgroup/c/cpu.max; /bin/echo; /bin/cat cgroup/c/memory.max"
+check "--mem-max units" 0 "2048" \
+  "run --cgroup d --mem-max 2k /bin/true; /bin/cat cgroup/d/memory.max"
+check "bad --cpu-max" 1 "run: --cpu-max should be max, N% or quota[/period]." \
+  "run --cgroup a --cpu-max 0 /bin/true"
+check "bad --mem-max" 1 "run: --mem-max should be max or bytes with K, M or G." \
+  "run --cgroup a --mem-max 5X /bin/true"
+check "group that cannot be created" 1 \
+  "Cannot create cgroup $CSHELL_CGROUP_ROOT/no/sub: No such file or directory" \
+  "run --cgroup no/sub /bin/true"
+unset CSHELL_CGROUP_ROOT
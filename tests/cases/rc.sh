@@ -0,0 +1,51 @@
+# the rc file and its token cache: parsed on the first start, cached on
+# the next, and parsed again once the rc file's mtime or size changes
+
+export CSHELL_RC="$scratch/work/rc"
+
+rc_source() {
+  # how the rc file was run, from the --startup-profile summary
+  printf 'true\n' | "$shell_under_test" --startup-profile 2>&1 > /dev/null |
+    sed -n 's/^(milliseconds, rc \(.*\))$/\1/p'
+}
+
+check_session "no rc file" 0 "" "true"
+report "no rc file in the profile" 0 "none" 0 "$(rc_source)"
+
+printf '%s\n' "greet() { echo hello; }" "NAME=first" > "$CSHELL_RC"
+report "first start parses the rc file" 0 "parsed" 0 "$(rc_source)"
+report "the cache is saved next to it" 0 "yes" 0 \
+  "$([ -s "$CSHELL_RC.cache" ] && echo yes)"
+report "next start runs the cache" 0 "cached" 0 "$(rc_source)"
+check_session "definitions from the cache" 0 "hello
+first" 'greet; echo $NAME'
+
+printf '%s\n' "greet() { echo hello again; }" "NAME=second" > "$CSHELL_RC"
+report "a new size parses it again" 0 "parsed" 0 "$(rc_source)"
+check_session "the new definitions are used" 0 "hello again
+second" \
+  'greet; echo $NAME'
+
+printf '%s\n' "greet() { echo howdy again; }" "NAME=thirds" > "$CSHELL_RC"
+touch -d '2001-01-01 00:00:00' "$CSHELL_RC"
+report "same size, new mtime parses it again" 0 "parsed" 0 "$(rc_source)"
+check_session "the edited definitions are used" 0 "howdy again
+thirds" \
+  'greet; echo $NAME'
+report "and are cached in turn" 0 "cached" 0 "$(rc_source)"
+
+printf 'cat <<END\nfrom a document\nEND\n' > "$CSHELL_RC"
+report "here-documents run as a script" 0 "run as a script" 0 "$(rc_source)"
+check_session "the script's output" 0 "from a document" "true"
+
+printf '%s\n' "echo broken > /nonexistent/f" "echo still runs" > "$CSHELL_RC"
+check_session "a failing line does not stop the rc file" 0 \
+  "Cannot open file /nonexistent/f: No such file or directory
+still runs" "true"
+
+printf '%s\n' "garbage" > "$CSHELL_RC.cache"
+touch "$CSHELL_RC"
+report "a damaged cache is rebuilt" 0 "parsed" 0 "$(rc_source)"
+report "and used after that" 0 "cached" 0 "$(rc_source)"
+
+export CSHELL_RC=
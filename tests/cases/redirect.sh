@@ -0,0 +1,48 @@
+# redirections of external commands under both launch engines, and of
+# builtins through their writers
+
+for engine in fork spawn; do
+  rm -f "$scratch/work"/*
+  check "2> ($engine)" 0 "e" \
+    "launch $engine; /bin/sh -c 'echo o; echo e >&2' 2> err > /dev/null; /bin/cat err"
+  check "2>> ($engine)" 0 "e1
+e2" "launch $engine; /bin/sh -c 'echo e1 >&2' 2>> log; /bin/sh -c 'echo e2 >&2' 2>> log; /bin/cat log"
+  check "> f 2>&1 ($engine)" 0 "o
+e" "launch $engine; /bin/sh -c 'echo o; echo e >&2' > f 2>&1; /bin/cat f"
+  check "2>&1 > f ($engine)" 0 "e
+o" "launch $engine; /bin/sh -c 'echo o; echo e >&2' 2>&1 > f; /bin/cat f"
+  check "< in > out ($engine)" 0 "ABC" \
+    "launch $engine; /bin/echo abc > in; /bin/tr a-z A-Z < in > out; /bin/cat out"
+  check ">> appends ($engine)" 0 "1
+2" "launch $engine; /bin/echo 1 > f; /bin/echo 2 >> f; /bin/cat f"
+  check "> truncates ($engine)" 0 "2" \
+    "launch $engine; /bin/echo 1111 > f; /bin/echo 2 > f; /bin/cat f"
+  check "2>&- ($engine)" 0 "closed" \
+    "launch $engine; /bin/sh -c 'echo x >&2 || echo closed' 2>&-"
+  check "fd 3 ($engine)" 0 "three" \
+    "launch $engine; /bin/sh -c 'echo three >&3' 3> f; /bin/cat f"
+  check "redirected pipeline stages ($engine)" 0 "B" \
+    "launch $engine; /bin/echo b > in; /bin/cat < in | tr a-z A-Z > out; /bin/cat out"
+  check "missing input file ($engine)" 1 \
+    "Cannot open file missing: No such file or directory" \
+    "launch $engine; /bin/cat < missing"
+  check "unwritable output file ($engine)" 1 \
+    "Cannot open file /nonexistent/f: No such file or directory" \
+    "launch $engine; /bin/echo x > /nonexistent/f"
+done
+
+check "builtin >" 0 "hi" "echo hi > f; /bin/cat f"
+check "builtin >>" 0 "b
+a" "echo b > f; echo a >> f; /bin/cat f"
+check "builtin 2>" 0 \
+  "Cannot change to directory /nonexistent: No such file or directory" \
+  "cd /nonexistent 2> e; /bin/cat e"
+check "builtin >&2 then 2>" 0 "" "echo err 2>/dev/null >&2"
+check "builtin 2> then >&2" 0 "err" "echo err >&2 2>/dev/null"
+check "builtin >&-" 0 "after" "echo hi >&-; echo after"
+check "builtin fd 3" 0 "a
+b" "printf '%s\n' a b 3> f 1>&3; /bin/cat f"
+check "builtin < is ignored" 0 "x" "echo x < /dev/null"
+check "builtin missing output directory" 1 \
+  "Cannot open file /nonexistent/f: No such file or directory" \
+  "pwd > /nonexistent/f"
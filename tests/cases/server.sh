@@ -0,0 +1,62 @@
+# --listen and --connect: the status each line sends back to the client
+
+sock="$scratch/server.sock"
+server_dir=$(pwd)
+"$shell_under_test" --listen "$sock" < /dev/null > "$scratch/server.log" 2>&1 &
+server=$!
+tries=0
+while [ ! -S "$sock" ] && [ "$tries" -lt 100 ]; do
+  sleep 0.05
+  tries=$((tries + 1))
+done
+
+check_client() {
+  # check_client name status expected-output line
+  output=$("$shell_under_test" --connect "$sock" -c "$4" 2>&1 < /dev/null)
+  report "$1" "$2" "$3" "$?" "$output"
+}
+
+check_client "external command" 0 "hi" "/bin/echo hi"
+check_client "failing external command" 1 "" "/bin/false"
+check_client "exit status of a job" 7 "" "/bin/sh -c 'exit 7'"
+check_client "unknown command" 1 "nosuchcmd file could not be executed." \
+  "nosuchcmd"
+check_client "builtin" 0 "hi" "echo hi"
+check_client "false" 1 "" "false"
+check_client "test" 1 "" "test 1 = 2"
+check_client "cd to a missing directory" 1 \
+  "Cannot change to directory /nonexistent: No such file or directory" \
+  "cd /nonexistent"
+check_client "a builtin after a failure" 0 "" "true"
+
+check_client "; runs one command after the other" 0 "first
+second" "/bin/sh -c 'sleep 0.2; echo first'; /bin/echo second"
+check_client "&& stops at a failure" 1 "" "/bin/false && /bin/echo no"
+check_client "|| goes on after one" 4 "" "/bin/false || /bin/sh -c 'exit 4'"
+check_client "loop" 1 "1
+2" "for i in 1 2; do /bin/echo \$i; done; false"
+check_client "a function defined by one line" 0 "" "greet() { echo hi \$1; }"
+check_client "is there for the next" 0 "hi you" "greet you"
+check_client "cd in a compound line stays in its copy" 0 "/" "cd /; pwd"
+check_client "the server's directory" 0 "$server_dir" "pwd"
+output=$(printf '%s\n' "/bin/false; /bin/true" "/bin/sh -c 'exit 5' || false" \
+  "/bin/echo last; /bin/sh -c 'exit 6'" |
+  "$shell_under_test" --connect "$sock" 2>&1)
+report "one reply per line" 6 "last" "$?" "$output"
+
+# a client whose job is killed from another client still gets its reply
+timeout 10 "$shell_under_test" --connect "$sock" -c "/bin/sleep 30" > /dev/null 2>&1 &
+sleeper=$!
+tries=0
+until jobs=$("$shell_under_test" --connect "$sock" -c "jobs" 2>&1) &&
+  id=$(printf '%s\n' "$jobs" | sed -n 's/^\[\([0-9]*\)\].*sleep 30$/\1/p') &&
+  [ -n "$id" ] || [ "$tries" -ge 100 ]; do
+  sleep 0.05
+  tries=$((tries + 1))
+done
+check_client "kill a client's job" 0 "" "kill %$id"
+wait "$sleeper"
+report "killed job reports to its client" 137 "" "$?" ""
+
+"$shell_under_test" --connect "$sock" -c "quit" > /dev/null 2>&1
+wait "$server"
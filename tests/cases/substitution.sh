@@ -0,0 +1,28 @@
+# $(...) command substitution
+
+check "substitution" 0 "a b c" "/bin/echo \$(/bin/echo a b) c"
+check "substitution is split into arguments" 0 "3" \
+  "/bin/echo \$(printf 'x\ny z') | wc -w"
+check "quoted substitution stays one word" 0 "a  b" \
+  "/bin/echo \"\$(/bin/echo 'a  b')\""
+check "trailing newlines are dropped" 0 "[x]" \
+  "/bin/echo [\$(printf 'x\n\n\n')]"
+check "nested substitution" 0 "inner" \
+  "/bin/echo \$(/bin/echo \$(/bin/echo inner))"
+check "substitution with a pipeline" 0 "AB" \
+  "/bin/echo \$(/bin/echo ab | tr a-z A-Z)"
+check "large substitution" 0 "50000" \
+  "/bin/echo \$(seq 50000) | wc -w"
+
+check_script "assignment takes the substitution's status" 0 "1
+3
+0" "x=\$(/bin/false)
+/bin/echo \$?
+x=\$(/bin/sh -c 'exit 3')
+/bin/echo \$?
+x=\$(/bin/true)
+/bin/echo \$?"
+check "a command's own status wins over its substitution's" 0 "" \
+  "x=\$(/bin/false) /bin/true"
+check "assignment line exits with the substitution's status" 2 "" \
+  "x=\$(/bin/sh -c 'exit 2')"
@@ -0,0 +1,18 @@
+# time in front of external commands, builtins and functions
+
+usage="
+real	NmNs
+user	NmNs
+sys	NmNs
+maxrss	N KB
+ctxsw	N voluntary, N involuntary"
+
+check_masked "time an external command" 0 "$usage" "time /bin/true"
+check_masked "time a failing command" 1 "$usage" "time /bin/false"
+check_masked "time a builtin" 0 "hi
+$usage" "time echo hi"
+check_masked "time cd" 0 "$usage
+/" "time cd /; pwd"
+check_masked "time a failing builtin" 1 "$usage" "time false"
+check_masked "time a function" 3 "in f
+$usage" "f() { echo in f; /bin/sh -c 'exit 3'; }; time f"
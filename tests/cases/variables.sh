@@ -0,0 +1,29 @@
+# shell variables, export, unset and per-command environments
+
+check_script "variable" 0 "hello world" "x=hello
+/bin/echo \$x world"
+check_script "braces" 0 "ab-c" "x=a
+/bin/echo \${x}b-c"
+check "unset variable is empty" 0 "[]" "/bin/echo [\$nosuchvar]"
+check_script "quoted variable keeps spaces" 0 "a   b" "x='a   b'
+/bin/echo \"\$x\""
+check_script "unquoted variable is split" 0 "2" "x='a   b'
+/bin/echo \$x | wc -w"
+check_script "plain variable stays out of the environment" 0 "" "x=1
+/bin/sh -c 'printf %s \"\$x\"'"
+check_script "export" 0 "1" "export x=1
+/bin/sh -c 'printf %s \"\$x\"'"
+check_script "export an existing variable" 0 "2" "x=2
+export x
+/bin/sh -c 'printf %s \"\$x\"'"
+check_script "unset" 0 "[]" "export x=1
+unset x
+/bin/sh -c 'printf [%s] \"\$x\"'"
+check_script "per-command environment" 0 "tmp
+[]" "x=tmp /bin/sh -c 'printf \"%s\n\" \"\$x\"'
+/bin/echo [\$x]"
+check "per-command environment in a pipeline" 0 "V" \
+  "x=v /bin/sh -c 'printf %s \"\$x\"' | tr a-z A-Z"
+check_script "export listing" 0 "export ONLY=\"this\"" "export ONLY=this
+export | grep ONLY="
+check "export of a bad name" 1 "export: 1x=2: not a valid name" "export 1x=2"
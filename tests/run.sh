@@ -0,0 +1,69 @@
+#!/bin/sh
+# End-to-end tests for the shell: every case runs a command line with
+# shell -c, or a script file, and checks what it printed on stdout and
+# stderr together and the exit status it ended with.
+#
+# Usage: tests/run.sh [shell]   (make test, or TEST_SHELL=... make test)
+#
+# The cases are in tests/cases/*.sh, one file per feature. They run in a
+# scratch directory that is removed afterwards, with no rc file and a
+# throwaway history.
+
+shell_under_test=$(cd "$(dirname "${1:-./shell}")" && pwd)/$(basename "${1:-./shell}")
+cases=$(cd "$(dirname "$0")/cases" && pwd)
+scratch=$(mktemp -d /tmp/cshell-test-XXXXXX)
+trap 'rm -rf "$scratch"' EXIT
+export CSHELL_RC=
+export CSHELL_HISTORY="$scratch/.history"
+passed=0
+failed=0
+
+report() {
+  # name, expected status, expected output, actual status, actual output
+  if [ "$2" = "$4" ] && [ "$3" = "$5" ]; then
+    passed=$((passed + 1))
+  else
+    failed=$((failed + 1))
+    printf 'FAIL %s\n  expected status %s, output:\n%s\n  got status %s, output:\n%s\n' \
+      "$1" "$2" "$3" "$4" "$5"
+  fi
+}
+
+check() {
+  # check name status expected-output command-line
+  output=$(cd "$scratch/work" && "$shell_under_test" -c "$4" 2>&1 < /dev/null)
+  report "$1" "$2" "$3" "$?" "$output"
+}
+
+check_masked() {
+  # like check, with every number in the output turned into N, for timings
+  output=$(cd "$scratch/work" && "$shell_under_test" -c "$4" 2>&1 < /dev/null)
+  status=$?
+  report "$1" "$2" "$3" "$status" "$(printf '%s\n' "$output" | sed 's/[0-9][0-9.]*/N/g')"
+}
+
+check_script() {
+  # check_script name status expected-output script-text
+  printf '%s\n' "$4" > "$scratch/script"
+  output=$(cd "$scratch/work" && "$shell_under_test" "$scratch/script" 2>&1 < /dev/null)
+  report "$1" "$2" "$3" "$?" "$output"
+}
+
+check_session() {
+  # check_session name status expected-output lines
+  # the lines are typed at the prompt of an interactive shell, which is
+  # left out of the output
+  output=$(cd "$scratch/work" && printf '%s\n' "$4" | "$shell_under_test" 2>&1)
+  status=$?
+  report "$1" "$2" "$3" "$status" "$(printf '%s\n' "$output" | sed 's/prompt > //g')"
+}
+
+for file in "$cases"/*.sh; do
+  # each file starts in an empty directory of its own
+  rm -rf "$scratch/work"
+  mkdir "$scratch/work"
+  . "$file"
+done
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]